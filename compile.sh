@@ -2,7 +2,7 @@
 
 DIR=$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )
 NUM_CPUS="$(getconf _NPROCESSORS_ONLN)"
-TARGETS="LearnedSort_bench_real LearnedSort_bench_synth LearnedSort_tests"
+TARGETS="LearnedSort_bench_real LearnedSort_bench_synth LearnedSort_bench_records LearnedSort_bench_tuning LearnedSort_tests"
 
 cd ${DIR}
 
@@ -0,0 +1,127 @@
+#pragma once
+
+/**
+ * @file cache_info.h
+ * @brief Detection of the sizes of the data caches of the host, which are used
+ * for sizing the fragments of the partitioning to fit the caches.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace learned_sort {
+namespace utils {
+
+// The sizes in bytes of the data caches that are private to a core (L1d and L2)
+// and of the last-level cache
+struct cache_sizes {
+  long l1d;
+  long l2;
+  long l3;
+
+  // The sizes assumed when the caches cannot be detected
+  static constexpr long DEFAULT_L1D = 32 << 10;
+  static constexpr long DEFAULT_L2 = 256 << 10;
+  static constexpr long DEFAULT_L3 = 8 << 20;
+};
+
+// Reads a sysfs attribute of the caches of the first CPU. Returns an empty
+// string if the attribute does not exist.
+inline std::string read_cache_attribute(int index, const char *attribute) {
+  std::string path = "/sys/devices/system/cpu/cpu0/cache/index" +
+                     std::to_string(index) + "/" + attribute;
+  FILE *file = std::fopen(path.c_str(), "r");
+  if (!file) return "";
+
+  char buf[64] = {0};
+  if (!std::fgets(buf, sizeof(buf), file)) buf[0] = '\0';
+  std::fclose(file);
+
+  std::string value(buf);
+  while (!value.empty() && (value.back() == '\n' || value.back() == ' ')) {
+    value.pop_back();
+  }
+  return value;
+}
+
+// Reads the cache sizes from sysfs (Linux). The sizes that are not found are
+// left untouched.
+inline void read_sysfs_cache_sizes(cache_sizes &sizes) {
+  for (int index = 0;; ++index) {
+    std::string level = read_cache_attribute(index, "level");
+    if (level.empty()) break;
+
+    std::string type = read_cache_attribute(index, "type");
+    std::string size = read_cache_attribute(index, "size");
+    if (type == "Instruction" || size.empty()) continue;
+
+    // The sizes are formatted as "48K", "2048K" or "300M"
+    long bytes = std::atol(size.c_str());
+    if (size.back() == 'K') bytes <<= 10;
+    if (size.back() == 'M') bytes <<= 20;
+    if (bytes <= 0) continue;
+
+    if (level == "1") sizes.l1d = bytes;
+    if (level == "2") sizes.l2 = bytes;
+    if (level == "3") sizes.l3 = bytes;
+  }
+}
+
+// Reads the cache sizes from the deterministic cache parameters of cpuid
+// (leaf 4 on Intel, leaf 0x8000001D on AMD). The sizes that are not found are
+// left untouched.
+inline void read_cpuid_cache_sizes(cache_sizes &sizes) {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) return;
+  const bool is_amd = ebx == 0x68747541;  // "Auth" of "AuthenticAMD"
+  const unsigned leaf = is_amd ? 0x8000001D : 4;
+  if (is_amd ? __get_cpuid_max(0x80000000, nullptr) < leaf : eax < leaf) {
+    return;
+  }
+
+  for (unsigned subleaf = 0;; ++subleaf) {
+    __cpuid_count(leaf, subleaf, eax, ebx, ecx, edx);
+    unsigned type = eax & 0x1f;
+    if (type == 0) break;     // No more caches
+    if (type == 2) continue;  // Instruction cache
+
+    long ways = ((ebx >> 22) & 0x3ff) + 1;
+    long partitions = ((ebx >> 12) & 0x3ff) + 1;
+    long line_sz = (ebx & 0xfff) + 1;
+    long sets = static_cast<long>(ecx) + 1;
+    long bytes = ways * partitions * line_sz * sets;
+
+    unsigned level = (eax >> 5) & 0x7;
+    if (level == 1) sizes.l1d = bytes;
+    if (level == 2) sizes.l2 = bytes;
+    if (level == 3) sizes.l3 = bytes;
+  }
+#endif
+}
+
+// Returns the cache sizes of the host, which are detected once, on the first
+// call. The sizes are read from sysfs, then from cpuid, and the defaults are
+// used for the ones that could not be detected.
+inline const cache_sizes &get_cache_sizes() {
+  static const cache_sizes sizes = [] {
+    cache_sizes detected{0, 0, 0};
+    read_sysfs_cache_sizes(detected);
+    if (!detected.l1d || !detected.l2) {
+      read_cpuid_cache_sizes(detected);
+    }
+    if (!detected.l1d) detected.l1d = cache_sizes::DEFAULT_L1D;
+    if (!detected.l2) detected.l2 = cache_sizes::DEFAULT_L2;
+    if (!detected.l3) detected.l3 = cache_sizes::DEFAULT_L3;
+    return detected;
+  }();
+  return sizes;
+}
+
+}  // namespace utils
+}  // namespace learned_sort
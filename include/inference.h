@@ -0,0 +1,451 @@
+#pragma once
+
+/**
+ * @file inference.h
+ * @brief Batched inference of the RMI, which predicts the buckets of several
+ * keys at once using AVX2 or AVX-512 instructions when they are available.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <type_traits>
+
+#include "utils.h"
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace learned_sort {
+namespace internal {
+
+// How the leaf model of a key is found in a flat view of a CDF model
+enum class leaf_routing {
+  // The root model predicts the leaf model
+  ROOT,
+
+  // The root model predicts a middle model, which predicts the leaf model
+  MIDDLE_LAYER,
+
+  // The leaf model is searched by the starts of the leaves, within the range
+  // given by the radix table when there is one
+  SEARCH
+};
+
+// A flat view over the parameters of a trained RMI, which is shared by the
+// sorting routines that operate on separate parts of the input
+struct flat_rmi {
+  double root_slope;
+  double root_intercept;
+  long num_leaf_models;
+  const double *slopes;
+  const double *intercepts;
+
+  // The bases of the models split by utils::split_key, for the keys that the
+  // models take as offsets. The leaf bases are null for the other keys.
+  double root_base_hi;
+  double root_base_lo;
+  const double *base_hi;
+  const double *base_lo;
+
+  // How the leaf model of a key is found. The middle models take the input of
+  // the root model, like the starts of the leaves and the radix table do.
+  leaf_routing routing = leaf_routing::ROOT;
+  long num_mid_models = 0;
+  const double *mid_slopes = nullptr;
+  const double *mid_intercepts = nullptr;
+  const double *leaf_starts = nullptr;
+  const long *radix_table = nullptr;
+  long num_radix_buckets = 0;
+  double radix_min = 0;
+  double radix_scale = 0;
+};
+
+// Maps a predicted CDF to a bucket index, which is computed as
+// clamp(cdf * scale + shift, 0, max_bucket_idx)
+struct bucket_map {
+  double scale;
+  double shift;
+  double max_bucket_idx;
+};
+
+// Computes a * b + c. A fused multiply-add is used whenever the vector kernels
+// use one, so that the scalar and the batched predictions are bit-identical.
+inline double mul_add(double a, double b, double c) {
+#ifdef __FMA__
+  return std::fma(a, b, c);
+#else
+  return a * b + c;
+#endif
+}
+
+// Clamps x to [0, hi], where NaNs are clamped to hi like the vector kernels do
+inline double clamp_idx(double x, double hi) {
+  return std::max(0., std::min(hi, x));
+}
+
+// Computes the offset of a split key from a split base key. The offset is
+// rounded only once, so it is exact when it fits in the mantissa of a double.
+inline double split_offset(double hi, double lo, double base_hi,
+                           double base_lo) {
+  return mul_add(hi - base_hi, 4294967296., lo - base_lo);
+}
+
+// Returns the input of the root model for a key
+template <class T>
+inline double root_input(const flat_rmi &model, const T &key) {
+  if constexpr (utils::uses_key_offsets<T>) {
+    double hi, lo;
+    utils::split_key(key, hi, lo);
+    return split_offset(hi, lo, model.root_base_hi, model.root_base_lo);
+  } else {
+    return static_cast<double>(key);
+  }
+}
+
+// Returns the input of the given leaf model for a key
+template <class T>
+inline double leaf_input(const flat_rmi &model, long leaf_idx, const T &key) {
+  if constexpr (utils::uses_key_offsets<T>) {
+    double hi, lo;
+    utils::split_key(key, hi, lo);
+    return split_offset(hi, lo, model.base_hi[leaf_idx],
+                        model.base_lo[leaf_idx]);
+  } else {
+    return static_cast<double>(key);
+  }
+}
+
+// Finds the last leaf model that starts at or before a root input, or the
+// first leaf model when there is none. The binary search halves the range
+// with conditional moves, since its branches would be mispredicted for about
+// half of the keys.
+inline long search_leaf(const flat_rmi &model, double x) {
+  long first = 0;
+  long len = model.num_leaf_models;
+  if (model.num_radix_buckets > 0) {
+    long radix_bucket =
+        static_cast<long>(clamp_idx((x - model.radix_min) * model.radix_scale,
+                                    model.num_radix_buckets - 1.));
+    first = model.radix_table[radix_bucket];
+    len = model.radix_table[radix_bucket + 1] - first;
+    if (len == 0) return std::max(0L, first - 1);
+  }
+  while (len > 1) {
+    long half = len / 2;
+    first = model.leaf_starts[first + half] <= x ? first + half : first;
+    len -= half;
+  }
+  return std::max(0L, first - (model.leaf_starts[first] > x));
+}
+
+// Predicts the index of the leaf model of a key
+template <class T>
+inline long predict_leaf(const flat_rmi &model, const T &key) {
+  const double x = root_input(model, key);
+  switch (model.routing) {
+    case leaf_routing::MIDDLE_LAYER: {
+      long mid_idx = static_cast<long>(
+          clamp_idx(mul_add(model.root_slope, x, model.root_intercept),
+                    model.num_mid_models - 1.));
+      return static_cast<long>(
+          clamp_idx(mul_add(model.mid_slopes[mid_idx], x,
+                            model.mid_intercepts[mid_idx]),
+                    model.num_leaf_models - 1.));
+    }
+    case leaf_routing::SEARCH:
+      return search_leaf(model, x);
+    default:
+      return static_cast<long>(
+          clamp_idx(mul_add(model.root_slope, x, model.root_intercept),
+                    model.num_leaf_models - 1.));
+  }
+}
+
+// Predicts the bucket of a key using the given leaf model
+template <class T>
+inline long predict_bucket_in_leaf(const flat_rmi &model, long leaf_idx,
+                                   const bucket_map &map, const T &key) {
+  double pred_cdf = mul_add(model.slopes[leaf_idx],
+                            leaf_input(model, leaf_idx, key),
+                            model.intercepts[leaf_idx]);
+  return static_cast<long>(
+      clamp_idx(mul_add(pred_cdf, map.scale, map.shift), map.max_bucket_idx));
+}
+
+// Predicts the bucket of a key by traversing the RMI
+template <class T>
+inline long predict_bucket(const flat_rmi &model, const bucket_map &map,
+                           const T &key) {
+  return predict_bucket_in_leaf(model, predict_leaf(model, key), map, key);
+}
+
+#if defined(__AVX512F__)
+
+// The number of keys whose buckets are predicted by one vector instruction
+static constexpr long INFERENCE_VECTOR_WIDTH = 8;
+
+// Predicts the buckets of INFERENCE_VECTOR_WIDTH keys. When fixed_leaf_idx is
+// not negative, that leaf model is used instead of traversing the RMI. When
+// SplitKeys is set, keys and keys_lo hold the keys split by utils::split_key,
+// and the models take their offsets from the bases of the models.
+template <bool SplitKeys>
+inline void predict_vector(const flat_rmi &model, long fixed_leaf_idx,
+                           const bucket_map &map, const double *keys,
+                           const double *keys_lo, long *pred_buckets) {
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d two_32 = _mm512_set1_pd(4294967296.);
+  __m512d x = _mm512_loadu_pd(keys);
+  __m512d x_lo = SplitKeys ? _mm512_loadu_pd(keys_lo) : zero;
+
+  __m512d slopes, intercepts, base_hi, base_lo;
+  if (fixed_leaf_idx < 0) {
+    __m512d root_x = x;
+    if constexpr (SplitKeys) {
+      root_x = _mm512_fmadd_pd(
+          _mm512_sub_pd(x, _mm512_set1_pd(model.root_base_hi)), two_32,
+          _mm512_sub_pd(x_lo, _mm512_set1_pd(model.root_base_lo)));
+    }
+    __m512d leaf = _mm512_fmadd_pd(_mm512_set1_pd(model.root_slope), root_x,
+                                   _mm512_set1_pd(model.root_intercept));
+    if (model.routing == leaf_routing::MIDDLE_LAYER) {
+      __m512d mid = _mm512_max_pd(
+          _mm512_min_pd(leaf, _mm512_set1_pd(model.num_mid_models - 1.)),
+          zero);
+      __m256i mid_idx = _mm512_cvttpd_epi32(mid);
+      leaf = _mm512_fmadd_pd(
+          _mm512_i32gather_pd(mid_idx, model.mid_slopes, sizeof(double)),
+          root_x,
+          _mm512_i32gather_pd(mid_idx, model.mid_intercepts, sizeof(double)));
+    }
+    leaf = _mm512_max_pd(
+        _mm512_min_pd(leaf, _mm512_set1_pd(model.num_leaf_models - 1.)), zero);
+    __m256i leaf_idx = _mm512_cvttpd_epi32(leaf);
+    slopes = _mm512_i32gather_pd(leaf_idx, model.slopes, sizeof(double));
+    intercepts =
+        _mm512_i32gather_pd(leaf_idx, model.intercepts, sizeof(double));
+    if constexpr (SplitKeys) {
+      base_hi = _mm512_i32gather_pd(leaf_idx, model.base_hi, sizeof(double));
+      base_lo = _mm512_i32gather_pd(leaf_idx, model.base_lo, sizeof(double));
+    }
+  } else {
+    slopes = _mm512_set1_pd(model.slopes[fixed_leaf_idx]);
+    intercepts = _mm512_set1_pd(model.intercepts[fixed_leaf_idx]);
+    if constexpr (SplitKeys) {
+      base_hi = _mm512_set1_pd(model.base_hi[fixed_leaf_idx]);
+      base_lo = _mm512_set1_pd(model.base_lo[fixed_leaf_idx]);
+    }
+  }
+
+  if constexpr (SplitKeys) {
+    x = _mm512_fmadd_pd(_mm512_sub_pd(x, base_hi), two_32,
+                        _mm512_sub_pd(x_lo, base_lo));
+  }
+  __m512d pred_cdf = _mm512_fmadd_pd(slopes, x, intercepts);
+  __m512d bucket = _mm512_fmadd_pd(pred_cdf, _mm512_set1_pd(map.scale),
+                                   _mm512_set1_pd(map.shift));
+  bucket = _mm512_max_pd(
+      _mm512_min_pd(bucket, _mm512_set1_pd(map.max_bucket_idx)), zero);
+  _mm512_storeu_si512(pred_buckets,
+                      _mm512_cvtepi32_epi64(_mm512_cvttpd_epi32(bucket)));
+}
+
+#elif defined(__AVX2__)
+
+// The number of keys whose buckets are predicted by one vector instruction
+static constexpr long INFERENCE_VECTOR_WIDTH = 4;
+
+// Predicts the buckets of INFERENCE_VECTOR_WIDTH keys. When fixed_leaf_idx is
+// not negative, that leaf model is used instead of traversing the RMI. When
+// SplitKeys is set, keys and keys_lo hold the keys split by utils::split_key,
+// and the models take their offsets from the bases of the models.
+template <bool SplitKeys>
+inline void predict_vector(const flat_rmi &model, long fixed_leaf_idx,
+                           const bucket_map &map, const double *keys,
+                           const double *keys_lo, long *pred_buckets) {
+#ifdef __FMA__
+#define LS_MUL_ADD_PD(a, b, c) _mm256_fmadd_pd(a, b, c)
+#else
+#define LS_MUL_ADD_PD(a, b, c) _mm256_add_pd(_mm256_mul_pd(a, b), c)
+#endif
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d two_32 = _mm256_set1_pd(4294967296.);
+  __m256d x = _mm256_loadu_pd(keys);
+  __m256d x_lo = SplitKeys ? _mm256_loadu_pd(keys_lo) : zero;
+
+  __m256d slopes, intercepts, base_hi, base_lo;
+  if (fixed_leaf_idx < 0) {
+    __m256d root_x = x;
+    if constexpr (SplitKeys) {
+      root_x = LS_MUL_ADD_PD(
+          _mm256_sub_pd(x, _mm256_set1_pd(model.root_base_hi)), two_32,
+          _mm256_sub_pd(x_lo, _mm256_set1_pd(model.root_base_lo)));
+    }
+    __m256d leaf = LS_MUL_ADD_PD(_mm256_set1_pd(model.root_slope), root_x,
+                                 _mm256_set1_pd(model.root_intercept));
+    if (model.routing == leaf_routing::MIDDLE_LAYER) {
+      __m256d mid = _mm256_max_pd(
+          _mm256_min_pd(leaf, _mm256_set1_pd(model.num_mid_models - 1.)),
+          zero);
+      __m128i mid_idx = _mm256_cvttpd_epi32(mid);
+      leaf = LS_MUL_ADD_PD(
+          _mm256_i32gather_pd(model.mid_slopes, mid_idx, sizeof(double)),
+          root_x,
+          _mm256_i32gather_pd(model.mid_intercepts, mid_idx, sizeof(double)));
+    }
+    leaf = _mm256_max_pd(
+        _mm256_min_pd(leaf, _mm256_set1_pd(model.num_leaf_models - 1.)), zero);
+    __m128i leaf_idx = _mm256_cvttpd_epi32(leaf);
+    slopes = _mm256_i32gather_pd(model.slopes, leaf_idx, sizeof(double));
+    intercepts = _mm256_i32gather_pd(model.intercepts, leaf_idx, sizeof(double));
+    if constexpr (SplitKeys) {
+      base_hi = _mm256_i32gather_pd(model.base_hi, leaf_idx, sizeof(double));
+      base_lo = _mm256_i32gather_pd(model.base_lo, leaf_idx, sizeof(double));
+    }
+  } else {
+    slopes = _mm256_set1_pd(model.slopes[fixed_leaf_idx]);
+    intercepts = _mm256_set1_pd(model.intercepts[fixed_leaf_idx]);
+    if constexpr (SplitKeys) {
+      base_hi = _mm256_set1_pd(model.base_hi[fixed_leaf_idx]);
+      base_lo = _mm256_set1_pd(model.base_lo[fixed_leaf_idx]);
+    }
+  }
+
+  if constexpr (SplitKeys) {
+    x = LS_MUL_ADD_PD(_mm256_sub_pd(x, base_hi), two_32,
+                      _mm256_sub_pd(x_lo, base_lo));
+  }
+  __m256d pred_cdf = LS_MUL_ADD_PD(slopes, x, intercepts);
+  __m256d bucket = LS_MUL_ADD_PD(pred_cdf, _mm256_set1_pd(map.scale),
+                                 _mm256_set1_pd(map.shift));
+  bucket = _mm256_max_pd(
+      _mm256_min_pd(bucket, _mm256_set1_pd(map.max_bucket_idx)), zero);
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(pred_buckets),
+                      _mm256_cvtepi32_epi64(_mm256_cvttpd_epi32(bucket)));
+#undef LS_MUL_ADD_PD
+}
+
+#else
+
+// Without vector instructions, the buckets are predicted one key at a time
+static constexpr long INFERENCE_VECTOR_WIDTH = 1;
+
+template <bool SplitKeys>
+inline void predict_vector(const flat_rmi &model, long fixed_leaf_idx,
+                           const bucket_map &map, const double *keys,
+                           const double *keys_lo, long *pred_buckets) {
+  double root_x = keys[0];
+  if constexpr (SplitKeys) {
+    root_x = split_offset(keys[0], keys_lo[0], model.root_base_hi,
+                          model.root_base_lo);
+  }
+  long leaf_idx = fixed_leaf_idx;
+  if (fixed_leaf_idx < 0) {
+    double leaf = mul_add(model.root_slope, root_x, model.root_intercept);
+    if (model.routing == leaf_routing::MIDDLE_LAYER) {
+      long mid_idx =
+          static_cast<long>(clamp_idx(leaf, model.num_mid_models - 1.));
+      leaf = mul_add(model.mid_slopes[mid_idx], root_x,
+                     model.mid_intercepts[mid_idx]);
+    }
+    leaf_idx = static_cast<long>(clamp_idx(leaf, model.num_leaf_models - 1.));
+  }
+
+  double x = keys[0];
+  if constexpr (SplitKeys) {
+    x = split_offset(keys[0], keys_lo[0], model.base_hi[leaf_idx],
+                     model.base_lo[leaf_idx]);
+  }
+  double pred_cdf =
+      mul_add(model.slopes[leaf_idx], x, model.intercepts[leaf_idx]);
+  pred_buckets[0] = static_cast<long>(
+      clamp_idx(mul_add(pred_cdf, map.scale, map.shift), map.max_bucket_idx));
+}
+
+#endif
+
+// The number of keys whose buckets are predicted in one batch
+static constexpr long INFERENCE_BATCH_SZ = 16;
+
+/**
+ * @brief Predicts the buckets of a sequence of keys. The keys are converted to
+ * double-precision and processed INFERENCE_VECTOR_WIDTH at a time, using
+ * gathers for the parameters of the middle and leaf models and vector min/max
+ * for the clamping. The leaf models that are searched are found one key at a
+ * time. The keys that the models take as offsets are split into two
+ * doubles, whose offsets from the bases of the models are computed exactly.
+ * The predictions are identical to the ones of predict_bucket().
+ *
+ * @param keys Random-access iterator to the first key.
+ * @param num_keys The number of keys.
+ * @param model The parameters of the trained CDF model.
+ * @param fixed_leaf_idx The leaf model to use for all the keys, or -1 to
+ * traverse the RMI for each key.
+ * @param map The mapping of the predicted CDFs to bucket indices.
+ * @param pred_buckets Output array of num_keys elements.
+ * @param key_of Extracts the numerical key of each record.
+ */
+template <class RandomIt, class KeyOf = utils::identity_key>
+void predict_buckets(RandomIt keys, long num_keys, const flat_rmi &model,
+                     long fixed_leaf_idx, const bucket_map &map,
+                     long *pred_buckets, const KeyOf &key_of = KeyOf()) {
+  // The vector kernels convert the bucket indices through 32-bit integers, and
+  // they do not search the leaf models
+  if (INFERENCE_VECTOR_WIDTH == 1 || map.max_bucket_idx > INT_MAX ||
+      model.num_leaf_models > INT_MAX ||
+      (fixed_leaf_idx < 0 && model.routing == leaf_routing::SEARCH)) {
+    for (long elm_idx = 0; elm_idx < num_keys; ++elm_idx) {
+      const auto &key = key_of(keys[elm_idx]);
+      long leaf_idx =
+          fixed_leaf_idx < 0 ? predict_leaf(model, key) : fixed_leaf_idx;
+      pred_buckets[elm_idx] = predict_bucket_in_leaf(model, leaf_idx, map, key);
+    }
+    return;
+  }
+
+  // Converts a key to the doubles that the vector kernels take
+  typedef std::decay_t<decltype(key_of(keys[0]))> K;
+  constexpr bool SPLIT_KEYS = utils::uses_key_offsets<K>;
+  double batch[INFERENCE_BATCH_SZ];
+  double batch_lo[INFERENCE_BATCH_SZ];
+  auto load_key = [&](long k, const K &key) {
+    if constexpr (SPLIT_KEYS) {
+      utils::split_key(key, batch[k], batch_lo[k]);
+    } else {
+      batch[k] = static_cast<double>(key);
+    }
+  };
+
+  long elm_idx = 0;
+  for (; elm_idx + INFERENCE_BATCH_SZ <= num_keys;
+       elm_idx += INFERENCE_BATCH_SZ) {
+    for (long k = 0; k < INFERENCE_BATCH_SZ; ++k) {
+      load_key(k, key_of(keys[elm_idx + k]));
+    }
+    for (long k = 0; k < INFERENCE_BATCH_SZ; k += INFERENCE_VECTOR_WIDTH) {
+      predict_vector<SPLIT_KEYS>(model, fixed_leaf_idx, map, batch + k,
+                                 batch_lo + k, pred_buckets + elm_idx + k);
+    }
+  }
+
+  // Predict the remaining keys by padding the last vector with copies of the
+  // last key
+  if (elm_idx < num_keys) {
+    long num_remaining = num_keys - elm_idx;
+    long num_padded = (num_remaining + INFERENCE_VECTOR_WIDTH - 1) /
+                      INFERENCE_VECTOR_WIDTH * INFERENCE_VECTOR_WIDTH;
+    for (long k = 0; k < num_padded; ++k) {
+      load_key(k, key_of(keys[elm_idx + std::min(k, num_remaining - 1)]));
+    }
+    long tail[INFERENCE_BATCH_SZ];
+    for (long k = 0; k < num_remaining; k += INFERENCE_VECTOR_WIDTH) {
+      predict_vector<SPLIT_KEYS>(model, fixed_leaf_idx, map, batch + k,
+                                 batch_lo + k, tail + k);
+    }
+    std::copy(tail, tail + num_remaining, pred_buckets + elm_idx);
+  }
+}
+
+}  // namespace internal
+}  // namespace learned_sort
@@ -23,11 +23,26 @@
  */
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cmath>
+#include <cstddef>
+#include <functional>
 #include <iterator>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <ranges>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
+#include "cache_info.h"
+#include "inference.h"
 #include "rmi.h"
+#include "sort_stats.h"
+#include "task_pool.h"
 #include "utils.h"
 
 using namespace std;
@@ -36,15 +51,1506 @@ using namespace learned_sort;
 namespace learned_sort {
 
 // Parameters
-static constexpr int PRIMARY_FANOUT = 1000;
-static constexpr int SECONDARY_FANOUT = 100;
-static constexpr int PRIMARY_FRAGMENT_CAPACITY = 100;
-static constexpr int SECONDARY_FRAGMENT_CAPACITY = 100;
 static constexpr int REP_CNT_THRESHOLD = 5;
+static constexpr double HEAVY_KEYS_MIN_SHARE = .5;
+static constexpr int TASKS_PER_THREAD = 8;
+static constexpr int PREFETCH_DISTANCE = 16;
+static constexpr long TOUCH_UP_MAX_DISPLACEMENT = 1024;
+static constexpr long TOUCH_UP_MOVES_PER_KEY = 32;
+static constexpr double DEFAULT_DRIFT_TOLERANCE = 4;
+static constexpr double DRIFT_MIN_BUCKET_IMBALANCE = .05;
+static constexpr double DRIFT_MIN_RATE = .02;
 
-template <class RandomIt>
-void sort(RandomIt begin, RandomIt end,
-          TwoLayerRMI<typename iterator_traits<RandomIt>::value_type> &rmi) {
+/**
+ * @brief Measures of how well a CDF model fits the input that it sorted, which
+ * are taken during the sort at the cost of a pass over the primary bucket
+ * sizes. A model that is reused on later inputs has drifted when these grow
+ * well beyond the values measured on the input that it was trained on.
+ */
+struct model_drift {
+  // The relative variance of the primary bucket sizes in excess of that of a
+  // perfect model on a random input (as in
+  // TwoLayerRMI::estimate_bucket_imbalance)
+  double bucket_imbalance = 0;
+
+  // The size of the largest primary bucket relative to the expected size
+  double max_bucket_ratio = 0;
+
+  // The share of the keys that overflowed their buckets in the out-of-place
+  // partitioning and were spilled
+  double spill_rate = 0;
+
+  // The share of the touched up buckets whose bounded insertion sort gave up
+  // and that were sorted from scratch
+  double touch_up_fallback_rate = 0;
+
+  // Whether the measures exceed the tolerance over the baseline of the model
+  bool drifted = false;
+
+  /**
+   * @brief Checks whether these measures show that the model has drifted from
+   * the input that it was trained on.
+   *
+   * @param baseline The measures taken on the input that the model was trained
+   * on.
+   * @param tolerance How many times larger than the baseline the measures may
+   * grow, on top of the small absolute margins DRIFT_MIN_BUCKET_IMBALANCE and
+   * DRIFT_MIN_RATE that absorb the noise of the measures.
+   * @return Whether the model has drifted.
+   */
+  bool exceeds(const model_drift &baseline, double tolerance) const {
+    return bucket_imbalance > tolerance * baseline.bucket_imbalance +
+                                  DRIFT_MIN_BUCKET_IMBALANCE ||
+           spill_rate > tolerance * baseline.spill_rate + DRIFT_MIN_RATE ||
+           touch_up_fallback_rate >
+               tolerance * baseline.touch_up_fallback_rate + DRIFT_MIN_RATE;
+  }
+};
+
+/**
+ * @brief The fanouts and the fragment capacities of the two rounds of
+ * partitioning. They are compile-time constants of the sorting routines, so
+ * that the bucket arithmetic and the fragment moves can be specialized for
+ * them.
+ *
+ * @tparam PrimaryFanout The number of primary buckets
+ * @tparam SecondaryFanout The number of secondary buckets in each primary
+ * bucket
+ * @tparam PrimaryFragmentCapacity The number of keys in a primary fragment
+ * @tparam SecondaryFragmentCapacity The number of keys in a secondary fragment
+ */
+template <long PrimaryFanout, long SecondaryFanout,
+          long PrimaryFragmentCapacity, long SecondaryFragmentCapacity>
+struct partitioning_config {
+  static constexpr long PRIMARY_FANOUT = PrimaryFanout;
+  static constexpr long SECONDARY_FANOUT = SecondaryFanout;
+  static constexpr long PRIMARY_FRAGMENT_CAPACITY = PrimaryFragmentCapacity;
+  static constexpr long SECONDARY_FRAGMENT_CAPACITY = SecondaryFragmentCapacity;
+};
+
+// The configuration of the original LearnedSort algorithm
+typedef partitioning_config<1000, 100, 100, 100> default_config;
+
+// A list of partitioning configurations
+template <class... Configs>
+struct config_list {};
+
+/**
+ * @brief The configurations that were tuned for keys of KeySz bytes. Inputs of
+ * fewer than LARGE_INPUT_SZ keys are sorted with small_input_config. Larger
+ * inputs are sorted with the first of large_input_configs whose fragments fit
+ * in the caches of the host, or with the last one if none of them fits. The
+ * primary fragments need to fit in half of the L2 cache, which leaves room for
+ * the keys that are streamed through it, and the secondary fragments need to
+ * fit in the L1d cache.
+ *
+ * @tparam KeySz The size of the keys in bytes
+ */
+template <size_t KeySz>
+struct tuned_configs {
+  typedef default_config small_input_config;
+  typedef config_list<default_config> large_input_configs;
+  static constexpr long LARGE_INPUT_SZ = 0;
+};
+
+// 4-byte keys. The primary fragments of large inputs take 1MB, 512KB or 256KB.
+template <>
+struct tuned_configs<4> {
+  typedef partitioning_config<500, 50, 128, 128> small_input_config;
+  typedef config_list<partitioning_config<1000, 50, 256, 128>,
+                      partitioning_config<1000, 50, 128, 128>,
+                      partitioning_config<500, 50, 128, 64>>
+      large_input_configs;
+  static constexpr long LARGE_INPUT_SZ = 4e6;
+};
+
+// 8-byte keys. The primary fragments of large inputs take 1MB, 512KB or 256KB.
+template <>
+struct tuned_configs<8> {
+  typedef partitioning_config<500, 50, 128, 128> small_input_config;
+  typedef config_list<partitioning_config<500, 50, 256, 64>,
+                      partitioning_config<500, 50, 128, 64>,
+                      partitioning_config<250, 50, 128, 32>>
+      large_input_configs;
+  static constexpr long LARGE_INPUT_SZ = 4e6;
+};
+
+// The type of the numerical keys that KeyOf extracts from the records that
+// RandomIt points to
+template <class RandomIt, class KeyOf>
+using key_type_t = std::decay_t<std::invoke_result_t<
+    const KeyOf &, typename iterator_traits<RandomIt>::reference>>;
+
+namespace internal {
+
+// Compares two records by the keys that key_of extracts from them
+template <class KeyOf>
+struct key_less {
+  const KeyOf &key_of;
+
+  template <class R>
+  bool operator()(const R &a, const R &b) const {
+    return key_of(a) < key_of(b);
+  }
+};
+
+// Whether the fragments of a configuration fit in the given caches when they
+// hold keys of type T
+template <class T, class Config>
+bool fits_in_caches(const utils::cache_sizes &caches) {
+  long primary_fragments_sz = sizeof(T) * Config::PRIMARY_FANOUT *
+                              Config::PRIMARY_FRAGMENT_CAPACITY;
+  long secondary_fragments_sz = sizeof(T) * Config::SECONDARY_FANOUT *
+                                Config::SECONDARY_FRAGMENT_CAPACITY;
+  return primary_fragments_sz <= caches.l2 / 2 &&
+         secondary_fragments_sz <= caches.l1d;
+}
+
+// Calls fn with the first configuration of the list that fits in the caches,
+// or with the last one if none of them fits
+template <class T, class Config, class... Fallbacks, class Fn>
+void with_fitting_config(config_list<Config, Fallbacks...>,
+                         const utils::cache_sizes &caches, Fn &&fn) {
+  if constexpr (sizeof...(Fallbacks) > 0) {
+    if (!fits_in_caches<T, Config>(caches)) {
+      with_fitting_config<T>(config_list<Fallbacks...>(), caches, fn);
+      return;
+    }
+  }
+  fn(Config());
+}
+
+// Calls fn with a default-constructed instance of the configuration that was
+// tuned for input_sz keys of type T and for the caches of the host
+template <class T, class Fn>
+void with_tuned_config(long input_sz, Fn &&fn) {
+  typedef tuned_configs<sizeof(T)> configs;
+  if (input_sz < configs::LARGE_INPUT_SZ) {
+    fn(typename configs::small_input_config());
+  } else {
+    with_fitting_config<T>(typename configs::large_input_configs(),
+                           utils::get_cache_sizes(), fn);
+  }
+}
+
+// Scratch memory for sorting the primary buckets, which is allocated once and
+// reused by every bucket, so that the secondary partitioning and the
+// model-based counting sort do not allocate memory per bucket. A scratch
+// arena must only be used by one thread at a time.
+template <class T, class Config>
+class secondary_scratch {
+ public:
+  // The auxiliary fragments of the secondary partitioning
+  T (*fragments)[Config::SECONDARY_FRAGMENT_CAPACITY];
+
+  // Swap space for the defragmentation
+  T *swap_buffer;
+
+  // The predicted positions, the counts, and the output of the model-based
+  // counting sort, with room for `capacity` keys each
+  long *pred_cache_cs;
+  long *cnt_hist;
+  T *tmp;
+  long capacity;
+
+  // The sizes of the sub-buckets of a primary bucket that is split around its
+  // heavy keys
+  vector<long> sub_bucket_sizes;
+
+  // The number of buckets that were touched up, and the number of those that
+  // had to be sorted from scratch, since the counters were last reset
+  long touched_up_buckets;
+  long touch_up_fallbacks;
+
+  secondary_scratch()
+      : fragments(new T[Config::SECONDARY_FANOUT]
+                       [Config::SECONDARY_FRAGMENT_CAPACITY]),
+        swap_buffer(new T[Config::SECONDARY_FRAGMENT_CAPACITY]),
+        pred_cache_cs(nullptr),
+        cnt_hist(nullptr),
+        tmp(nullptr),
+        capacity(0),
+        touched_up_buckets(0),
+        touch_up_fallbacks(0) {}
+
+  secondary_scratch(const secondary_scratch &) = delete;
+  secondary_scratch &operator=(const secondary_scratch &) = delete;
+
+  ~secondary_scratch() {
+    delete[] tmp;
+    delete[] cnt_hist;
+    delete[] pred_cache_cs;
+    delete[] swap_buffer;
+    delete[] fragments;
+  }
+
+  // Makes room for the counting sort of a bucket of bucket_sz keys. The
+  // buffers only grow, so they are reallocated at most a few times per sort.
+  void reserve(long bucket_sz) {
+    if (bucket_sz <= capacity) return;
+
+    delete[] tmp;
+    delete[] cnt_hist;
+    delete[] pred_cache_cs;
+    capacity = std::max(bucket_sz, 2 * capacity);
+    pred_cache_cs = new long[capacity];
+    cnt_hist = new long[capacity];
+    tmp = new T[capacity];
+  }
+};
+
+// The parameters of a trained CDF model laid out for its flat view (see
+// flatten_model)
+struct flat_model_storage {
+  vector<double> slopes;
+  vector<double> intercepts;
+  vector<double> base_hi;
+  vector<double> base_lo;
+  vector<double> mid_slopes;
+  vector<double> mid_intercepts;
+};
+
+// Scratch memory for a whole sort, which can be kept across the sorts of
+// several inputs so that repeated sorts do not allocate memory. A scratch arena
+// must only be used by one thread at a time.
+template <class T, class Config>
+class sort_scratch {
+ public:
+  // The auxiliary fragments of the primary partitioning
+  T (*fragments)[Config::PRIMARY_FRAGMENT_CAPACITY];
+
+  // Swap space for the defragmentation
+  T *swap_buffer;
+
+  // The predicted buckets of a batch of keys
+  vector<long> pred_buckets;
+
+  // Scratch memory for sorting the primary buckets
+  secondary_scratch<T, Config> secondary;
+
+  // The parameters of the CDF model that the sort uses
+  flat_model_storage model_storage;
+
+  // The overallocated buckets and the spill area of the out-of-place
+  // partitioning, where the buckets have room for `buckets_capacity` keys
+  T *buckets;
+  long buckets_capacity;
+  vector<T> spill;
+
+  sort_scratch()
+      : fragments(new T[Config::PRIMARY_FANOUT]
+                       [Config::PRIMARY_FRAGMENT_CAPACITY]),
+        swap_buffer(new T[Config::PRIMARY_FRAGMENT_CAPACITY]),
+        buckets(nullptr),
+        buckets_capacity(0) {}
+
+  sort_scratch(const sort_scratch &) = delete;
+  sort_scratch &operator=(const sort_scratch &) = delete;
+
+  ~sort_scratch() {
+    delete[] buckets;
+    delete[] swap_buffer;
+    delete[] fragments;
+  }
+
+  // Makes room for sz keys in the overallocated buckets. The buckets only
+  // grow, so that repeated sorts of similar inputs do not reallocate them.
+  void reserve_buckets(long sz) {
+    if (sz <= buckets_capacity) return;
+
+    delete[] buckets;
+    buckets_capacity = sz;
+    buckets = new T[buckets_capacity];
+  }
+};
+
+// Returns the index of the first occurrence of Config in Configs
+template <class Config, class... Configs>
+constexpr size_t config_index() {
+  constexpr bool matches[] = {std::is_same<Config, Configs>::value...};
+  size_t idx = 0;
+  while (idx < sizeof...(Configs) && !matches[idx]) ++idx;
+  return idx;
+}
+
+// The scratch memory of a sort for each of several configurations, which is
+// allocated the first time that a configuration is used
+template <class T, class... Configs>
+class scratch_arenas {
+ public:
+  template <class Config>
+  sort_scratch<T, Config> &get() {
+    auto &arena = std::get<config_index<Config, Configs...>()>(arenas);
+    if (!arena) arena.reset(new sort_scratch<T, Config>());
+    return *arena;
+  }
+
+ private:
+  std::tuple<std::unique_ptr<sort_scratch<T, Configs>>...> arenas;
+};
+
+// The scratch arenas of all the configurations that were tuned for keys of
+// type T
+template <class T,
+          class List = typename tuned_configs<sizeof(T)>::large_input_configs>
+struct tuned_scratch_arenas;
+
+template <class T, class... LargeInputConfigs>
+struct tuned_scratch_arenas<T, config_list<LargeInputConfigs...>> {
+  typedef scratch_arenas<T,
+                         typename tuned_configs<sizeof(T)>::small_input_config,
+                         LargeInputConfigs...>
+      type;
+};
+
+/**
+ * @brief Partitions the keys of a single primary bucket into secondary buckets,
+ * unless all of its keys are identical.
+ *
+ * @param primary_bucket_start Random-access iterator to the first key of the
+ * primary bucket.
+ * @param primary_bucket_sz The number of keys in the primary bucket.
+ * @param primary_bucket_idx The index of the primary bucket.
+ * @param model The parameters of the trained CDF model.
+ * @param enable_dups_detection Whether to skip homogeneous buckets.
+ * @param secondary_bucket_sizes Output array of SECONDARY_FANOUT elements,
+ * where the number of keys in each secondary bucket is written.
+ * @param scratch Scratch memory for the auxiliary fragments.
+ * @param key_of Extracts the numerical key of each record.
+ * @return false if the bucket is homogeneous and needs no further sorting,
+ * true otherwise.
+ */
+template <class Config, class RandomIt, class KeyOf = utils::identity_key>
+bool partition_primary_bucket(
+    RandomIt primary_bucket_start, long primary_bucket_sz,
+    long primary_bucket_idx, const flat_rmi &model, bool enable_dups_detection,
+    long *secondary_bucket_sizes,
+    secondary_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch,
+    const KeyOf &key_of = KeyOf()) {
+  // The fanouts and the fragment capacity of the configuration
+  constexpr long PRIMARY_FANOUT = Config::PRIMARY_FANOUT;
+  constexpr long SECONDARY_FANOUT = Config::SECONDARY_FANOUT;
+  constexpr long SECONDARY_FRAGMENT_CAPACITY =
+      Config::SECONDARY_FRAGMENT_CAPACITY;
+
+  // Maps the predicted CDFs to the secondary buckets of this primary bucket
+  const bucket_map secondary_map{
+      1. * PRIMARY_FANOUT * SECONDARY_FANOUT,
+      -1. * primary_bucket_idx * SECONDARY_FANOUT, SECONDARY_FANOUT - 1.};
+
+  LS_STATS_PHASE(SECONDARY_PARTITION);
+
+  // When the bucket is homogeneous, skip sorting it
+  if (enable_dups_detection &&
+      utils::all_keys_equal(primary_bucket_start, primary_bucket_sz, key_of)) {
+    LS_STATS_ADD(homogeneous_buckets_skipped, 1);
+    return false;
+  }
+
+  //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+  //        PARTITION THE KEYS INTO SECONDARY BUCKETS         //
+  //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+
+  // Keeps track of the number of elements in each secondary bucket
+  std::fill(secondary_bucket_sizes, secondary_bucket_sizes + SECONDARY_FANOUT,
+            0);
+
+  // Keeps track of the number of elements in each fragment
+  long fragment_sizes[SECONDARY_FANOUT]{0};
+
+  // An auxiliary set of fragments where the elements will be partitioned
+  auto fragments = scratch.fragments;
+
+  // Keeps track of the number of fragments that have been written back to the
+  // original array
+  long fragments_written = 0;
+
+  // Points to the next free space where to write back
+  auto write_itr = primary_bucket_start;
+
+  // The predicted buckets of a batch of keys
+  long pred_buckets[INFERENCE_BATCH_SZ];
+
+  // For each element in the input, predict which bucket it would go to, and
+  // insert to the respective bucket fragment
+  for (long elm_idx = 0; elm_idx < primary_bucket_sz; ++elm_idx) {
+    // Predict the buckets of the next batch of keys
+    if (elm_idx % INFERENCE_BATCH_SZ == 0) {
+      predict_buckets(primary_bucket_start + elm_idx,
+                      std::min(INFERENCE_BATCH_SZ, primary_bucket_sz - elm_idx),
+                      model, -1, secondary_map, pred_buckets, key_of);
+    }
+    long pred_bucket_idx = pred_buckets[elm_idx % INFERENCE_BATCH_SZ];
+
+    // Place the current element in the predicted fragment
+    fragments[pred_bucket_idx][fragment_sizes[pred_bucket_idx]] =
+        primary_bucket_start[elm_idx];
+
+    // Update the fragment size and the bucket size
+    ++secondary_bucket_sizes[pred_bucket_idx];
+    ++fragment_sizes[pred_bucket_idx];
+
+    if (fragment_sizes[pred_bucket_idx] == SECONDARY_FRAGMENT_CAPACITY) {
+      ++fragments_written;
+      // The predicted fragment is full, place in the array and update bucket
+      // size
+      std::move(fragments[pred_bucket_idx],
+                fragments[pred_bucket_idx] + SECONDARY_FRAGMENT_CAPACITY,
+                write_itr);
+      write_itr += SECONDARY_FRAGMENT_CAPACITY;
+
+      // Reset the fragment size
+      fragment_sizes[pred_bucket_idx] = 0;
+    }
+  }  // end of partitioninig over secondary fragments
+
+  //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+  //                      DEFRAGMENTATION                     //
+  //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+
+  LS_STATS_NEXT_PHASE(DEFRAGMENTATION);
+
+  // Records the ending offset for the buckets
+  long bucket_end_offset[SECONDARY_FANOUT]{0};
+  bucket_end_offset[0] = secondary_bucket_sizes[0];
+
+  // Swap space
+  auto swap_buffer = scratch.swap_buffer;
+
+  // Maintains a writing iterator for each bucket, initialized at the starting
+  // offsets
+  long bucket_start_off[SECONDARY_FANOUT]{0};
+  bucket_start_off[0] = 0;
+
+  // Calculate the starting and ending offsets of each bucket
+  for (long bucket_idx = 1; bucket_idx < SECONDARY_FANOUT; ++bucket_idx) {
+    // Calculate the bucket end offsets (prefix sum)
+    bucket_end_offset[bucket_idx] = secondary_bucket_sizes[bucket_idx] +
+                                    bucket_end_offset[bucket_idx - 1];
+
+    // Calculate the bucket start offsets and assign the writing iterator to
+    // that value
+
+    // These offsets are aligned w.r.t. SECONDARY_FRAGMENT_CAPACITY
+    bucket_start_off[bucket_idx] =
+        ceil(bucket_end_offset[bucket_idx - 1] * 1. /
+             SECONDARY_FRAGMENT_CAPACITY) *
+        SECONDARY_FRAGMENT_CAPACITY;
+
+    // Fence the bucket iterator. This might occur because the write offset is
+    // not necessarily aligned with SECONDARY_FRAGMENT_CAPACITY
+    if (bucket_start_off[bucket_idx] > bucket_end_offset[bucket_idx]) {
+      bucket_start_off[bucket_idx] = bucket_end_offset[bucket_idx];
+    }
+  }
+
+  // This keeps track of which bucket we are operating on
+  long stored_bucket_idx = 0;
+
+  // Go over each fragment and re-arrange them so that they are placed
+  // contiguously within each bucket boundaries
+  for (long fragment_idx = 0; fragment_idx < fragments_written;
+       ++fragment_idx) {
+    auto cur_fragment_start_off =
+        fragment_idx * SECONDARY_FRAGMENT_CAPACITY;
+
+    // Find the bucket where this fragment is stored into, which is not
+    // necessarily the bucket it belongs to
+    while (cur_fragment_start_off >=
+           bucket_end_offset[stored_bucket_idx]) {
+      ++stored_bucket_idx;
+    }
+
+    // Skip this fragment if its starting index is lower than the writing offset
+    // for the current bucket. This means that the fragment has already been
+    // dealt with
+    if (cur_fragment_start_off < bucket_start_off[stored_bucket_idx]) {
+      continue;
+    }
+
+    // Find out what bucket the current fragment belongs to by looking at RMI
+    // prediction for the first element of the fragment.
+    long pred_bucket_for_cur_fragment =
+        predict_bucket(model, secondary_map,
+                       key_of(primary_bucket_start[cur_fragment_start_off]));
+
+    // If the current bucket contains fragments that are not all the way full,
+    // no need to use a swap fragment, since there is available space. The first
+    // condition checks whether the current fragment will need to be written in
+    // a bucket that was already consumed. The second condition checks whether
+    // the writing offset of the predicted bucket is beyond the last element
+    // written into the array. This means that there is empty space to write the
+    // fragments to.
+    if (bucket_start_off[pred_bucket_for_cur_fragment] <
+            cur_fragment_start_off ||
+        bucket_start_off[pred_bucket_for_cur_fragment] >=
+            fragments_written * SECONDARY_FRAGMENT_CAPACITY) {
+      // If the current fragment will not be the last one to write in the
+      // predicted bucket
+      if (bucket_start_off[pred_bucket_for_cur_fragment] +
+              SECONDARY_FRAGMENT_CAPACITY <=
+          bucket_end_offset[pred_bucket_for_cur_fragment]) {
+        auto write_itr = primary_bucket_start +
+                         bucket_start_off[pred_bucket_for_cur_fragment];
+        auto read_itr = primary_bucket_start + cur_fragment_start_off;
+
+        // Move the elements of the fragment to the bucket's write offset
+        std::copy(read_itr, read_itr + SECONDARY_FRAGMENT_CAPACITY,
+                  write_itr);
+
+        // Update the bucket write offset
+        bucket_start_off[pred_bucket_for_cur_fragment] +=
+            SECONDARY_FRAGMENT_CAPACITY;
+
+      } else {  // This is the last fragment to write into the predicted
+                // bucket
+        auto write_itr = primary_bucket_start +
+                         bucket_start_off[pred_bucket_for_cur_fragment];
+        auto read_itr = primary_bucket_start + cur_fragment_start_off;
+
+        // Calculate the fragment size
+        auto cur_fragment_sz =
+            bucket_end_offset[pred_bucket_for_cur_fragment] -
+            bucket_start_off[pred_bucket_for_cur_fragment];
+
+        // Move the elements of the fragment to the bucket's write offset
+        std::copy(read_itr, read_itr + cur_fragment_sz, write_itr);
+
+        // Update the bucket write offset for the predicted bucket
+        bucket_start_off[pred_bucket_for_cur_fragment] =
+            bucket_end_offset[pred_bucket_for_cur_fragment];
+
+        // Place the remaining elements of this fragment into the auxiliary
+        // fragment memory. This is needed when the start of the bucket might
+        // have empty spaces because the writing iterator was not aligned with
+        // FRAGMENT_CAPACITY (not a multiple)
+        for (long elm_idx = cur_fragment_sz;
+             elm_idx < SECONDARY_FRAGMENT_CAPACITY; elm_idx++) {
+          fragments[pred_bucket_for_cur_fragment]
+                   [fragment_sizes[pred_bucket_for_cur_fragment] +
+                    elm_idx - cur_fragment_sz] = read_itr[elm_idx];
+        }
+
+        // Update the auxiliary fragment size
+        fragment_sizes[pred_bucket_for_cur_fragment] +=
+            SECONDARY_FRAGMENT_CAPACITY - cur_fragment_sz;
+      }
+
+    } else {  // The current fragment is to be written in a non-empty
+              // space, so an incumbent fragment will need to be evicted
+
+      // If the fragment is already within the correct bucket
+      if (pred_bucket_for_cur_fragment == stored_bucket_idx) {
+        // If the empty area left in the bucket is not enough for all the
+        // elements in the fragment. This is needed when the start of the bucket
+        // might have empty spaces because the writing iterator was not aligned
+        // with FRAGMENT_CAPACITY (not a multiple)
+        if (bucket_end_offset[stored_bucket_idx] -
+                bucket_start_off[stored_bucket_idx] <
+            SECONDARY_FRAGMENT_CAPACITY) {
+          auto write_itr =
+              primary_bucket_start + bucket_start_off[stored_bucket_idx];
+          auto read_itr = primary_bucket_start + cur_fragment_start_off;
+
+          // Calculate the amount of space left for the current bucket
+          long remaining_space = bucket_end_offset[stored_bucket_idx] -
+                                 bucket_start_off[stored_bucket_idx];
+
+          // Write out the fragment in the remaining space
+          std::copy(read_itr, read_itr + remaining_space, write_itr);
+
+          // Update the read iterator to point to the remaining elements
+          read_itr = primary_bucket_start + cur_fragment_start_off +
+                     remaining_space;
+
+          // Calculate the fragment size
+          auto cur_fragment_sz = fragment_sizes[stored_bucket_idx];
+
+          // Write the remaining elements into the auxiliary fragment space
+          for (int k = 0;
+               k < SECONDARY_FRAGMENT_CAPACITY - remaining_space; ++k) {
+            fragments[stored_bucket_idx][cur_fragment_sz++] =
+                *(read_itr++);
+          }
+
+          // Update the fragment size after the new placements
+          fragment_sizes[stored_bucket_idx] = cur_fragment_sz;
+
+          // Update the bucket write offset to indicate that the bucket was
+          // fully written
+          bucket_start_off[stored_bucket_idx] =
+              bucket_end_offset[stored_bucket_idx];
+
+        } else {  // The bucket has enough space for the incoming fragment
+
+          auto write_itr =
+              primary_bucket_start + bucket_start_off[stored_bucket_idx];
+          auto read_itr = primary_bucket_start + cur_fragment_start_off;
+
+          if (write_itr != read_itr) {
+            // Write the elements to the bucket's write offset
+            std::copy(read_itr, read_itr + SECONDARY_FRAGMENT_CAPACITY,
+                      write_itr);
+          }
+
+          // Update the write offset for the current bucket
+          bucket_start_off[stored_bucket_idx] +=
+              SECONDARY_FRAGMENT_CAPACITY;
+        }
+      } else {  // The fragment is not in the correct bucket and needs to
+                // be
+        // swapped out with an incorrectly placed fragment there
+
+        // Predict the bucket of the fragment that will be swapped out
+        long pred_bucket_for_fragment_to_be_swapped_out = predict_bucket(
+            model, secondary_map,
+            key_of(primary_bucket_start
+                       [bucket_start_off[pred_bucket_for_cur_fragment]]));
+
+        // If the fragment at the next write offset is not already in the right
+        // bucket, swap the fragments
+        if (pred_bucket_for_fragment_to_be_swapped_out !=
+            pred_bucket_for_cur_fragment) {
+          // Move the contents at the write offset into a swap fragment
+          auto itr_buf1 = primary_bucket_start +
+                          bucket_start_off[pred_bucket_for_cur_fragment];
+          auto itr_buf2 = primary_bucket_start + cur_fragment_start_off;
+          std::copy(itr_buf1, itr_buf1 + SECONDARY_FRAGMENT_CAPACITY,
+                    swap_buffer);
+
+          // Write the contents of the incoming fragment
+          std::copy(itr_buf2, itr_buf2 + SECONDARY_FRAGMENT_CAPACITY,
+                    itr_buf1);
+
+          // Place the swap buffer into the emptied space
+          std::copy(swap_buffer,
+                    swap_buffer + SECONDARY_FRAGMENT_CAPACITY, itr_buf2);
+          LS_STATS_ADD(fragments_swapped, 1);
+
+          pred_bucket_for_cur_fragment =
+              pred_bucket_for_fragment_to_be_swapped_out;
+        } else {  // The fragment at the write offset is already in the
+                  // right bucket
+          bucket_start_off[pred_bucket_for_cur_fragment] +=
+              SECONDARY_FRAGMENT_CAPACITY;
+        }
+
+        // Decrement the fragment index so that the newly swapped in fragment is
+        // not skipped over
+        --fragment_idx;
+      }
+    }
+  }
+
+  // Add the elements remaining in the auxiliary fragments to the buckets they
+  // belong to. This is for when the fragments weren't full and thus not flushed
+  // to the input array
+  for (long bucket_idx = 0; bucket_idx < SECONDARY_FANOUT; ++bucket_idx) {
+    // Set the writing offset to the beggining of the bucket
+    long write_off = 0;
+    if (bucket_idx > 0) {
+      write_off = bucket_end_offset[bucket_idx - 1];
+    }
+
+    // Add the elements left in the auxiliary fragments to the beggining of the
+    // predicted bucket, since it was not full
+    long elm_idx;
+    for (elm_idx = 0; (elm_idx < fragment_sizes[bucket_idx]) &&
+                      (write_off % SECONDARY_FRAGMENT_CAPACITY != 0);
+         ++elm_idx) {
+      primary_bucket_start[write_off++] = fragments[bucket_idx][elm_idx];
+    }
+
+    // Add the remaining elements from the auxiliary fragments to the end of the
+    // bucket it belongs to
+    write_off =
+        bucket_end_offset[bucket_idx] - fragment_sizes[bucket_idx];
+    for (; elm_idx < fragment_sizes[bucket_idx]; ++elm_idx) {
+      primary_bucket_start[write_off + elm_idx] =
+          fragments[bucket_idx][elm_idx];
+      ++bucket_start_off[bucket_idx];
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Touches up a bucket that the model-based counting sort left almost
+ * sorted. The keys that are slightly out of place are moved by insertion, and
+ * the bucket is sorted from scratch as soon as a key needs to move
+ * TOUCH_UP_MAX_DISPLACEMENT positions or the insertions exceed
+ * TOUCH_UP_MOVES_PER_KEY moves per key. This bounds the time spent on the
+ * buckets where the model mispredicts badly.
+ *
+ * @param bucket_start Random-access iterator to the first key of the bucket.
+ * @param bucket_end Random-access iterator past the last key of the bucket.
+ * @param key_of Extracts the numerical key of each record.
+ * @return Whether the bounded insertion sort was enough, as opposed to sorting
+ * the bucket from scratch.
+ */
+template <class RandomIt, class KeyOf>
+bool touch_up_bucket(RandomIt bucket_start, RandomIt bucket_end,
+                     const KeyOf &key_of) {
+  LS_STATS_PHASE(TOUCH_UP);
+  long num_moves = 0;
+  const bool bounded = utils::bounded_insertion_sort(
+      bucket_start, bucket_end, TOUCH_UP_MAX_DISPLACEMENT,
+      TOUCH_UP_MOVES_PER_KEY * (bucket_end - bucket_start), key_of,
+      &num_moves);
+  LS_STATS_ADD(touch_up_moves, num_moves);
+  if (!bounded) {
+    LS_STATS_ADD(touch_up_fallbacks, 1);
+    std::sort(bucket_start, bucket_end, key_less<KeyOf>{key_of});
+  }
+  return bounded;
+}
+
+/**
+ * @brief Restores the order across the boundary between a sorted prefix and the
+ * sorted run of keys that follows it. The order only breaks when the model is
+ * not monotonic due to rounding errors, and then only the keys on either side
+ * of the boundary that overlap are merged.
+ *
+ * @param prefix_start Random-access iterator to the first key of the prefix.
+ * @param run_start Random-access iterator to the first key of the run, which is
+ * also the end of the prefix.
+ * @param run_end Random-access iterator past the last key of the run.
+ * @param key_of Extracts the numerical key of each record.
+ */
+template <class RandomIt, class KeyOf>
+void touch_up_boundary(RandomIt prefix_start, RandomIt run_start,
+                       RandomIt run_end, const KeyOf &key_of) {
+  if (prefix_start == run_start || run_start == run_end ||
+      !(key_of(run_start[0]) < key_of(run_start[-1]))) {
+    return;
+  }
+
+  LS_STATS_PHASE(TOUCH_UP);
+  const key_less<KeyOf> less{key_of};
+  auto merge_start =
+      std::upper_bound(prefix_start, run_start, run_start[0], less);
+  auto merge_end = std::lower_bound(run_start, run_end, run_start[-1], less);
+  std::inplace_merge(merge_start, run_start, merge_end, less);
+}
+
+/**
+ * @brief Sorts a contiguous range of the secondary buckets of a primary bucket
+ * using the model-based counting sort, and touches up each bucket and the
+ * boundaries between them, which leaves the range sorted.
+ *
+ * @param secondary_bucket_start Random-access iterator to the first key of the
+ * first secondary bucket in the range.
+ * @param secondary_bucket_sizes The number of keys in each of the
+ * SECONDARY_FANOUT secondary buckets of the primary bucket.
+ * @param first_secondary_bucket_idx The index of the first secondary bucket in
+ * the range.
+ * @param end_secondary_bucket_idx The index past the last secondary bucket in
+ * the range.
+ * @param primary_bucket_idx The index of the primary bucket.
+ * @param input_sz The size of the whole input that is being sorted.
+ * @param model The parameters of the trained CDF model.
+ * @param enable_dups_detection Whether to skip homogeneous buckets.
+ * @param scratch Scratch memory for the counting sort.
+ * @param key_of Extracts the numerical key of each record.
+ */
+template <class Config, class RandomIt, class KeyOf = utils::identity_key>
+void sort_secondary_buckets(
+    RandomIt secondary_bucket_start, const long *secondary_bucket_sizes,
+    long first_secondary_bucket_idx, long end_secondary_bucket_idx,
+    long primary_bucket_idx, long input_sz, const flat_rmi &model,
+    bool enable_dups_detection,
+    secondary_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch,
+    const KeyOf &key_of = KeyOf()) {
+  // The fanouts of the configuration
+  constexpr long PRIMARY_FANOUT = Config::PRIMARY_FANOUT;
+  constexpr long SECONDARY_FANOUT = Config::SECONDARY_FANOUT;
+
+  // Counts the number of elements in this range that are done going through
+  // the partitioning steps for good
+  long num_elms_finalized = 0;
+
+  //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+  //                MODEL-BASED COUNTING SORT                 //
+  //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+  LS_STATS_PHASE(COUNTING_SORT);
+
+  // Iterate over the secondary buckets
+  for (long secondary_bucket_idx = first_secondary_bucket_idx;
+       secondary_bucket_idx < end_secondary_bucket_idx;
+       ++secondary_bucket_idx) {
+    auto secondary_bucket_sz = secondary_bucket_sizes[secondary_bucket_idx];
+    auto cur_bucket_start = secondary_bucket_start + num_elms_finalized;
+    auto cur_bucket_end = cur_bucket_start + secondary_bucket_sz;
+    LS_STATS_BUCKET(secondary_bucket_hist, secondary_bucket_sz);
+
+    // Skip bucket if empty
+    if (secondary_bucket_sz == 0) continue;
+
+    // Skip the bucket if it is homogeneous
+    if (enable_dups_detection and
+        utils::all_keys_equal(cur_bucket_start, secondary_bucket_sz, key_of)) {
+      LS_STATS_ADD(homogeneous_buckets_skipped, 1);
+    } else {
+      long adjustment_offset =
+          1. *
+          (primary_bucket_idx * SECONDARY_FANOUT + secondary_bucket_idx) *
+          input_sz / (PRIMARY_FANOUT * SECONDARY_FANOUT);
+
+      scratch.reserve(secondary_bucket_sz);
+
+      // Saves the predicted CDFs for the Counting Sort subroutine
+      auto pred_cache_cs = scratch.pred_cache_cs;
+
+      // Count array for the model-enhanced counting sort subroutine
+      auto cnt_hist = scratch.cnt_hist;
+      std::fill(cnt_hist, cnt_hist + secondary_bucket_sz, 0);
+
+      /*
+       * OPTIMIZATION
+       * We check to see if the first and last element in the current
+       * bucket used the same leaf model to obtain their CDF. If that is
+       * the case, then we don't need to traverse the CDF model for
+       * every element in this bucket, hence decreasing the inference
+       * complexity from O(num_layer) to O(1).
+       */
+
+      long pred_model_first_elm =
+          predict_leaf(model, key_of(cur_bucket_start[0]));
+      long pred_model_last_elm =
+          predict_leaf(model, key_of(cur_bucket_end[-1]));
+
+      // Scale the predicted CDFs to the input size, relative to the start of
+      // the current bucket
+      const bucket_map cs_map{1. * input_sz, -1. * adjustment_offset,
+                              secondary_bucket_sz - 1.};
+
+      // Predict the positions of the elements, avoiding the CDF model
+      // traversal when they all use the same leaf model
+      predict_buckets(
+          cur_bucket_start, secondary_bucket_sz, model,
+          pred_model_first_elm == pred_model_last_elm ? pred_model_first_elm
+                                                      : -1,
+          cs_map, pred_cache_cs, key_of);
+
+      // Update the counts
+      for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
+        ++cnt_hist[pred_cache_cs[elm_idx]];
+      }
+
+      --cnt_hist[0];
+
+      // Calculate the running totals
+      for (long i = 1; i < secondary_bucket_sz; ++i) {
+        cnt_hist[i] += cnt_hist[i - 1];
+      }
+
+      // A temporary buffer for placing the keys in sorted order
+      auto tmp = scratch.tmp;
+
+      // Re-shuffle the elms based on the calculated cumulative counts
+      for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
+        // Place the element in the predicted position in the array
+
+        tmp[cnt_hist[pred_cache_cs[elm_idx]]] =
+            std::move(cur_bucket_start[elm_idx]);
+
+        // Update counts
+        --cnt_hist[pred_cache_cs[elm_idx]];
+      }
+
+      // Write back the temprorary buffer to the original input
+      std::move(tmp, tmp + secondary_bucket_sz, cur_bucket_start);
+
+      // Touch up the bucket while it is still cached
+      ++scratch.touched_up_buckets;
+      if (!touch_up_bucket(cur_bucket_start, cur_bucket_end, key_of)) {
+        ++scratch.touch_up_fallbacks;
+      }
+    }
+
+    // Merge the bucket with the preceding ones in the range if they overlap
+    touch_up_boundary(secondary_bucket_start, cur_bucket_start, cur_bucket_end,
+                      key_of);
+
+    // Update the number of finalized elements
+    num_elms_finalized += secondary_bucket_sz;
+  }  // end of iteration over the secondary buckets
+}
+
+/**
+ * @brief Sorts the keys of a single primary bucket by partitioning them into
+ * secondary buckets and then applying the model-based counting sort on each of
+ * them. The bucket is left sorted, unless the model is not monotonic across
+ * its boundaries with the neighbouring buckets.
+ *
+ * @param primary_bucket_start Random-access iterator to the first key of the
+ * primary bucket.
+ * @param primary_bucket_sz The number of keys in the primary bucket.
+ * @param primary_bucket_idx The index of the primary bucket.
+ * @param input_sz The size of the whole input that is being sorted.
+ * @param model The parameters of the trained CDF model.
+ * @param enable_dups_detection Whether to skip homogeneous buckets.
+ * @param scratch Scratch memory that is reused across the buckets.
+ * @param key_of Extracts the numerical key of each record.
+ */
+template <class Config, class RandomIt, class KeyOf = utils::identity_key>
+void sort_primary_bucket(
+    RandomIt primary_bucket_start, long primary_bucket_sz,
+    long primary_bucket_idx, long input_sz, const flat_rmi &model,
+    bool enable_dups_detection,
+    secondary_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch,
+    const KeyOf &key_of = KeyOf()) {
+  long secondary_bucket_sizes[Config::SECONDARY_FANOUT];
+  if (partition_primary_bucket(primary_bucket_start, primary_bucket_sz,
+                               primary_bucket_idx, model, enable_dups_detection,
+                               secondary_bucket_sizes, scratch, key_of)) {
+    sort_secondary_buckets(primary_bucket_start, secondary_bucket_sizes, 0,
+                           Config::SECONDARY_FANOUT, primary_bucket_idx,
+                           input_sz, model, enable_dups_detection, scratch,
+                           key_of);
+  }
+}
+
+// The keys that occur at least REP_CNT_THRESHOLD times in the training sample,
+// grouped by the primary bucket that the model predicts for them. The heavy
+// keys of the i-th primary bucket are keys[first[i]] to keys[first[i + 1] - 1],
+// in ascending order. Only the buckets that are mostly made of heavy keys keep
+// them, since splitting off the heavy keys costs a pass over the bucket.
+template <class K>
+struct heavy_keys {
+  vector<K> keys;
+  vector<long> first;
+
+  // The number of heavy keys of a primary bucket
+  long count(long primary_bucket_idx) const {
+    return keys.empty() ? 0
+                        : first[primary_bucket_idx + 1] -
+                              first[primary_bucket_idx];
+  }
+
+  // The heavy keys of a primary bucket
+  const K *of(long primary_bucket_idx) const {
+    return keys.data() + first[primary_bucket_idx];
+  }
+};
+
+// Checks whether some key occurs at least REP_CNT_THRESHOLD times in the
+// sorted training sample. Most inputs have no such keys.
+template <class K>
+bool has_heavy_keys(const vector<K> &training_sample) {
+  const long sample_sz = training_sample.size();
+  for (long i = REP_CNT_THRESHOLD - 1; i < sample_sz; ++i) {
+    if (training_sample[i] == training_sample[i - REP_CNT_THRESHOLD + 1]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Calls visit(key, count) for each run of equal keys of the sorted training
+// sample, in ascending order of the keys
+template <class K, class Visit>
+void for_each_sample_run(const vector<K> &training_sample, Visit &&visit) {
+  const long sample_sz = training_sample.size();
+  for (long run_start = 0, i = 1; i <= sample_sz; ++i) {
+    if (i < sample_sz && training_sample[i] == training_sample[run_start]) {
+      continue;
+    }
+    visit(training_sample[run_start], i - run_start);
+    run_start = i;
+  }
+}
+
+/**
+ * @brief Finds the heavy keys among the runs of equal keys of the sorted
+ * training sample of a model, and groups them by the primary bucket that the
+ * model predicts for them. The heavy keys of a bucket are dropped when they
+ * make up less than HEAVY_KEYS_MIN_SHARE of the sample keys of the bucket.
+ *
+ * @param for_each_run Calls its argument with the key and the length of each
+ * run of the sample, in ascending order of the keys.
+ * @param model The parameters of the trained CDF model.
+ * @param primary_fanout The number of primary buckets.
+ * @param heavy Output table of the heavy keys, which is left empty when there
+ * are none.
+ */
+template <class K, class ForEachRun>
+void find_heavy_keys_in_runs(const ForEachRun &for_each_run,
+                             const flat_rmi &model, long primary_fanout,
+                             heavy_keys<K> &heavy) {
+  // Maps the predicted CDFs to the primary buckets
+  const bucket_map primary_map{1. * primary_fanout, 0., primary_fanout - 1.};
+
+  heavy.keys.clear();
+  heavy.first.clear();
+
+  // Collect the keys that are repeated enough times in the sample, along with
+  // their primary buckets, and count the sample keys of each bucket
+  vector<std::pair<long, K>> bucketed_keys;
+  vector<long> bucket_sample_sz(primary_fanout, 0);
+  vector<long> heavy_sample_sz(primary_fanout, 0);
+  for_each_run([&](const K &key, long run_sz) {
+    long bucket_idx = predict_bucket(model, primary_map, key);
+    bucket_sample_sz[bucket_idx] += run_sz;
+    if (run_sz >= REP_CNT_THRESHOLD) {
+      bucketed_keys.push_back({bucket_idx, key});
+      heavy_sample_sz[bucket_idx] += run_sz;
+    }
+  });
+
+  // Drop the heavy keys of the buckets where they are a minority
+  std::erase_if(bucketed_keys, [&](const std::pair<long, K> &bucketed_key) {
+    return heavy_sample_sz[bucketed_key.first] <
+           HEAVY_KEYS_MIN_SHARE * bucket_sample_sz[bucketed_key.first];
+  });
+  if (bucketed_keys.empty()) return;
+
+  // Group the keys by their buckets, and find where the group of each bucket
+  // starts
+  std::sort(bucketed_keys.begin(), bucketed_keys.end());
+  heavy.first.assign(primary_fanout + 1, 0);
+  for (const auto &[bucket_idx, key] : bucketed_keys) {
+    heavy.keys.push_back(key);
+    ++heavy.first[bucket_idx + 1];
+  }
+  std::partial_sum(heavy.first.begin(), heavy.first.end(),
+                   heavy.first.begin());
+}
+
+/**
+ * @brief Finds the heavy keys in the sorted training sample of a model (see
+ * find_heavy_keys_in_runs).
+ *
+ * @param training_sample The sorted training sample of the model.
+ * @param model The parameters of the trained CDF model.
+ * @param primary_fanout The number of primary buckets.
+ * @param heavy Output table of the heavy keys, which is left empty when there
+ * are none.
+ */
+template <class K>
+void find_heavy_keys(const vector<K> &training_sample, const flat_rmi &model,
+                     long primary_fanout, heavy_keys<K> &heavy) {
+  // Most inputs have no heavy keys, and need no predictions for the sample
+  if (!has_heavy_keys(training_sample)) {
+    heavy.keys.clear();
+    heavy.first.clear();
+    return;
+  }
+
+  find_heavy_keys_in_runs(
+      [&](auto &&visit) { for_each_sample_run(training_sample, visit); },
+      model, primary_fanout, heavy);
+}
+
+/**
+ * @brief Splits a primary bucket around its heavy keys into 2 * num_heavy_keys
+ * + 1 sub-buckets, which are sorted with respect to each other. The odd
+ * sub-buckets are the equality buckets, which hold all the copies of one heavy
+ * key each and need no further sorting. The even sub-buckets hold the keys
+ * before the first heavy key, between two consecutive heavy keys, and after the
+ * last heavy key.
+ *
+ * @param primary_bucket_start Random-access iterator to the first key of the
+ * primary bucket.
+ * @param primary_bucket_sz The number of keys in the primary bucket.
+ * @param heavy_keys The heavy keys of the bucket, in ascending order.
+ * @param num_heavy_keys The number of heavy keys of the bucket.
+ * @param scratch Scratch memory for the split, whose sub_bucket_sizes are set
+ * to the number of keys in each sub-bucket.
+ * @param key_of Extracts the numerical key of each record.
+ */
+template <class Config, class RandomIt, class K, class KeyOf>
+void split_equality_buckets(
+    RandomIt primary_bucket_start, long primary_bucket_sz, const K *heavy_keys,
+    long num_heavy_keys,
+    secondary_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch,
+    const KeyOf &key_of) {
+  const long num_sub_buckets = 2 * num_heavy_keys + 1;
+  auto &sub_bucket_sizes = scratch.sub_bucket_sizes;
+  sub_bucket_sizes.assign(num_sub_buckets, 0);
+  scratch.reserve(std::max(primary_bucket_sz, num_sub_buckets));
+
+  // Find the sub-bucket of each key. The heavy keys are compared without
+  // branches, since the keys of a bucket alternate between them at random.
+  auto sub_bucket_idxs = scratch.pred_cache_cs;
+  for (long elm_idx = 0; elm_idx < primary_bucket_sz; ++elm_idx) {
+    const auto &key = key_of(primary_bucket_start[elm_idx]);
+    long sub_bucket_idx = 0;
+    for (long heavy_idx = 0; heavy_idx < num_heavy_keys; ++heavy_idx) {
+      sub_bucket_idx += (heavy_keys[heavy_idx] < key) +
+                        (heavy_keys[heavy_idx] <= key);
+    }
+    sub_bucket_idxs[elm_idx] = sub_bucket_idx;
+    ++sub_bucket_sizes[sub_bucket_idx];
+  }
+
+  // Calculate the starting offsets of the sub-buckets
+  auto sub_bucket_off = scratch.cnt_hist;
+  sub_bucket_off[0] = 0;
+  for (long i = 1; i < num_sub_buckets; ++i) {
+    sub_bucket_off[i] = sub_bucket_off[i - 1] + sub_bucket_sizes[i - 1];
+  }
+
+  // Place the keys in their sub-buckets through the temporary buffer
+  auto tmp = scratch.tmp;
+  for (long elm_idx = 0; elm_idx < primary_bucket_sz; ++elm_idx) {
+    tmp[sub_bucket_off[sub_bucket_idxs[elm_idx]]++] =
+        std::move(primary_bucket_start[elm_idx]);
+  }
+  std::move(tmp, tmp + primary_bucket_sz, primary_bucket_start);
+}
+
+/**
+ * @brief Sorts the keys of a primary bucket that has heavy keys. The equality
+ * buckets of the heavy keys are split off first, and only the sub-buckets
+ * between them are sorted like a primary bucket.
+ *
+ * @param primary_bucket_start Random-access iterator to the first key of the
+ * primary bucket.
+ * @param primary_bucket_sz The number of keys in the primary bucket.
+ * @param primary_bucket_idx The index of the primary bucket.
+ * @param input_sz The size of the whole input that is being sorted.
+ * @param model The parameters of the trained CDF model.
+ * @param enable_dups_detection Whether to skip homogeneous buckets.
+ * @param heavy The heavy keys of all the primary buckets.
+ * @param scratch Scratch memory that is reused across the buckets.
+ * @param key_of Extracts the numerical key of each record.
+ */
+template <class Config, class RandomIt, class K, class KeyOf>
+void sort_around_heavy_keys(
+    RandomIt primary_bucket_start, long primary_bucket_sz,
+    long primary_bucket_idx, long input_sz, const flat_rmi &model,
+    bool enable_dups_detection, const heavy_keys<K> &heavy,
+    secondary_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch,
+    const KeyOf &key_of) {
+  const long num_heavy_keys = heavy.count(primary_bucket_idx);
+  split_equality_buckets(primary_bucket_start, primary_bucket_sz,
+                         heavy.of(primary_bucket_idx), num_heavy_keys, scratch,
+                         key_of);
+
+  // Sort the sub-buckets between the equality buckets
+  const auto &sub_bucket_sizes = scratch.sub_bucket_sizes;
+  auto sub_bucket_start = primary_bucket_start;
+  for (long sub_bucket_idx = 0; sub_bucket_idx <= 2 * num_heavy_keys;
+       ++sub_bucket_idx) {
+    long sub_bucket_sz = sub_bucket_sizes[sub_bucket_idx];
+    if (sub_bucket_idx % 2 == 0 && sub_bucket_sz > 0) {
+      sort_primary_bucket(sub_bucket_start, sub_bucket_sz, primary_bucket_idx,
+                          input_sz, model, enable_dups_detection, scratch,
+                          key_of);
+    }
+    sub_bucket_start += sub_bucket_sz;
+  }
+}
+
+/**
+ * @brief Sorts the inputs that need no CDF model, which are the inputs that are
+ * already sorted, the ones sorted in descending order, and the ones too small
+ * for a model with the given hyperparameters.
+ *
+ * @param begin Random-access iterator to the first key.
+ * @param end Random-access iterator past the last key.
+ * @param params The hyperparameters for the CDF model.
+ * @param key_of Extracts the numerical key of each record.
+ * @return true if the keys were sorted, false if they need a CDF model.
+ */
+template <class RandomIt, class KeyOf = utils::identity_key>
+bool sort_without_model(
+    RandomIt begin, RandomIt end,
+    const typename TwoLayerRMI<key_type_t<RandomIt, KeyOf>>::Params &params,
+    const KeyOf &key_of = KeyOf()) {
+  const key_less<KeyOf> less{key_of};
+
+  // An empty input is already sorted
+  if (begin == end) return true;
+
+  // Check if the data is already sorted
+  if (key_of(*(end - 1)) >= key_of(*begin) &&
+      std::is_sorted(begin, end, less)) {
+    return true;
+  }
+
+  // Check if the data is sorted in descending order
+  if (key_of(*(end - 1)) <= key_of(*begin)) {
+    auto is_reverse_sorted = true;
+
+    for (auto i = begin; i != end - 1; ++i) {
+      if (key_of(*i) < key_of(*(i + 1))) {
+        is_reverse_sorted = false;
+        break;
+      }
+    }
+
+    if (is_reverse_sorted) {
+      std::reverse(begin, end);
+      return true;
+    }
+  }
+
+  if (std::distance(begin, end) <=
+      std::max<long>(params.fanout * params.threshold,
+                     5 * params.num_leaf_models)) {
+    std::sort(begin, end, less);
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * @brief Partitions the keys into the primary buckets out of place. The keys
+ * are first gathered in the same auxiliary fragments as in the in-place
+ * partitioning, and every full fragment is appended to its bucket in an
+ * auxiliary buffer, where the buckets have room for `overallocation` times
+ * their expected size. The keys that do not fit in their bucket are appended
+ * to a spill area instead, and once the whole input has been partitioned, they
+ * are moved to the end of their buckets in the input, which predicts their
+ * buckets a second time. The rest of the keys are copied back to the input by
+ * copy_out_of_place_bucket(), which lets each bucket be copied right before it
+ * is sorted. Unlike the in-place partitioning, no fragment needs to be moved a
+ * second time.
+ *
+ * @param begin Random-access iterator to the first key.
+ * @param input_sz The number of keys.
+ * @param model The parameters of the trained CDF model.
+ * @param batch_sz The number of keys whose buckets are predicted at once.
+ * @param overallocation The capacity of each bucket relative to its expected
+ * size, which must be at least 1.
+ * @param primary_bucket_sizes Output array of PRIMARY_FANOUT elements, where
+ * the number of keys in each primary bucket is written.
+ * @param bucket_fill Output array of PRIMARY_FANOUT elements, where the number
+ * of keys in each bucket of the buffer is written.
+ * @param scratch Scratch memory for the fragments, the buckets and the spill
+ * area.
+ * @param key_of Extracts the numerical key of each record.
+ * @return The capacity of each bucket in the buffer.
+ */
+template <class Config, class RandomIt, class KeyOf>
+long partition_out_of_place(
+    RandomIt begin, long input_sz, const flat_rmi &model, long batch_sz,
+    double overallocation, long *primary_bucket_sizes, long *bucket_fill,
+    sort_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch,
+    const KeyOf &key_of) {
+  constexpr long PRIMARY_FANOUT = Config::PRIMARY_FANOUT;
+  constexpr long PRIMARY_FRAGMENT_CAPACITY = Config::PRIMARY_FRAGMENT_CAPACITY;
+
+  // Maps the predicted CDFs to the primary buckets
+  const bucket_map primary_map{1. * PRIMARY_FANOUT, 0., PRIMARY_FANOUT - 1.};
+
+  // Every bucket has room for this many keys
+  const long bucket_capacity =
+      std::ceil(overallocation * input_sz / PRIMARY_FANOUT);
+  scratch.reserve_buckets(bucket_capacity * PRIMARY_FANOUT);
+  auto buckets = scratch.buckets;
+  auto &spill = scratch.spill;
+  spill.clear();
+
+  // Keeps track of the number of elements in each fragment
+  long fragment_sizes[PRIMARY_FANOUT]{0};
+  auto fragments = scratch.fragments;
+  std::fill(bucket_fill, bucket_fill + PRIMARY_FANOUT, 0);
+
+  // Appends the keys of a fragment to its bucket, and the ones that do not fit
+  // to the spill area
+  auto flush_fragment = [&](long bucket_idx, long fragment_sz) {
+    long num_fitting =
+        std::min(fragment_sz, bucket_capacity - bucket_fill[bucket_idx]);
+    std::copy(fragments[bucket_idx], fragments[bucket_idx] + num_fitting,
+              buckets + bucket_idx * bucket_capacity + bucket_fill[bucket_idx]);
+    bucket_fill[bucket_idx] += num_fitting;
+    spill.insert(spill.end(), fragments[bucket_idx] + num_fitting,
+                 fragments[bucket_idx] + fragment_sz);
+  };
+
+  // The keys are processed in batches, like in the in-place partitioning
+  vector<long> &pred_buckets = scratch.pred_buckets;
+  pred_buckets.resize(batch_sz);
+
+  for (long elm_idx = 0; elm_idx < input_sz; ++elm_idx) {
+    // Predict the buckets of the next batch of keys
+    const long batch_elm_idx = elm_idx % batch_sz;
+    if (batch_elm_idx == 0) {
+      predict_buckets(begin + elm_idx, std::min(batch_sz, input_sz - elm_idx),
+                      model, -1, primary_map, pred_buckets.data(), key_of);
+    }
+
+    // Prefetch the fragment slot of an upcoming key in the batch
+    if (batch_elm_idx + PREFETCH_DISTANCE < batch_sz &&
+        elm_idx + PREFETCH_DISTANCE < input_sz) {
+      long ahead_bucket_idx = pred_buckets[batch_elm_idx + PREFETCH_DISTANCE];
+      __builtin_prefetch(
+          &fragments[ahead_bucket_idx][fragment_sizes[ahead_bucket_idx]], 1);
+    }
+
+    long pred_bucket_idx = pred_buckets[batch_elm_idx];
+
+    // Place the current element in the predicted fragment
+    fragments[pred_bucket_idx][fragment_sizes[pred_bucket_idx]++] =
+        begin[elm_idx];
+    primary_bucket_sizes[pred_bucket_idx]++;
+
+    if (fragment_sizes[pred_bucket_idx] == PRIMARY_FRAGMENT_CAPACITY) {
+      flush_fragment(pred_bucket_idx, PRIMARY_FRAGMENT_CAPACITY);
+      fragment_sizes[pred_bucket_idx] = 0;
+    }
+  }
+
+  // Flush the fragments that are not full
+  for (long bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+    flush_fragment(bucket_idx, fragment_sizes[bucket_idx]);
+  }
+
+  // Place the spilled keys at the end of their buckets in the input, after the
+  // room that is left for the keys in the buffer
+  if (!spill.empty()) {
+    long spill_write_off[PRIMARY_FANOUT];
+    long bucket_start_off = 0;
+    for (long bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+      spill_write_off[bucket_idx] = bucket_start_off + bucket_fill[bucket_idx];
+      bucket_start_off += primary_bucket_sizes[bucket_idx];
+    }
+    for (auto &record : spill) {
+      begin[spill_write_off[predict_bucket(model, primary_map,
+                                           key_of(record))]++] =
+          std::move(record);
+    }
+  }
+
+  return bucket_capacity;
+}
+
+// Copies the keys of a primary bucket that were partitioned out of place from
+// the buffer back to the input
+template <class Config, class RandomIt>
+void copy_out_of_place_bucket(
+    RandomIt primary_bucket_start, long primary_bucket_idx,
+    long bucket_capacity, const long *bucket_fill,
+    const sort_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch) {
+  LS_STATS_PHASE(DEFRAGMENTATION);
+  auto bucket_begin = scratch.buckets + primary_bucket_idx * bucket_capacity;
+  std::copy(bucket_begin, bucket_begin + bucket_fill[primary_bucket_idx],
+            primary_bucket_start);
+}
+
+// Measures how far the sizes of the primary buckets are from the expected size
+// of input_sz / fanout keys, in the imbalance measures of the drift
+inline void measure_bucket_drift(const long *bucket_sizes, long fanout,
+                                 long input_sz, model_drift &drift) {
+  const double mean = 1. * input_sz / fanout;
+  double sum_sq = 0;
+  long max_sz = 0;
+  for (long bucket_idx = 0; bucket_idx < fanout; ++bucket_idx) {
+    sum_sq += 1. * bucket_sizes[bucket_idx] * bucket_sizes[bucket_idx];
+    max_sz = std::max(max_sz, bucket_sizes[bucket_idx]);
+  }
+
+  // A perfect model still has a relative variance of 1/mean on a random input
+  const double rel_var = sum_sq / fanout / (mean * mean) - 1;
+  drift.bucket_imbalance = std::max(0., rel_var - 1 / mean);
+  drift.max_bucket_ratio = max_sz / mean;
+}
+
+// Splits the bases of the models of an RMI for the flat view of the RMI, when
+// its models take the keys as offsets (see utils::uses_key_offsets). Otherwise,
+// the bases are left unset.
+template <class K>
+void split_bases(const TwoLayerRMI<K> &rmi, double &root_base_hi,
+                 double &root_base_lo, double *base_hi, double *base_lo) {
+  root_base_hi = root_base_lo = 0;
+  if constexpr (utils::uses_key_offsets<K>) {
+    utils::split_key(rmi.root_base, root_base_hi, root_base_lo);
+    for (size_t i = 0; i < rmi.leaf_bases.size(); ++i) {
+      utils::split_key(rmi.leaf_bases[i], base_hi[i], base_lo[i]);
+    }
+  }
+}
+
+// Lays out the parameters of a trained CDF model in the given storage, and
+// returns the flat view over them. The leaf routing of the view follows the
+// kind of the model: the middle layer of a 3-layer RMI, the starts of the
+// leaves of the piecewise-linear and radix-spline models, or the root model.
+template <class K>
+flat_rmi flatten_model(const TwoLayerRMI<K> &rmi, flat_model_storage &storage) {
+  const long num_leaf_models = rmi.leaf_models.size();
+  storage.slopes.resize(num_leaf_models);
+  storage.intercepts.resize(num_leaf_models);
+  for (long i = 0; i < num_leaf_models; ++i) {
+    storage.slopes[i] = rmi.leaf_models[i].slope;
+    storage.intercepts[i] = rmi.leaf_models[i].intercept;
+  }
+  constexpr bool KEY_OFFSETS = utils::uses_key_offsets<K>;
+  storage.base_hi.resize(KEY_OFFSETS ? num_leaf_models : 0);
+  storage.base_lo.resize(KEY_OFFSETS ? num_leaf_models : 0);
+
+  flat_rmi model{rmi.root_model.slope,
+                 rmi.root_model.intercept,
+                 num_leaf_models,
+                 storage.slopes.data(),
+                 storage.intercepts.data(),
+                 0,
+                 0,
+                 KEY_OFFSETS ? storage.base_hi.data() : nullptr,
+                 KEY_OFFSETS ? storage.base_lo.data() : nullptr};
+  split_bases(rmi, model.root_base_hi, model.root_base_lo,
+              storage.base_hi.data(), storage.base_lo.data());
+
+  if (!rmi.mid_models.empty()) {
+    const long num_mid_models = rmi.mid_models.size();
+    storage.mid_slopes.resize(num_mid_models);
+    storage.mid_intercepts.resize(num_mid_models);
+    for (long i = 0; i < num_mid_models; ++i) {
+      storage.mid_slopes[i] = rmi.mid_models[i].slope;
+      storage.mid_intercepts[i] = rmi.mid_models[i].intercept;
+    }
+    model.routing = leaf_routing::MIDDLE_LAYER;
+    model.num_mid_models = num_mid_models;
+    model.mid_slopes = storage.mid_slopes.data();
+    model.mid_intercepts = storage.mid_intercepts.data();
+  } else if (!rmi.leaf_starts.empty()) {
+    model.routing = leaf_routing::SEARCH;
+    model.leaf_starts = rmi.leaf_starts.data();
+    if (!rmi.radix_table.empty()) {
+      model.radix_table = rmi.radix_table.data();
+      model.num_radix_buckets = rmi.radix_table.size() - 1;
+      model.radix_min = rmi.radix_min;
+      model.radix_scale = rmi.radix_scale;
+    }
+  }
+  return model;
+}
+
+/**
+ * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
+ * Sort and the flat view of a trained CDF model, in ascending order.
+ *
+ * @param begin Random-access iterator to the first key.
+ * @param end Random-access iterator past the last key.
+ * @param model The parameters of the trained CDF model.
+ * @param heavy The heavy keys of the model for the primary buckets of Config.
+ * @param hp The hyperparameters that the model was trained with.
+ * @param enable_dups_detection Whether the model detects duplicate keys.
+ * @param scratch Scratch memory for the partitioning and the bucket sorting.
+ * @param key_of Extracts the numerical key of each record.
+ * @param drift Optional output for how well the model fits the input, which is
+ * only measured when it is given.
+ */
+template <class Config, class RandomIt, class KeyOf = utils::identity_key>
+void sort_with_model(
+    RandomIt begin, RandomIt end, const flat_rmi &model,
+    const heavy_keys<key_type_t<RandomIt, KeyOf>> &heavy,
+    const typename TwoLayerRMI<key_type_t<RandomIt, KeyOf>>::Params &hp,
+    bool enable_dups_detection,
+    sort_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch,
+    const KeyOf &key_of = KeyOf(), model_drift *drift = nullptr) {
   //----------------------------------------------------------//
   //                          INIT                            //
   //----------------------------------------------------------//
@@ -54,37 +1560,35 @@ void sort(RandomIt begin, RandomIt end,
 
   // Constants
   const long input_sz = std::distance(begin, end);
-  const long TRAINING_SAMPLE_SZ = rmi.training_sample.size();
+  constexpr long PRIMARY_FANOUT = Config::PRIMARY_FANOUT;
+  constexpr long PRIMARY_FRAGMENT_CAPACITY = Config::PRIMARY_FRAGMENT_CAPACITY;
 
   // Keeps track of the number of elements in each bucket
   long primary_bucket_sizes[PRIMARY_FANOUT]{0};
 
-  // Counts the number of elements that are done going through the
-  // partitioning steps for good
-  long num_elms_finalized = 0;
-
-  // Cache the model parameters
-  const long num_leaf_models = rmi.hp.num_leaf_models;
-  double root_slope = rmi.root_model.slope;
-  double root_intercept = rmi.root_model.intercept;
-  auto num_models = rmi.hp.num_leaf_models;
-  double slopes[num_leaf_models];
-  double intercepts[num_leaf_models];
-  for (auto i = 0; i < num_leaf_models; ++i) {
-    slopes[i] = rmi.leaf_models[i].slope;
-    intercepts[i] = rmi.leaf_models[i].intercept;
-  }
+  // Maps the predicted CDFs to the primary buckets
+  const bucket_map primary_map{1. * PRIMARY_FANOUT, 0., PRIMARY_FANOUT - 1.};
 
   //----------------------------------------------------------//
   //              PARTITION THE KEYS INTO BUCKETS             //
   //----------------------------------------------------------//
+  LS_STATS_PHASE(PRIMARY_PARTITION);
 
-  {
+  // The number of keys in each bucket of the buffer of the out-of-place
+  // partitioning, and the capacity of the buckets
+  long bucket_fill[PRIMARY_FANOUT];
+  long bucket_capacity = 0;
+
+  if (hp.out_of_place) {
+    bucket_capacity = partition_out_of_place(
+        begin, input_sz, model, hp.batch_sz, hp.overallocation,
+        primary_bucket_sizes, bucket_fill, scratch, key_of);
+  } else {
     // Keeps track of the number of elements in each fragment
     long fragment_sizes[PRIMARY_FANOUT]{0};
 
     // An auxiliary set of fragments where the elements will be partitioned
-    auto fragments = new T[PRIMARY_FANOUT][PRIMARY_FRAGMENT_CAPACITY];
+    auto fragments = scratch.fragments;
 
     // Keeps track of the number of fragments that have been written back to the
     // original array
@@ -93,24 +1597,34 @@ void sort(RandomIt begin, RandomIt end,
     // Points to the next free space where to write back
     auto write_itr = begin;
 
-    // For each element in the input, predict which bucket it would go to, and
-    // insert to the respective bucket fragment
-    for (auto it = begin; it != end; ++it) {
-      // Predict the model id in the leaf layer of the RMI
-      long pred_bucket_idx = static_cast<long>(std::max(
-          0.,
-          std::min(num_leaf_models - 1., root_slope * it[0] + root_intercept)));
+    // The keys are processed in batches. The buckets of all the keys in a
+    // batch are predicted first, and the keys are then scattered into their
+    // fragments while prefetching the fragment slots of the upcoming keys.
+    const long batch_sz = hp.batch_sz;
+    vector<long> &pred_buckets = scratch.pred_buckets;
+    pred_buckets.resize(batch_sz);
+
+    for (long elm_idx = 0; elm_idx < input_sz; ++elm_idx) {
+      // Predict the buckets of the next batch of keys
+      const long batch_elm_idx = elm_idx % batch_sz;
+      if (batch_elm_idx == 0) {
+        predict_buckets(begin + elm_idx, std::min(batch_sz, input_sz - elm_idx),
+                        model, -1, primary_map, pred_buckets.data(), key_of);
+      }
 
-      // Predict the CDF
-      double pred_cdf =
-          slopes[pred_bucket_idx] * it[0] + intercepts[pred_bucket_idx];
+      // Prefetch the fragment slot of an upcoming key in the batch
+      if (batch_elm_idx + PREFETCH_DISTANCE < batch_sz &&
+          elm_idx + PREFETCH_DISTANCE < input_sz) {
+        long ahead_bucket_idx = pred_buckets[batch_elm_idx + PREFETCH_DISTANCE];
+        __builtin_prefetch(
+            &fragments[ahead_bucket_idx][fragment_sizes[ahead_bucket_idx]], 1);
+      }
 
-      // Get the predicted bucket id
-      pred_bucket_idx = static_cast<long>(std::max(
-          0., std::min(PRIMARY_FANOUT - 1., pred_cdf * PRIMARY_FANOUT)));
+      long pred_bucket_idx = pred_buckets[batch_elm_idx];
 
       // Place the current element in the predicted fragment
-      fragments[pred_bucket_idx][fragment_sizes[pred_bucket_idx]] = it[0];
+      fragments[pred_bucket_idx][fragment_sizes[pred_bucket_idx]] =
+          begin[elm_idx];
 
       // Update the fragment size and the bucket size
       primary_bucket_sizes[pred_bucket_idx]++;
@@ -133,13 +1647,14 @@ void sort(RandomIt begin, RandomIt end,
     //----------------------------------------------------------//
     //                     DEFRAGMENTATION                      //
     //----------------------------------------------------------//
+    LS_STATS_NEXT_PHASE(DEFRAGMENTATION);
 
     // Records the ending offset for the buckets
     long bucket_end_offset[PRIMARY_FANOUT]{0};
     bucket_end_offset[0] = primary_bucket_sizes[0];
 
     // Swap space
-    T *swap_buffer = new T[PRIMARY_FRAGMENT_CAPACITY];
+    T *swap_buffer = scratch.swap_buffer;
 
     // Maintains a writing iterator for each bucket, initialized at the starting
     // offsets
@@ -191,19 +1706,8 @@ void sort(RandomIt begin, RandomIt end,
 
       // Find out what bucket the current fragment belongs to by looking at RMI
       // prediction for the first element of the fragment.
-      auto first_elm_in_fragment = begin[cur_fragment_start_off];
-      long pred_bucket_for_cur_fragment = static_cast<long>(std::max(
-          0., std::min(num_leaf_models - 1.,
-                       root_slope * first_elm_in_fragment + root_intercept)));
-
-      // Predict the CDF
-      double pred_cdf =
-          slopes[pred_bucket_for_cur_fragment] * first_elm_in_fragment +
-          intercepts[pred_bucket_for_cur_fragment];
-
-      // Get the predicted bucket id
-      pred_bucket_for_cur_fragment = static_cast<long>(std::max(
-          0., std::min(PRIMARY_FANOUT - 1., pred_cdf * PRIMARY_FANOUT)));
+      long pred_bucket_for_cur_fragment = predict_bucket(
+          model, primary_map, key_of(begin[cur_fragment_start_off]));
 
       // If the current bucket contains fragments that are not all the way full,
       // no need to use a swap buffer, since there is available space. The first
@@ -326,26 +1830,9 @@ void sort(RandomIt begin, RandomIt end,
           // swapped out with an incorrectly placed fragment there
 
           // Predict the bucket of the fragment that will be swapped out
-          auto first_elm_in_fragment_to_be_swapped_out =
-              begin[bucket_write_off[pred_bucket_for_cur_fragment]];
-
-          long pred_bucket_for_fragment_to_be_swapped_out =
-              static_cast<long>(std::max(
-                  0., std::min(
-                          num_leaf_models - 1.,
-                          root_slope * first_elm_in_fragment_to_be_swapped_out +
-                              root_intercept)));
-
-          // Predict the CDF
-          double pred_cdf =
-              slopes[pred_bucket_for_fragment_to_be_swapped_out] *
-                  first_elm_in_fragment_to_be_swapped_out +
-              intercepts[pred_bucket_for_fragment_to_be_swapped_out];
-
-          // Get the predicted bucket idx
-          pred_bucket_for_fragment_to_be_swapped_out = static_cast<long>(
-              std::max(0., std::min(PRIMARY_FANOUT - 1.,
-                                    pred_cdf * PRIMARY_FANOUT)));
+          long pred_bucket_for_fragment_to_be_swapped_out = predict_bucket(
+              model, primary_map,
+              key_of(begin[bucket_write_off[pred_bucket_for_cur_fragment]]));
 
           // If the fragment at the next write offset is not already in the
           // right bucket, swap the fragments
@@ -358,615 +1845,1318 @@ void sort(RandomIt begin, RandomIt end,
             std::copy(itr_buf1, itr_buf1 + PRIMARY_FRAGMENT_CAPACITY,
                       swap_buffer);
 
-            // Write the contents of the incoming fragment
-            std::copy(itr_buf2, itr_buf2 + PRIMARY_FRAGMENT_CAPACITY, itr_buf1);
+            // Write the contents of the incoming fragment
+            std::copy(itr_buf2, itr_buf2 + PRIMARY_FRAGMENT_CAPACITY, itr_buf1);
+
+            // Place the swap buffer into the emptied space
+            std::copy(swap_buffer, swap_buffer + PRIMARY_FRAGMENT_CAPACITY,
+                      itr_buf2);
+            LS_STATS_ADD(fragments_swapped, 1);
+
+            pred_bucket_for_cur_fragment =
+                pred_bucket_for_fragment_to_be_swapped_out;
+          } else {  // The fragment at the write offset is already in the right
+                    // bucket
+            bucket_write_off[pred_bucket_for_cur_fragment] +=
+                PRIMARY_FRAGMENT_CAPACITY;
+          }
+
+          // Decrement the fragment index so that the newly swapped in fragment
+          // is not skipped over
+          --fragment_idx;
+        }
+      }
+    }
+
+    // Add the elements remaining in the auxiliary fragments to the buckets they
+    // belong to. This is for when the fragments weren't full and thus not
+    // flushed to the input array
+    for (long bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+      // Set the writing offset to the beggining of the bucket
+      long write_off = 0;
+      if (bucket_idx > 0) {
+        write_off = bucket_end_offset[bucket_idx - 1];
+      }
+
+      // Add the elements left in the auxiliary fragments to the beggining of
+      // the predicted bucket, since it was not full
+      long elm_idx;
+      for (elm_idx = 0; (elm_idx < fragment_sizes[bucket_idx]) &&
+                        (write_off % PRIMARY_FRAGMENT_CAPACITY != 0);
+           ++elm_idx) {
+        begin[write_off++] = fragments[bucket_idx][elm_idx];
+      }
+
+      // Add the remaining elements from the auxiliary fragments to the end of
+      // the bucket it belongs to
+      write_off = bucket_end_offset[bucket_idx] - fragment_sizes[bucket_idx];
+      for (; elm_idx < fragment_sizes[bucket_idx]; ++elm_idx) {
+        begin[write_off + elm_idx] = fragments[bucket_idx][elm_idx];
+        ++bucket_write_off[bucket_idx];
+      }
+    }
+  }
+
+  LS_STATS_NEXT_PHASE(SECONDARY_PARTITION);
+  if constexpr (sort_stats::ENABLED) {
+    for (long bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+      LS_STATS_BUCKET(primary_bucket_hist, primary_bucket_sizes[bucket_idx]);
+    }
+  }
+
+  // Measure how far the primary buckets are from their expected size
+  if (drift) {
+    measure_bucket_drift(primary_bucket_sizes, PRIMARY_FANOUT, input_sz,
+                         *drift);
+    drift->spill_rate = hp.out_of_place ? 1. * scratch.spill.size() / input_sz
+                                        : 0.;
+    scratch.secondary.touched_up_buckets = 0;
+    scratch.secondary.touch_up_fallbacks = 0;
+  }
+
+  //----------------------------------------------------------//
+  //                SECOND ROUND OF PARTITIONING              //
+  //----------------------------------------------------------//
+
+  {
+    // Iterate over each primary bucket and sort its keys
+    auto primary_bucket_start = begin;
+    for (long primary_bucket_idx = 0; primary_bucket_idx < PRIMARY_FANOUT;
+         ++primary_bucket_idx) {
+      auto primary_bucket_sz = primary_bucket_sizes[primary_bucket_idx];
+
+      // Skip bucket if empty
+      if (primary_bucket_sz == 0) continue;
+
+      // Copy the bucket back from the buffer of the out-of-place partitioning,
+      // so that it is still cached when it is sorted
+      if (hp.out_of_place) {
+        copy_out_of_place_bucket(primary_bucket_start, primary_bucket_idx,
+                                 bucket_capacity, bucket_fill, scratch);
+      }
+
+      if (heavy.count(primary_bucket_idx) == 0) {
+        sort_primary_bucket(primary_bucket_start, primary_bucket_sz,
+                            primary_bucket_idx, input_sz, model,
+                            enable_dups_detection, scratch.secondary,
+                            key_of);
+      } else {
+        sort_around_heavy_keys(primary_bucket_start, primary_bucket_sz,
+                               primary_bucket_idx, input_sz, model,
+                               enable_dups_detection, heavy,
+                               scratch.secondary, key_of);
+      }
+
+      // Merge the bucket with the preceding ones if they overlap
+      touch_up_boundary(begin, primary_bucket_start,
+                        primary_bucket_start + primary_bucket_sz, key_of);
+
+      primary_bucket_start += primary_bucket_sz;
+    }
+  }
+
+  if (drift) {
+    const long touched_up_buckets = scratch.secondary.touched_up_buckets;
+    drift->touch_up_fallback_rate =
+        touched_up_buckets == 0
+            ? 0.
+            : 1. * scratch.secondary.touch_up_fallbacks / touched_up_buckets;
+  }
+}
+
+/**
+ * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
+ * Sort and a trained CDF model, in ascending order.
+ *
+ * @param begin Random-access iterator to the first key.
+ * @param end Random-access iterator past the last key.
+ * @param rmi A trained CDF model of the keys.
+ * @param scratch Scratch memory for the partitioning and the bucket sorting.
+ * @param key_of Extracts the numerical key of each record.
+ * @param drift Optional output for how well the model fits the input.
+ */
+template <class Config, class RandomIt, class KeyOf = utils::identity_key>
+void sort_with_model(
+    RandomIt begin, RandomIt end, TwoLayerRMI<key_type_t<RandomIt, KeyOf>> &rmi,
+    sort_scratch<typename iterator_traits<RandomIt>::value_type, Config>
+        &scratch,
+    const KeyOf &key_of = KeyOf(), model_drift *drift = nullptr) {
+  // Cache the model parameters
+  const flat_rmi model = flatten_model(rmi, scratch.model_storage);
+
+  // The keys that get their own equality buckets
+  heavy_keys<key_type_t<RandomIt, KeyOf>> heavy;
+  find_heavy_keys(rmi.training_sample, model, Config::PRIMARY_FANOUT, heavy);
+
+  sort_with_model(begin, end, model, heavy, rmi.hp, rmi.enable_dups_detection,
+                  scratch, key_of, drift);
+}
+
+}  // namespace internal
+
+/**
+ * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
+ * Sort and a trained CDF model, in ascending order.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+ * @param begin Random-access iterators to the initial position of the
+ * sequence to be used for sorting. The range used is [begin,end), which
+ * contains all the elements between first and last, including the element
+ * pointed by first but not the element pointed by last.
+ * @param end Random-access iterators to the last position of the sequence to
+ * be used for sorting. The range used is [begin,end), which contains all the
+ * elements between first and last, including the element pointed by first but
+ * not the element pointed by last.
+ * @param rmi A trained CDF model of the keys.
+ */
+template <class RandomIt>
+void sort(RandomIt begin, RandomIt end,
+          TwoLayerRMI<typename iterator_traits<RandomIt>::value_type> &rmi) {
+  typedef typename iterator_traits<RandomIt>::value_type T;
+  internal::with_tuned_config<T>(
+      std::distance(begin, end), [&](auto config) {
+        internal::sort_scratch<T, decltype(config)> scratch;
+        internal::sort_with_model(begin, end, rmi, scratch);
+      });
+}
+
+/**
+ * @brief Sorts a sequence of records from [begin, end) by their numerical keys
+ * using Learned Sort, in ascending order. The CDF model is trained on the keys,
+ * and the whole records are moved through the partitioning and the counting
+ * sort. Records with equal keys may end up in any order.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of
+ * records
+ * @tparam KeyOf The type of a functor that returns the numerical key of a
+ * record
+ * @param begin Random-access iterator to the first record.
+ * @param end Random-access iterator past the last record.
+ * @param key_of The functor that returns the numerical key of a record.
+ * @param params The hyperparameters for the CDF model, which describe the
+ * architecture and sampling ratio.
+ */
+template <class RandomIt, class KeyOf>
+  requires std::is_invocable_v<const KeyOf &,
+                               typename iterator_traits<RandomIt>::reference>
+void sort(RandomIt begin, RandomIt end, const KeyOf &key_of,
+          typename TwoLayerRMI<key_type_t<RandomIt, KeyOf>>::Params &params) {
+  typedef typename iterator_traits<RandomIt>::value_type T;
+
+  // Sort the inputs that need no CDF model
+  if (internal::sort_without_model(begin, end, params, key_of)) {
+    return;
+  }
+
+  // Initialize the RMI
+  TwoLayerRMI<key_type_t<RandomIt, KeyOf>> rmi(params);
+
+  // Check if the model can be trained
+  if (rmi.train(begin, end, key_of)) {
+    // Sort the data if the model was successfully trained
+    internal::with_tuned_config<T>(
+        std::distance(begin, end), [&](auto config) {
+          internal::sort_scratch<T, decltype(config)> scratch;
+          internal::sort_with_model(begin, end, rmi, scratch, key_of);
+        });
+  }
+
+  else {  // Fall back in case the model could not be trained
+    std::sort(begin, end, internal::key_less<KeyOf>{key_of});
+  }
+}
+
+/**
+ * @brief Sorts a sequence of records from [begin, end) by their numerical keys
+ * using Learned Sort, in ascending order.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of
+ * records
+ * @tparam KeyOf The type of a functor that returns the numerical key of a
+ * record
+ * @param begin Random-access iterator to the first record.
+ * @param end Random-access iterator past the last record.
+ * @param key_of The functor that returns the numerical key of a record.
+ */
+template <class RandomIt, class KeyOf>
+  requires std::is_invocable_v<const KeyOf &,
+                               typename iterator_traits<RandomIt>::reference>
+void sort(RandomIt begin, RandomIt end, const KeyOf &key_of) {
+  if (begin != end) {
+    typename TwoLayerRMI<key_type_t<RandomIt, KeyOf>>::Params p;
+    learned_sort::sort(begin, end, key_of, p);
+  }
+}
+
+/**
+ * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
+ * Sort, in ascending order.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+ * @param begin Random-access iterators to the initial position of the
+ * sequence to be used for sorting. The range used is [begin,end), which
+ * contains all the elements between first and last, including the element
+ * pointed by first but not the element pointed by last.
+ * @param end Random-access iterators to the last position of the sequence to
+ * be used for sorting. The range used is [begin,end), which contains all the
+ * elements between first and last, including the element pointed by first but
+ * not the element pointed by last.
+ * @param params The hyperparameters for the CDF model, which describe the
+ * architecture and sampling ratio.
+ */
+template <class RandomIt>
+void sort(
+    RandomIt begin, RandomIt end,
+    typename TwoLayerRMI<typename iterator_traits<RandomIt>::value_type>::Params
+        &params) {
+  learned_sort::sort(begin, end, utils::identity_key(), params);
+}
+
+/**
+ * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
+ * Sort, in ascending order.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+ * @param begin Random-access iterators to the initial position of the
+ * sequence to be used for sorting. The range used is [begin,end), which
+ * contains all the elements between first and last, including the element
+ * pointed by first but not the element pointed by last.
+ * @param end Random-access iterators to the last position of the sequence to
+ * be used for sorting. The range used is [begin,end), which contains all the
+ * elements between first and last, including the element pointed by first but
+ * not the element pointed by last.
+ */
+template <class RandomIt>
+void sort(RandomIt begin, RandomIt end) {
+  if (begin != end) {
+    typename TwoLayerRMI<typename iterator_traits<RandomIt>::value_type>::Params
+        p;
+    learned_sort::sort(begin, end, p);
+  }
+}
+
+/**
+ * @brief Sorts sequences of numerical keys of type T using Learned Sort, while
+ * keeping the CDF model, its training data, and the scratch memory of the
+ * partitioning between the sorts. This avoids the allocations and page faults
+ * of the free sorting functions when many inputs are sorted one after another.
+ *
+ * By default the model is retrained for every input. A sorter can instead
+ * reuse the model of one input for the following ones (see set_model_reuse),
+ * which skips the training of inputs that come from the same distribution. The
+ * sorter then measures while it sorts how well the model still fits the inputs
+ * (see drift), and retrains it for the next input once it has drifted.
+ *
+ * A sorter is not thread-safe, so each thread should use its own sorter.
+ *
+ * @tparam T The type of the keys
+ */
+template <class T>
+class LearnedSorter {
+ public:
+  typedef typename TwoLayerRMI<T>::Params Params;
+
+  // Constructs a sorter that uses the default hyperparameters
+  LearnedSorter() : LearnedSorter(Params()) {}
+
+  // Constructs a sorter that uses the given hyperparameters for every input
+  explicit LearnedSorter(const Params &params)
+      : params(params),
+        rmi(params),
+        reuse(false),
+        retrain_on_drift(true),
+        drift_tolerance(DEFAULT_DRIFT_TOLERANCE),
+        has_model(false) {}
+
+  LearnedSorter(const LearnedSorter &) = delete;
+  LearnedSorter &operator=(const LearnedSorter &) = delete;
+
+  /**
+   * @brief Sets whether the model is kept across the inputs instead of being
+   * retrained for every input. A kept model is trained on the next input that
+   * needs one, and it is then reused until it drifts.
+   *
+   * @param reuse Whether to keep the model across the inputs.
+   * @param retrain_on_drift Whether to retrain the model on the next input
+   * once it has drifted, or to only report the drift and keep the model.
+   * @param drift_tolerance How many times larger than on the training input the
+   * measures of the drift may grow before the model counts as drifted (see
+   * model_drift::exceeds), which must be at least 1.
+   */
+  void set_model_reuse(bool reuse, bool retrain_on_drift = true,
+                       double drift_tolerance = DEFAULT_DRIFT_TOLERANCE) {
+    if (drift_tolerance < 1) {
+      drift_tolerance = DEFAULT_DRIFT_TOLERANCE;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid drift tolerance. Using "
+              "default ("
+           << DEFAULT_DRIFT_TOLERANCE << ")." << endl;
+    }
+    this->reuse = reuse;
+    this->retrain_on_drift = retrain_on_drift;
+    this->drift_tolerance = drift_tolerance;
+    this->has_model = false;
+  }
+
+  // Returns how well the kept model fitted the last input, and whether it had
+  // drifted from the input that it was trained on. The measures are zero when
+  // the last input was sorted without a kept model.
+  const model_drift &drift() const { return last_drift; }
+
+  // Forgets the kept model, so that the next input retrains it
+  void invalidate_model() { has_model = false; }
+
+  /**
+   * @brief Sorts a sequence of numerical keys from [begin, end) in ascending
+   * order, reusing the memory of the previous sorts.
+   *
+   * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+   * @param begin Random-access iterators to the initial position of the
+   * sequence to be used for sorting. The range used is [begin,end), which
+   * contains all the elements between first and last, including the element
+   * pointed by first but not the element pointed by last.
+   * @param end Random-access iterators to the last position of the sequence to
+   * be used for sorting. The range used is [begin,end), which contains all the
+   * elements between first and last, including the element pointed by first
+   * but not the element pointed by last.
+   */
+  template <class RandomIt>
+  void sort(RandomIt begin, RandomIt end) {
+    static_assert(
+        std::is_same<typename iterator_traits<RandomIt>::value_type, T>::value,
+        "The keys must be of the sorter's type");
+
+    // The drift is only measured on the inputs that a kept model sorts
+    last_drift = model_drift();
+
+    // Sort the inputs that need no CDF model
+    if (begin == end || internal::sort_without_model(begin, end, params)) {
+      return;
+    }
+
+    if (!reuse) {
+      // Retrain the RMI on the new input
+      rmi.reset(params);
+      if (rmi.train(begin, end)) {
+        internal::with_tuned_config<T>(
+            std::distance(begin, end), [&](auto config) {
+              internal::sort_with_model(
+                  begin, end, rmi, scratch.template get<decltype(config)>());
+            });
+      } else {  // Fall back in case the model could not be trained
+        std::sort(begin, end);
+      }
+      return;
+    }
+
+    // Train the kept model when there is none yet, or when it has drifted
+    const bool retrain = !has_model;
+    if (retrain) {
+      rmi.reset(params);
+      if (!rmi.train(begin, end)) {
+        std::sort(begin, end);
+        return;
+      }
+      has_model = true;
+    }
+
+    model_drift cur_drift;
+    internal::with_tuned_config<T>(
+        std::distance(begin, end), [&](auto config) {
+          internal::sort_with_model(begin, end, rmi,
+                                    scratch.template get<decltype(config)>(),
+                                    utils::identity_key(), &cur_drift);
+        });
+
+    // The measures on the training input are the baseline of the later ones
+    if (retrain) {
+      baseline_drift = cur_drift;
+    } else {
+      cur_drift.drifted = cur_drift.exceeds(baseline_drift, drift_tolerance);
+      if (cur_drift.drifted && retrain_on_drift) has_model = false;
+    }
+    last_drift = cur_drift;
+  }
+
+ private:
+  // The hyperparameters used for every input
+  Params params;
+
+  // The CDF model, which is retrained for every input unless it is reused
+  TwoLayerRMI<T> rmi;
+
+  // The options of the reuse of the model (see set_model_reuse)
+  bool reuse;
+  bool retrain_on_drift;
+  double drift_tolerance;
+
+  // Whether the kept model is trained and can sort the next input
+  bool has_model;
+
+  // The drift measured on the input that the kept model was trained on, and on
+  // the last input that it sorted
+  model_drift baseline_drift;
+  model_drift last_drift;
+
+  // Scratch memory for the partitioning and the bucket sorting, for each of
+  // the configurations that the inputs are sorted with
+  typename internal::tuned_scratch_arenas<T>::type scratch;
+};
+
+namespace internal {
+
+// A key and its position in the input, which are sorted together by argsort
+template <class K, class Index>
+struct indexed_key {
+  K key;
+  Index idx;
+};
+
+// Extracts the key of an indexed_key
+struct key_of_indexed_key {
+  template <class K, class Index>
+  K operator()(const indexed_key<K, Index> &r) const {
+    return r.key;
+  }
+};
+
+// Reorders a column so that its i-th element becomes the element at position
+// perm[i], by gathering the elements into a new column
+template <class IndexIt, class T>
+void permute_column(IndexIt perm, long perm_sz, vector<T> &column) {
+  vector<T> permuted(perm_sz);
+  for (long idx = 0; idx < perm_sz; ++idx) {
+    permuted[idx] = column[perm[idx]];
+  }
+  column.swap(permuted);
+}
+
+// The positions of a permutation, grouped so that the columns can be permuted
+// block by block. The columns are split into blocks of 2^block_bits elements.
+// The positions that are read are grouped by the block they read from, and
+// the elements that are read are written to a buffer where they are grouped by
+// the block of the permuted column that they belong to. Both the random reads
+// and the random writes then stay within one block at a time, at the cost of
+// building the grouping once for all the columns.
+template <class Index>
+struct blocked_permutation {
+  long block_bits;
+
+  // The positions that are read, grouped by their block
+  vector<Index> reads;
+
+  // The position in the buffer of each element that is read
+  vector<Index> buffer_pos;
+
+  // The position in the permuted column of each element of the buffer
+  vector<Index> writes;
+
+  // Building the blocked permutation costs about as much as permuting two
+  // columns directly, and permuting a column by blocks is only faster once it
+  // spans many blocks, so the tables of fewer columns or blocks are permuted
+  // directly
+  static constexpr long MIN_COLUMNS = 4;
+  static constexpr long MIN_BLOCKS = 256;
+
+  // Returns the number of bits of a block, whose elements of elm_sz bytes fill
+  // a quarter of the L2 cache, so that the block is not evicted by the
+  // positions and the buffer that are streamed through the cache
+  static long block_bits_for(long elm_sz) {
+    const long block_sz =
+        std::max(1L, utils::get_cache_sizes().l2 / 4 / elm_sz);
+    return std::max(1L, (long)std::bit_width((unsigned long)block_sz) - 1);
+  }
+
+  // Groups the positions of the permutation
+  template <class IndexIt>
+  blocked_permutation(IndexIt perm, long perm_sz, long block_bits)
+      : block_bits(block_bits),
+        reads(perm_sz),
+        buffer_pos(perm_sz),
+        writes(perm_sz) {
+    const long num_blocks = ((perm_sz - 1) >> block_bits) + 1;
+
+    // Count the positions that are read from each block
+    vector<long> read_offsets(num_blocks + 1, 0);
+    for (long idx = 0; idx < perm_sz; ++idx) {
+      ++read_offsets[(perm[idx] >> block_bits) + 1];
+    }
+    std::partial_sum(read_offsets.begin(), read_offsets.end(),
+                     read_offsets.begin());
+
+    // Group the positions that are read by their block, and keep the position
+    // in the permuted column of each of them in the writes, temporarily
+    vector<Index> read_dests(perm_sz);
+    for (long idx = 0; idx < perm_sz; ++idx) {
+      const long pos = read_offsets[perm[idx] >> block_bits]++;
+      this->reads[pos] = perm[idx];
+      read_dests[pos] = idx;
+    }
+
+    // The elements of each block of the permuted column take the same range of
+    // the buffer as in the column
+    vector<long> write_offsets(num_blocks);
+    for (long block = 0; block < num_blocks; ++block) {
+      write_offsets[block] = block << block_bits;
+    }
+    for (long pos = 0; pos < perm_sz; ++pos) {
+      const long buf_pos = write_offsets[read_dests[pos] >> block_bits]++;
+      this->buffer_pos[pos] = buf_pos;
+      this->writes[buf_pos] = read_dests[pos];
+    }
+  }
+
+  // Permutes a column through a buffer of as many elements
+  template <class T>
+  void permute(vector<T> &column, T *buffer) const {
+    const long perm_sz = this->reads.size();
+    for (long pos = 0; pos < perm_sz; ++pos) {
+      buffer[this->buffer_pos[pos]] = column[this->reads[pos]];
+    }
+    for (long pos = 0; pos < perm_sz; ++pos) {
+      column[this->writes[pos]] = buffer[pos];
+    }
+  }
+};
+
+}  // namespace internal
+
+/**
+ * @brief Computes the permutation that sorts a sequence of numerical keys from
+ * [begin, end) in ascending order, using Learned Sort. The keys are paired with
+ * their positions, and the pairs are sorted through the same partitioning and
+ * counting sort as the keys themselves. The keys are left untouched.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+ * @tparam IndexIt A random-access iterator over unsigned integers, such as
+ * uint32_t or uint64_t, that can represent the positions of all the keys
+ * @param begin Random-access iterator to the first key.
+ * @param end Random-access iterator past the last key.
+ * @param indices Random-access iterator to the first of end - begin positions,
+ * where the permutation is written. The i-th position is the position in
+ * [begin, end) of the i-th smallest key.
+ * @param params The hyperparameters for the CDF model, which describe the
+ * architecture and sampling ratio.
+ * @return true if the permutation was computed, false if the index type cannot
+ * represent the positions of all the keys.
+ */
+template <class RandomIt, class IndexIt>
+bool argsort(
+    RandomIt begin, RandomIt end, IndexIt indices,
+    typename TwoLayerRMI<typename iterator_traits<RandomIt>::value_type>::Params
+        &params) {
+  typedef typename iterator_traits<RandomIt>::value_type T;
+  typedef typename iterator_traits<IndexIt>::value_type Index;
+  static_assert(std::is_unsigned<Index>::value,
+                "The positions must be of an unsigned integer type");
+
+  // The index type must represent the positions of all the keys
+  const long input_sz = std::distance(begin, end);
+  if (input_sz > 0 && static_cast<unsigned long>(input_sz - 1) >
+                          std::numeric_limits<Index>::max()) {
+    return false;
+  }
+
+  // Pair each key with its position
+  vector<internal::indexed_key<T, Index>> records(input_sz);
+  for (long idx = 0; idx < input_sz; ++idx) {
+    records[idx] = {begin[idx], static_cast<Index>(idx)};
+  }
+
+  if (input_sz > 0) {
+    learned_sort::sort(records.begin(), records.end(),
+                       internal::key_of_indexed_key(), params);
+  }
+
+  for (long idx = 0; idx < input_sz; ++idx) {
+    indices[idx] = records[idx].idx;
+  }
+  return true;
+}
+
+/**
+ * @brief Computes the permutation that sorts a sequence of numerical keys from
+ * [begin, end) in ascending order, using Learned Sort.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+ * @tparam IndexIt A random-access iterator over unsigned integers, such as
+ * uint32_t or uint64_t, that can represent the positions of all the keys
+ * @param begin Random-access iterator to the first key.
+ * @param end Random-access iterator past the last key.
+ * @param indices Random-access iterator to the first of end - begin positions,
+ * where the permutation is written.
+ * @return true if the permutation was computed, false if the index type cannot
+ * represent the positions of all the keys.
+ */
+template <class RandomIt, class IndexIt>
+bool argsort(RandomIt begin, RandomIt end, IndexIt indices) {
+  typename TwoLayerRMI<typename iterator_traits<RandomIt>::value_type>::Params
+      p;
+  return learned_sort::argsort(begin, end, indices, p);
+}
+
+/**
+ * @brief Reorders several columns by a permutation, such as the one computed
+ * by argsort, so that the i-th element of each column becomes the element at
+ * position perm[i]. Large tables are permuted block by block: the positions
+ * are grouped once by the blocks of the columns that they read from and write
+ * to, and each column is then gathered into a buffer and written back with its
+ * random accesses confined to one block at a time. Small tables, or tables of
+ * few columns, are gathered directly, one column at a time.
+ *
+ * @tparam IndexIt A random-access iterator over the positions
+ * @tparam Ts The types of the elements of the columns
+ * @param perm_begin Random-access iterator to the first position.
+ * @param perm_end Random-access iterator past the last position.
+ * @param columns The columns, which must have as many elements as the
+ * permutation.
+ */
+template <class IndexIt, class... Ts>
+void apply_permutation(IndexIt perm_begin, IndexIt perm_end,
+                       vector<Ts> &...columns) {
+  typedef typename iterator_traits<IndexIt>::value_type Index;
+  typedef internal::blocked_permutation<Index> blocked_permutation;
+  constexpr long MAX_ELM_SZ = std::max({sizeof(Ts)...});
+  const long perm_sz = std::distance(perm_begin, perm_end);
+
+  // The columns share one buffer, in which the elements of every column must
+  // fit and can be copied bytewise
+  constexpr bool SHARES_BUFFER =
+      ((std::is_trivially_copyable_v<Ts> &&
+        alignof(Ts) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) &&
+       ...);
+  const long block_bits = blocked_permutation::block_bits_for(MAX_ELM_SZ);
+  if (!SHARES_BUFFER ||
+      (long)sizeof...(Ts) < blocked_permutation::MIN_COLUMNS ||
+      (perm_sz >> block_bits) < blocked_permutation::MIN_BLOCKS) {
+    (internal::permute_column(perm_begin, perm_sz, columns), ...);
+    return;
+  }
+
+  const blocked_permutation blocked(perm_begin, perm_sz, block_bits);
+  std::unique_ptr<std::byte[]> buffer(new std::byte[perm_sz * MAX_ELM_SZ]);
+  (blocked.permute(columns, reinterpret_cast<Ts *>(buffer.get())), ...);
+}
+
+namespace internal {
 
-            // Place the swap buffer into the emptied space
-            std::copy(swap_buffer, swap_buffer + PRIMARY_FRAGMENT_CAPACITY,
-                      itr_buf2);
+/**
+ * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
+ * Sort, multiple threads, and a trained CDF model, in ascending order. The
+ * number of threads is taken from the hyperparameters of the given RMI.
+ *
+ * Each thread partitions a stripe of the input into its own set of primary
+ * fragments and flushes the full fragments back to the beginning of its
+ * stripe. The full fragments are then moved in parallel to the primary buckets
+ * they belong to, and the remaining keys are placed in the gaps at the edges
+ * of each bucket. Finally, the primary buckets are sorted independently by a
+ * work-stealing pool of tasks, where large buckets are split into several
+ * tasks after their secondary partitioning.
+ *
+ * @tparam Config The fanouts and the fragment capacities of the partitioning
+ * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+ * @param begin Random-access iterators to the initial position of the
+ * sequence to be used for sorting. The range used is [begin,end), which
+ * contains all the elements between first and last, including the element
+ * pointed by first but not the element pointed by last.
+ * @param end Random-access iterators to the last position of the sequence to
+ * be used for sorting. The range used is [begin,end), which contains all the
+ * elements between first and last, including the element pointed by first but
+ * not the element pointed by last.
+ * @param rmi A trained CDF model of the keys.
+ * @param key_of Extracts the numerical key of each record.
+ */
+template <class Config, class RandomIt, class KeyOf = utils::identity_key>
+void parallel_sort_with_model(RandomIt begin, RandomIt end,
+                              TwoLayerRMI<key_type_t<RandomIt, KeyOf>> &rmi,
+                              const KeyOf &key_of = KeyOf()) {
+  //----------------------------------------------------------//
+  //                          INIT                            //
+  //----------------------------------------------------------//
 
-            pred_bucket_for_cur_fragment =
-                pred_bucket_for_fragment_to_be_swapped_out;
-          } else {  // The fragment at the write offset is already in the right
-                    // bucket
-            bucket_write_off[pred_bucket_for_cur_fragment] +=
-                PRIMARY_FRAGMENT_CAPACITY;
-          }
+  // Determine the data type
+  typedef typename iterator_traits<RandomIt>::value_type T;
 
-          // Decrement the fragment index so that the newly swapped in fragment
-          // is not skipped over
-          --fragment_idx;
-        }
-      }
-    }
+  // Constants
+  const long input_sz = std::distance(begin, end);
+  constexpr long PRIMARY_FANOUT = Config::PRIMARY_FANOUT;
+  constexpr long SECONDARY_FANOUT = Config::SECONDARY_FANOUT;
+  constexpr long PRIMARY_FRAGMENT_CAPACITY = Config::PRIMARY_FRAGMENT_CAPACITY;
+  constexpr long SECONDARY_FRAGMENT_CAPACITY =
+      Config::SECONDARY_FRAGMENT_CAPACITY;
+
+  // Each thread is given a stripe of at least this many elements
+  static constexpr long MIN_STRIPE_SZ =
+      PRIMARY_FANOUT * PRIMARY_FRAGMENT_CAPACITY;
+
+  // Fall back to the sequential algorithm for small inputs
+  long num_threads = std::min(rmi.hp.num_threads, input_sz / MIN_STRIPE_SZ);
+  if (num_threads <= 1) {
+    sort_scratch<T, Config> scratch;
+    sort_with_model(begin, end, rmi, scratch, key_of);
+    return;
+  }
 
-    // Add the elements remaining in the auxiliary fragments to the buckets they
-    // belong to. This is for when the fragments weren't full and thus not
-    // flushed to the input array
-    for (long bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
-      // Set the writing offset to the beggining of the bucket
-      long write_off = bucket_end_offset[bucket_idx - 1];
-      if (bucket_idx == 0) {
-        write_off = 0;
-      }
+  // The stripe sizes are multiples of PRIMARY_FRAGMENT_CAPACITY, so that the
+  // fragments flushed by all threads are aligned in the input
+  const long stripe_sz =
+      (input_sz + num_threads * PRIMARY_FRAGMENT_CAPACITY - 1) /
+      (num_threads * PRIMARY_FRAGMENT_CAPACITY) * PRIMARY_FRAGMENT_CAPACITY;
+  num_threads = (input_sz + stripe_sz - 1) / stripe_sz;
 
-      // Add the elements left in the auxiliary fragments to the beggining of
-      // the predicted bucket, since it was not full
-      long elm_idx;
-      for (elm_idx = 0; (elm_idx < fragment_sizes[bucket_idx]) &&
-                        (write_off % PRIMARY_FRAGMENT_CAPACITY != 0);
-           ++elm_idx) {
-        begin[write_off++] = fragments[bucket_idx][elm_idx];
-      }
+  // Cache the model parameters
+  internal::flat_model_storage model_storage;
+  const internal::flat_rmi model =
+      internal::flatten_model(rmi, model_storage);
 
-      // Add the remaining elements from the auxiliary fragments to the end of
-      // the bucket it belongs to
-      write_off = bucket_end_offset[bucket_idx] - fragment_sizes[bucket_idx];
-      for (; elm_idx < fragment_sizes[bucket_idx]; ++elm_idx) {
-        begin[write_off + elm_idx] = fragments[bucket_idx][elm_idx];
-        ++bucket_write_off[bucket_idx];
-      }
-    }
+  // Maps the predicted CDFs to the primary buckets
+  const internal::bucket_map primary_map{1. * PRIMARY_FANOUT, 0.,
+                                         PRIMARY_FANOUT - 1.};
 
-    // Cleanup
-    delete[] swap_buffer;
-    delete[] fragments;
-  }
+  // The keys that get their own equality buckets
+  internal::heavy_keys<key_type_t<RandomIt, KeyOf>> heavy;
+  internal::find_heavy_keys(rmi.training_sample, model, PRIMARY_FANOUT, heavy);
+
+  // Keeps track of the number of elements in each bucket
+  long primary_bucket_sizes[PRIMARY_FANOUT]{0};
+
+  // Records the starting offset of each bucket, plus the end of the input
+  long bucket_start_off[PRIMARY_FANOUT + 1]{0};
 
   //----------------------------------------------------------//
-  //                SECOND ROUND OF PARTITIONING              //
+  //              PARTITION THE KEYS INTO BUCKETS             //
   //----------------------------------------------------------//
 
   {
-    // Iterate over each bucket starting from the end so that the merging step
-    // later is done in-place
-    auto primary_bucket_start = begin;
-    auto primary_bucket_end = begin;
-    for (long primary_bucket_idx = 0; primary_bucket_idx < PRIMARY_FANOUT;
-         ++primary_bucket_idx) {
-      auto primary_bucket_sz = primary_bucket_sizes[primary_bucket_idx];
+    // The per-thread auxiliary fragments where the elements will be
+    // partitioned, and the number of elements in each of them
+    vector<T(*)[PRIMARY_FRAGMENT_CAPACITY]> fragments(num_threads);
+    vector<array<long, PRIMARY_FANOUT>> fragment_sizes(num_threads);
+
+    // Keeps track of the number of elements each thread found for each bucket
+    vector<array<long, PRIMARY_FANOUT>> thread_bucket_sizes(num_threads);
+
+    // The input is viewed as a sequence of slots of PRIMARY_FRAGMENT_CAPACITY
+    // elements each, where only the last slot may be partial. This records the
+    // bucket of the full fragment that was flushed into each slot, or -1 if
+    // the slot is empty.
+    const long num_slots =
+        (input_sz + PRIMARY_FRAGMENT_CAPACITY - 1) / PRIMARY_FRAGMENT_CAPACITY;
+    vector<int> slot_bucket(num_slots, -1);
+
+    // For each element in its stripe, each thread predicts which bucket it
+    // would go to, and inserts it to the respective thread-local fragment
+    utils::run_in_parallel(num_threads, [&](long thread_idx) {
+      auto stripe_begin = begin + thread_idx * stripe_sz;
+      auto stripe_end =
+          begin + std::min(input_sz, (thread_idx + 1) * stripe_sz);
+
+      // Allocate the fragments from the thread that will be writing to them
+      auto local_fragments = new T[PRIMARY_FANOUT][PRIMARY_FRAGMENT_CAPACITY];
+      fragments[thread_idx] = local_fragments;
+      auto &local_fragment_sizes = fragment_sizes[thread_idx];
+      auto &local_bucket_sizes = thread_bucket_sizes[thread_idx];
+      local_fragment_sizes.fill(0);
+      local_bucket_sizes.fill(0);
+
+      // Points to the next free space where to write back
+      auto write_itr = stripe_begin;
+      long write_slot = thread_idx * stripe_sz / PRIMARY_FRAGMENT_CAPACITY;
+
+      // The keys are predicted and scattered in batches, like in the
+      // sequential algorithm
+      const long batch_sz = rmi.hp.batch_sz;
+      vector<long> pred_buckets(batch_sz);
+      const long stripe_len = std::distance(stripe_begin, stripe_end);
+
+      for (long elm_idx = 0; elm_idx < stripe_len; ++elm_idx) {
+        // Predict the buckets of the next batch of keys
+        const long batch_elm_idx = elm_idx % batch_sz;
+        if (batch_elm_idx == 0) {
+          internal::predict_buckets(stripe_begin + elm_idx,
+                                    std::min(batch_sz, stripe_len - elm_idx),
+                                    model, -1, primary_map,
+                                    pred_buckets.data(), key_of);
+        }
 
-      // Skip bucket if empty
-      if (primary_bucket_sz == 0) continue;
+        // Prefetch the fragment slot of an upcoming key in the batch
+        if (batch_elm_idx + PREFETCH_DISTANCE < batch_sz &&
+            elm_idx + PREFETCH_DISTANCE < stripe_len) {
+          long ahead_bucket_idx =
+              pred_buckets[batch_elm_idx + PREFETCH_DISTANCE];
+          __builtin_prefetch(&local_fragments[ahead_bucket_idx]
+                                             [local_fragment_sizes
+                                                  [ahead_bucket_idx]],
+                             1);
+        }
 
-      // Update the start and the end of the bucket data
-      primary_bucket_start = primary_bucket_end;
-      primary_bucket_end += primary_bucket_sz;
-
-      // Check for homogeneity
-      bool is_homogeneous = true;
-      if (rmi.enable_dups_detection) {
-        for (long elm_idx = 1; elm_idx < primary_bucket_sz; ++elm_idx) {
-          if (primary_bucket_start[elm_idx] !=
-              primary_bucket_start[elm_idx - 1]) {
-            is_homogeneous = false;
-            break;
-          }
+        long pred_bucket_idx = pred_buckets[batch_elm_idx];
+
+        // Place the current element in the predicted fragment
+        local_fragments[pred_bucket_idx]
+                       [local_fragment_sizes[pred_bucket_idx]] =
+                           stripe_begin[elm_idx];
+
+        // Update the fragment size and the bucket size
+        ++local_bucket_sizes[pred_bucket_idx];
+        ++local_fragment_sizes[pred_bucket_idx];
+
+        if (local_fragment_sizes[pred_bucket_idx] ==
+            PRIMARY_FRAGMENT_CAPACITY) {
+          // The predicted fragment is full, place it in the stripe
+          std::move(local_fragments[pred_bucket_idx],
+                    local_fragments[pred_bucket_idx] +
+                        PRIMARY_FRAGMENT_CAPACITY,
+                    write_itr);
+          write_itr += PRIMARY_FRAGMENT_CAPACITY;
+          slot_bucket[write_slot++] = pred_bucket_idx;
+
+          // Reset the fragment size
+          local_fragment_sizes[pred_bucket_idx] = 0;
         }
       }
+    });
 
-      // When the bucket is homogeneous, skip sorting it
-      if (rmi.enable_dups_detection && is_homogeneous) {
-        num_elms_finalized += primary_bucket_sz;
+    //----------------------------------------------------------//
+    //                     DEFRAGMENTATION                      //
+    //----------------------------------------------------------//
 
+    // Keeps track of the number of full fragments in each bucket
+    long num_full_fragments[PRIMARY_FANOUT]{0};
+
+    // The first slot where the full fragments of each bucket will be placed,
+    // which is the first slot that starts inside the bucket
+    long first_slot[PRIMARY_FANOUT]{0};
+
+    for (long thread_idx = 0; thread_idx < num_threads; ++thread_idx) {
+      for (long bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+        primary_bucket_sizes[bucket_idx] +=
+            thread_bucket_sizes[thread_idx][bucket_idx];
+        num_full_fragments[bucket_idx] +=
+            (thread_bucket_sizes[thread_idx][bucket_idx] -
+             fragment_sizes[thread_idx][bucket_idx]) /
+            PRIMARY_FRAGMENT_CAPACITY;
       }
+    }
 
-      // When the bucket is not homogeneous, and it's not flagged for duplicates
-      else {
-        //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
-        //        PARTITION THE KEYS INTO SECONDARY BUCKETS         //
-        //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
-
-        // Keeps track of the number of elements in each secondary bucket
-        long secondary_bucket_sizes[SECONDARY_FANOUT]{0};
-
-        // Keeps track of the number of elements in each fragment
-        long fragment_sizes[SECONDARY_FANOUT]{0};
-
-        // An auxiliary set of fragments where the elements will be partitioned
-        auto fragments = new T[SECONDARY_FANOUT][SECONDARY_FRAGMENT_CAPACITY];
-
-        // Keeps track of the number of fragments that have been written back to
-        // the original array
-        long fragments_written = 0;
-
-        // Points to the next free space where to write back
-        auto write_itr = primary_bucket_start;
-
-        // For each element in the input, predict which bucket it would go to,
-        // and insert to the respective bucket fragment
-        for (auto it = primary_bucket_start; it != primary_bucket_end; ++it) {
-          // Predict the model id in the leaf layer of the RMI
-          long pred_bucket_idx = static_cast<long>(
-              std::max(0., std::min(num_leaf_models - 1.,
-                                    root_slope * it[0] + root_intercept)));
-
-          // Predict the CDF
-          double pred_cdf =
-              slopes[pred_bucket_idx] * it[0] + intercepts[pred_bucket_idx];
-
-          // Get the predicted bucket id
-          pred_bucket_idx = static_cast<long>(std::max(
-              0., std::min(SECONDARY_FANOUT - 1.,
-                           (pred_cdf * PRIMARY_FANOUT - primary_bucket_idx) *
-                               SECONDARY_FANOUT)));
-
-          // Place the current element in the predicted fragment
-          fragments[pred_bucket_idx][fragment_sizes[pred_bucket_idx]] = it[0];
-
-          // Update the fragment size and the bucket size
-          ++secondary_bucket_sizes[pred_bucket_idx];
-          ++fragment_sizes[pred_bucket_idx];
-
-          if (fragment_sizes[pred_bucket_idx] == SECONDARY_FRAGMENT_CAPACITY) {
-            ++fragments_written;
-            // The predicted fragment is full, place in the array and update
-            // bucket size
-            std::move(fragments[pred_bucket_idx],
-                      fragments[pred_bucket_idx] + SECONDARY_FRAGMENT_CAPACITY,
-                      write_itr);
-            write_itr += SECONDARY_FRAGMENT_CAPACITY;
-
-            // Reset the fragment size
-            fragment_sizes[pred_bucket_idx] = 0;
-          }
-        }  // end of partitioninig over secondary fragments
+    for (long bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+      bucket_start_off[bucket_idx + 1] =
+          bucket_start_off[bucket_idx] + primary_bucket_sizes[bucket_idx];
+      first_slot[bucket_idx] =
+          (bucket_start_off[bucket_idx] + PRIMARY_FRAGMENT_CAPACITY - 1) /
+          PRIMARY_FRAGMENT_CAPACITY;
+    }
 
-        //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
-        //                      DEFRAGMENTATION                     //
-        //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+    // Assign a destination slot to each full fragment. The fragments that are
+    // already within the slots of their bucket are left where they are, and the
+    // others take the remaining slots of their bucket in order.
+    vector<long> slot_dest(num_slots, -1);
+    for (long slot_idx = 0; slot_idx < num_slots; ++slot_idx) {
+      long bucket_idx = slot_bucket[slot_idx];
+      if (bucket_idx >= 0 && slot_idx >= first_slot[bucket_idx] &&
+          slot_idx < first_slot[bucket_idx] + num_full_fragments[bucket_idx]) {
+        slot_dest[slot_idx] = slot_idx;
+      }
+    }
 
-        // Records the ending offset for the buckets
-        long bucket_end_offset[SECONDARY_FANOUT]{0};
-        bucket_end_offset[0] = secondary_bucket_sizes[0];
+    long next_free_slot[PRIMARY_FANOUT];
+    std::copy(first_slot, first_slot + PRIMARY_FANOUT, next_free_slot);
+    for (long slot_idx = 0; slot_idx < num_slots; ++slot_idx) {
+      long bucket_idx = slot_bucket[slot_idx];
+      if (bucket_idx >= 0 && slot_dest[slot_idx] < 0) {
+        while (slot_dest[next_free_slot[bucket_idx]] ==
+               next_free_slot[bucket_idx]) {
+          ++next_free_slot[bucket_idx];
+        }
+        slot_dest[slot_idx] = next_free_slot[bucket_idx]++;
+      }
+    }
 
-        // Swap space
-        T *swap_buffer = new T[SECONDARY_FRAGMENT_CAPACITY];
+    // The moves form disjoint chains, which start at a slot that nothing is
+    // moved into and end at an empty slot, and disjoint cycles. Find the
+    // starting slot of each of them, so that they can be followed in parallel.
+    vector<char> is_moved_into(num_slots, 0);
+    for (long slot_idx = 0; slot_idx < num_slots; ++slot_idx) {
+      if (slot_dest[slot_idx] >= 0 && slot_dest[slot_idx] != slot_idx) {
+        is_moved_into[slot_dest[slot_idx]] = 1;
+      }
+    }
 
-        // Maintains a writing iterator for each bucket, initialized at the
-        // starting offsets
-        long bucket_start_off[SECONDARY_FANOUT]{0};
-        bucket_start_off[0] = 0;
+    vector<long> move_starts;
+    vector<char> visited(num_slots, 0);
+    for (long slot_idx = 0; slot_idx < num_slots; ++slot_idx) {
+      if (slot_dest[slot_idx] >= 0 && slot_dest[slot_idx] != slot_idx &&
+          !is_moved_into[slot_idx]) {
+        move_starts.push_back(slot_idx);
+        for (long cur = slot_idx; cur >= 0 && !visited[cur];
+             cur = slot_dest[cur]) {
+          visited[cur] = 1;
+        }
+      }
+    }
+    for (long slot_idx = 0; slot_idx < num_slots; ++slot_idx) {
+      if (slot_dest[slot_idx] >= 0 && slot_dest[slot_idx] != slot_idx &&
+          !visited[slot_idx]) {
+        move_starts.push_back(slot_idx);
+        for (long cur = slot_idx; !visited[cur]; cur = slot_dest[cur]) {
+          visited[cur] = 1;
+        }
+      }
+    }
 
-        // Calculate the starting and ending offsets of each bucket
-        for (long bucket_idx = 1; bucket_idx < SECONDARY_FANOUT; ++bucket_idx) {
-          // Calculate the bucket end offsets (prefix sum)
-          bucket_end_offset[bucket_idx] = secondary_bucket_sizes[bucket_idx] +
-                                          bucket_end_offset[bucket_idx - 1];
+    // The destination of a fragment may be the last slot, which is partial
+    // when the input size is not a multiple of PRIMARY_FRAGMENT_CAPACITY. That
+    // fragment is written into an overflow buffer instead.
+    T *overflow_buffer = new T[PRIMARY_FRAGMENT_CAPACITY];
+
+    // Move the fragments along the chains and the cycles
+    std::atomic<long> next_move_start{0};
+    utils::run_in_parallel(num_threads, [&](long) {
+      T *cur_fragment = new T[PRIMARY_FRAGMENT_CAPACITY];
+      T *swap_buffer = new T[PRIMARY_FRAGMENT_CAPACITY];
+
+      for (long move_idx = next_move_start++;
+           move_idx < static_cast<long>(move_starts.size());
+           move_idx = next_move_start++) {
+        long start_slot = move_starts[move_idx];
+        auto read_itr = begin + start_slot * PRIMARY_FRAGMENT_CAPACITY;
+        std::copy(read_itr, read_itr + PRIMARY_FRAGMENT_CAPACITY, cur_fragment);
+
+        long cur_slot = slot_dest[start_slot];
+        while (cur_slot != start_slot && slot_bucket[cur_slot] >= 0) {
+          // The destination holds a fragment that needs to be moved as well
+          auto write_itr = begin + cur_slot * PRIMARY_FRAGMENT_CAPACITY;
+          std::copy(write_itr, write_itr + PRIMARY_FRAGMENT_CAPACITY,
+                    swap_buffer);
+          std::copy(cur_fragment, cur_fragment + PRIMARY_FRAGMENT_CAPACITY,
+                    write_itr);
+          std::swap(cur_fragment, swap_buffer);
+          cur_slot = slot_dest[cur_slot];
+        }
 
-          // Calculate the bucket start offsets and assign the writing
-          // iterator to that value
+        // The destination is either empty or the start of a cycle
+        if ((cur_slot + 1) * PRIMARY_FRAGMENT_CAPACITY > input_sz) {
+          std::copy(cur_fragment, cur_fragment + PRIMARY_FRAGMENT_CAPACITY,
+                    overflow_buffer);
+        } else {
+          std::copy(cur_fragment, cur_fragment + PRIMARY_FRAGMENT_CAPACITY,
+                    begin + cur_slot * PRIMARY_FRAGMENT_CAPACITY);
+        }
+      }
 
-          // These offsets are aligned w.r.t. SECONDARY_FRAGMENT_CAPACITY
-          bucket_start_off[bucket_idx] =
-              ceil(bucket_end_offset[bucket_idx - 1] * 1. /
-                   SECONDARY_FRAGMENT_CAPACITY) *
-              SECONDARY_FRAGMENT_CAPACITY;
+      delete[] swap_buffer;
+      delete[] cur_fragment;
+    });
+
+    // The last full fragment of a bucket may spill over into the next buckets.
+    // Save the spilled elements before the gaps of those buckets are filled.
+    T *spill_buffer = new T[PRIMARY_FANOUT * PRIMARY_FRAGMENT_CAPACITY];
+    long spill_sizes[PRIMARY_FANOUT]{0};
+
+    utils::run_in_parallel(num_threads, [&](long thread_idx) {
+      for (long bucket_idx = thread_idx; bucket_idx < PRIMARY_FANOUT;
+           bucket_idx += num_threads) {
+        if (num_full_fragments[bucket_idx] == 0) continue;
+
+        long last_fragment_off = (first_slot[bucket_idx] +
+                                  num_full_fragments[bucket_idx] - 1) *
+                                 PRIMARY_FRAGMENT_CAPACITY;
+        long bucket_end_off = bucket_start_off[bucket_idx + 1];
+        if (last_fragment_off + PRIMARY_FRAGMENT_CAPACITY <= bucket_end_off) {
+          continue;
+        }
 
-          // Fence the bucket iterator. This might occur because the write
-          // offset is not necessarily aligned with SECONDARY_FRAGMENT_CAPACITY
-          if (bucket_start_off[bucket_idx] > bucket_end_offset[bucket_idx]) {
-            bucket_start_off[bucket_idx] = bucket_end_offset[bucket_idx];
-          }
+        // The number of elements of the last fragment that fit in the bucket
+        long num_fitting = bucket_end_off - last_fragment_off;
+        spill_sizes[bucket_idx] = PRIMARY_FRAGMENT_CAPACITY - num_fitting;
+
+        auto spill_itr = spill_buffer + bucket_idx * PRIMARY_FRAGMENT_CAPACITY;
+        if (last_fragment_off + PRIMARY_FRAGMENT_CAPACITY > input_sz) {
+          std::copy(overflow_buffer, overflow_buffer + num_fitting,
+                    begin + last_fragment_off);
+          std::copy(overflow_buffer + num_fitting,
+                    overflow_buffer + PRIMARY_FRAGMENT_CAPACITY, spill_itr);
+        } else {
+          std::copy(begin + bucket_end_off,
+                    begin + last_fragment_off + PRIMARY_FRAGMENT_CAPACITY,
+                    spill_itr);
+        }
+      }
+    });
+
+    // Add the elements remaining in the auxiliary fragments, as well as the
+    // spilled elements, to the gaps before and after the full fragments of the
+    // buckets they belong to
+    utils::run_in_parallel(num_threads, [&](long thread_idx) {
+      for (long bucket_idx = thread_idx; bucket_idx < PRIMARY_FANOUT;
+           bucket_idx += num_threads) {
+        long bucket_end_off = bucket_start_off[bucket_idx + 1];
+        long head_gap_end = bucket_end_off;
+        long tail_gap_start = bucket_end_off;
+        if (num_full_fragments[bucket_idx] > 0) {
+          head_gap_end = first_slot[bucket_idx] * PRIMARY_FRAGMENT_CAPACITY;
+          tail_gap_start = std::min(
+              bucket_end_off,
+              (first_slot[bucket_idx] + num_full_fragments[bucket_idx]) *
+                  PRIMARY_FRAGMENT_CAPACITY);
         }
 
-        // This keeps track of which bucket we are operating on
-        long stored_bucket_idx = 0;
-
-        // Go over each fragment and re-arrange them so that they are placed
-        // contiguously within each bucket boundaries
-        for (long fragment_idx = 0; fragment_idx < fragments_written;
-             ++fragment_idx) {
-          auto cur_fragment_start_off =
-              fragment_idx * SECONDARY_FRAGMENT_CAPACITY;
-
-          // Find the bucket where this fragment is stored into, which is not
-          // necessarily the bucket it belongs to
-          while (cur_fragment_start_off >=
-                 bucket_end_offset[stored_bucket_idx]) {
-            ++stored_bucket_idx;
-          }
+        long write_off = bucket_start_off[bucket_idx];
+        auto place = [&](const T &key) {
+          if (write_off == head_gap_end) write_off = tail_gap_start;
+          begin[write_off++] = key;
+        };
 
-          // Skip this fragment if its starting index is lower than the writing
-          // offset for the current bucket. This means that the fragment has
-          // already been dealt with
-          if (cur_fragment_start_off < bucket_start_off[stored_bucket_idx]) {
-            continue;
+        for (long t = 0; t < num_threads; ++t) {
+          for (long elm_idx = 0; elm_idx < fragment_sizes[t][bucket_idx];
+               ++elm_idx) {
+            place(fragments[t][bucket_idx][elm_idx]);
           }
+        }
+        for (long elm_idx = 0; elm_idx < spill_sizes[bucket_idx]; ++elm_idx) {
+          place(spill_buffer[bucket_idx * PRIMARY_FRAGMENT_CAPACITY + elm_idx]);
+        }
+      }
+    });
 
-          // Find out what bucket the current fragment belongs to by looking at
-          // RMI prediction for the first element of the fragment.
-          auto first_elm_in_fragment =
-              primary_bucket_start[cur_fragment_start_off];
-          long pred_bucket_for_cur_fragment = static_cast<long>(std::max(
-              0.,
-              std::min(num_leaf_models - 1.,
-                       root_slope * first_elm_in_fragment + root_intercept)));
-
-          // Predict the CDF
-          double pred_cdf =
-              slopes[pred_bucket_for_cur_fragment] * first_elm_in_fragment +
-              intercepts[pred_bucket_for_cur_fragment];
-
-          // Get the predicted bucket id
-          pred_bucket_for_cur_fragment = static_cast<long>(std::max(
-              0., std::min(SECONDARY_FANOUT - 1.,
-                           (pred_cdf * PRIMARY_FANOUT - primary_bucket_idx) *
-                               SECONDARY_FANOUT)));
-
-          // If the current bucket contains fragments that are not all the way
-          // full, no need to use a swap fragment, since there is available
-          // space. The first condition checks whether the current fragment will
-          // need to be written in a bucket that was already consumed. The
-          // second condition checks whether the writing offset of the
-          // predicted bucket is beyond the last element written into the
-          // array. This means that there is empty space to write the fragments
-          // to.
-          if (bucket_start_off[pred_bucket_for_cur_fragment] <
-                  cur_fragment_start_off ||
-              bucket_start_off[pred_bucket_for_cur_fragment] >=
-                  fragments_written * SECONDARY_FRAGMENT_CAPACITY) {
-            // If the current fragment will not be the last one to write in the
-            // predicted bucket
-            if (bucket_start_off[pred_bucket_for_cur_fragment] +
-                    SECONDARY_FRAGMENT_CAPACITY <=
-                bucket_end_offset[pred_bucket_for_cur_fragment]) {
-              auto write_itr = primary_bucket_start +
-                               bucket_start_off[pred_bucket_for_cur_fragment];
-              auto read_itr = primary_bucket_start + cur_fragment_start_off;
-
-              // Move the elements of the fragment to the bucket's write offset
-              std::copy(read_itr, read_itr + SECONDARY_FRAGMENT_CAPACITY,
-                        write_itr);
+    // Cleanup
+    delete[] spill_buffer;
+    delete[] overflow_buffer;
+    for (auto local_fragments : fragments) {
+      delete[] local_fragments;
+    }
+  }
 
-              // Update the bucket write offset
-              bucket_start_off[pred_bucket_for_cur_fragment] +=
-                  SECONDARY_FRAGMENT_CAPACITY;
-
-            } else {  // This is the last fragment to write into the predicted
-                      // bucket
-              auto write_itr = primary_bucket_start +
-                               bucket_start_off[pred_bucket_for_cur_fragment];
-              auto read_itr = primary_bucket_start + cur_fragment_start_off;
-
-              // Calculate the fragment size
-              auto cur_fragment_sz =
-                  bucket_end_offset[pred_bucket_for_cur_fragment] -
-                  bucket_start_off[pred_bucket_for_cur_fragment];
-
-              // Move the elements of the fragment to the bucket's write offset
-              std::copy(read_itr, read_itr + cur_fragment_sz, write_itr);
-
-              // Update the bucket write offset for the predicted bucket
-              bucket_start_off[pred_bucket_for_cur_fragment] =
-                  bucket_end_offset[pred_bucket_for_cur_fragment];
-
-              // Place the remaining elements of this fragment into the
-              // auxiliary fragment memory. This is needed when the start of the
-              // bucket might have empty spaces because the writing iterator
-              // was not aligned with FRAGMENT_CAPACITY (not a multiple)
-              for (long elm_idx = cur_fragment_sz;
-                   elm_idx < SECONDARY_FRAGMENT_CAPACITY; elm_idx++) {
-                fragments[pred_bucket_for_cur_fragment]
-                         [fragment_sizes[pred_bucket_for_cur_fragment] +
-                          elm_idx - cur_fragment_sz] = read_itr[elm_idx];
-              }
-
-              // Update the auxiliary fragment size
-              fragment_sizes[pred_bucket_for_cur_fragment] +=
-                  SECONDARY_FRAGMENT_CAPACITY - cur_fragment_sz;
-            }
+  //----------------------------------------------------------//
+  //                SECOND ROUND OF PARTITIONING              //
+  //----------------------------------------------------------//
 
-          } else {  // The current fragment is to be written in a non-empty
-                    // space, so an incumbent fragment will need to be evicted
-
-            // If the fragment is already within the correct bucket
-            if (pred_bucket_for_cur_fragment == stored_bucket_idx) {
-              // If the empty area left in the bucket is not enough for all
-              // the elements in the fragment. This is needed when the start of
-              // the bucket might have empty spaces because the writing
-              // iterator was not aligned with FRAGMENT_CAPACITY (not a
-              // multiple)
-              if (bucket_end_offset[stored_bucket_idx] -
-                      bucket_start_off[stored_bucket_idx] <
-                  SECONDARY_FRAGMENT_CAPACITY) {
-                auto write_itr =
-                    primary_bucket_start + bucket_start_off[stored_bucket_idx];
-                auto read_itr = primary_bucket_start + cur_fragment_start_off;
-
-                // Calculate the amount of space left for the current bucket
-                long remaining_space = bucket_end_offset[stored_bucket_idx] -
-                                       bucket_start_off[stored_bucket_idx];
-
-                // Write out the fragment in the remaining space
-                std::copy(read_itr, read_itr + remaining_space, write_itr);
-
-                // Update the read iterator to point to the remaining elements
-                read_itr = primary_bucket_start + cur_fragment_start_off +
-                           remaining_space;
-
-                // Calculate the fragment size
-                auto cur_fragment_sz = fragment_sizes[stored_bucket_idx];
-
-                // Write the remaining elements into the auxiliary fragment
-                // space
-                for (int k = 0;
-                     k < SECONDARY_FRAGMENT_CAPACITY - remaining_space; ++k) {
-                  fragments[stored_bucket_idx][cur_fragment_sz++] =
-                      *(read_itr++);
-                }
-
-                // Update the fragment size after the new placements
-                fragment_sizes[stored_bucket_idx] = cur_fragment_sz;
-
-                // Update the bucket write offset to indicate that the bucket
-                // was fully written
-                bucket_start_off[stored_bucket_idx] =
-                    bucket_end_offset[stored_bucket_idx];
-
-              } else {  // The bucket has enough space for the incoming fragment
-
-                auto write_itr =
-                    primary_bucket_start + bucket_start_off[stored_bucket_idx];
-                auto read_itr = primary_bucket_start + cur_fragment_start_off;
-
-                if (write_itr != read_itr) {
-                  // Write the elements to the bucket's write offset
-                  std::copy(read_itr, read_itr + SECONDARY_FRAGMENT_CAPACITY,
-                            write_itr);
-                }
-
-                // Update the write offset for the current bucket
-                bucket_start_off[stored_bucket_idx] +=
-                    SECONDARY_FRAGMENT_CAPACITY;
-              }
-            } else {  // The fragment is not in the correct bucket and needs to
-                      // be
-              // swapped out with an incorrectly placed fragment there
-
-              // Predict the bucket of the fragment that will be swapped out
-              auto first_elm_in_fragment_to_be_swapped_out =
-                  primary_bucket_start
-                      [bucket_start_off[pred_bucket_for_cur_fragment]];
-
-              long pred_bucket_for_fragment_to_be_swapped_out =
-                  static_cast<long>(std::max(
-                      0.,
-                      std::min(
-                          num_leaf_models - 1.,
-                          root_slope * first_elm_in_fragment_to_be_swapped_out +
-                              root_intercept)));
-
-              // Predict the CDF
-              double pred_cdf =
-                  slopes[pred_bucket_for_fragment_to_be_swapped_out] *
-                      first_elm_in_fragment_to_be_swapped_out +
-                  intercepts[pred_bucket_for_fragment_to_be_swapped_out];
-
-              // Get the predicted bucket idx
-              pred_bucket_for_fragment_to_be_swapped_out = static_cast<long>(
-                  std::max(0., std::min(SECONDARY_FANOUT - 1.,
-                                        (pred_cdf * PRIMARY_FANOUT -
-                                         primary_bucket_idx) *
-                                            SECONDARY_FANOUT)));
-
-              // If the fragment at the next write offset is not already in the
-              // right bucket, swap the fragments
-              if (pred_bucket_for_fragment_to_be_swapped_out !=
-                  pred_bucket_for_cur_fragment) {
-                // Move the contents at the write offset into a swap fragment
-                auto itr_buf1 = primary_bucket_start +
-                                bucket_start_off[pred_bucket_for_cur_fragment];
-                auto itr_buf2 = primary_bucket_start + cur_fragment_start_off;
-                std::copy(itr_buf1, itr_buf1 + SECONDARY_FRAGMENT_CAPACITY,
-                          swap_buffer);
-
-                // Write the contents of the incoming fragment
-                std::copy(itr_buf2, itr_buf2 + SECONDARY_FRAGMENT_CAPACITY,
-                          itr_buf1);
-
-                // Place the swap buffer into the emptied space
-                std::copy(swap_buffer,
-                          swap_buffer + SECONDARY_FRAGMENT_CAPACITY, itr_buf2);
-
-                pred_bucket_for_cur_fragment =
-                    pred_bucket_for_fragment_to_be_swapped_out;
-              } else {  // The fragment at the write offset is already in the
-                        // right bucket
-                bucket_start_off[pred_bucket_for_cur_fragment] +=
-                    SECONDARY_FRAGMENT_CAPACITY;
-              }
-
-              // Decrement the fragment index so that the newly swapped in
-              // fragment is not skipped over
-              --fragment_idx;
-            }
-          }
-        }
+  // The primary buckets are sorted by a work-stealing pool, since their sizes
+  // can be very different on skewed data. Buckets that are larger than this are
+  // split into several tasks after their secondary partitioning.
+  const long task_grain_sz =
+      std::max<long>(SECONDARY_FANOUT * SECONDARY_FRAGMENT_CAPACITY,
+                     input_sz / (TASKS_PER_THREAD * num_threads));
+
+  // Counts the unfinished tasks of the primary buckets that were split
+  vector<std::atomic<long>> num_pending_subtasks(PRIMARY_FANOUT);
+
+  utils::WorkStealingPool pool(num_threads);
+
+  // Each worker reuses its own scratch memory for all the buckets it sorts
+  vector<internal::secondary_scratch<T, Config>> scratches(num_threads);
+
+  // Merges the secondary buckets of a split primary bucket across the
+  // boundaries where they overlap
+  auto touch_up_split_bucket = [&](long primary_bucket_idx,
+                                   const long *secondary_bucket_sizes) {
+    auto primary_bucket_start = begin + bucket_start_off[primary_bucket_idx];
+    auto secondary_bucket_start = primary_bucket_start;
+    for (long secondary_bucket_idx = 0; secondary_bucket_idx < SECONDARY_FANOUT;
+         ++secondary_bucket_idx) {
+      auto secondary_bucket_end =
+          secondary_bucket_start + secondary_bucket_sizes[secondary_bucket_idx];
+      internal::touch_up_boundary(primary_bucket_start, secondary_bucket_start,
+                                  secondary_bucket_end, key_of);
+      secondary_bucket_start = secondary_bucket_end;
+    }
+  };
+
+  auto sort_bucket = [&](long primary_bucket_idx, long thread_idx) {
+    auto primary_bucket_start = begin + bucket_start_off[primary_bucket_idx];
+    auto primary_bucket_sz = primary_bucket_sizes[primary_bucket_idx];
+
+    // Buckets with heavy keys are mostly made of their equality buckets, which
+    // need no sorting, so they are sorted by a single task
+    if (heavy.count(primary_bucket_idx) > 0) {
+      internal::sort_around_heavy_keys(
+          primary_bucket_start, primary_bucket_sz, primary_bucket_idx, input_sz,
+          model, rmi.enable_dups_detection, heavy, scratches[thread_idx],
+          key_of);
+      return;
+    }
 
-        // Add the elements remaining in the auxiliary fragments to the buckets
-        // they belong to. This is for when the fragments weren't full and thus
-        // not flushed to the input array
-        for (long bucket_idx = 0; bucket_idx < SECONDARY_FANOUT; ++bucket_idx) {
-          // Set the writing offset to the beggining of the bucket
-          long write_off = bucket_end_offset[bucket_idx - 1];
-          if (bucket_idx == 0) {
-            write_off = 0;
-          }
+    auto secondary_bucket_sizes =
+        std::make_shared<array<long, SECONDARY_FANOUT>>();
+    if (!internal::partition_primary_bucket(
+            primary_bucket_start, primary_bucket_sz, primary_bucket_idx, model,
+            rmi.enable_dups_detection, secondary_bucket_sizes->data(),
+            scratches[thread_idx], key_of)) {
+      return;
+    }
 
-          // Add the elements left in the auxiliary fragments to the beggining
-          // of the predicted bucket, since it was not full
-          long elm_idx;
-          for (elm_idx = 0; (elm_idx < fragment_sizes[bucket_idx]) &&
-                            (write_off % SECONDARY_FRAGMENT_CAPACITY != 0);
-               ++elm_idx) {
-            primary_bucket_start[write_off++] = fragments[bucket_idx][elm_idx];
-          }
+    // Sort small buckets right away
+    if (primary_bucket_sz <= task_grain_sz) {
+      internal::sort_secondary_buckets(
+          primary_bucket_start, secondary_bucket_sizes->data(), 0,
+          SECONDARY_FANOUT, primary_bucket_idx, input_sz, model,
+          rmi.enable_dups_detection, scratches[thread_idx], key_of);
+      return;
+    }
 
-          // Add the remaining elements from the auxiliary fragments to the end
-          // of the bucket it belongs to
-          write_off =
-              bucket_end_offset[bucket_idx] - fragment_sizes[bucket_idx];
-          for (; elm_idx < fragment_sizes[bucket_idx]; ++elm_idx) {
-            primary_bucket_start[write_off + elm_idx] =
-                fragments[bucket_idx][elm_idx];
-            ++bucket_start_off[bucket_idx];
-          }
+    // Split the secondary buckets of large buckets into ranges of roughly
+    // task_grain_sz keys, and make each of them a separate task
+    vector<long> range_starts;
+    for (long secondary_bucket_idx = 0, range_sz = task_grain_sz;
+         secondary_bucket_idx < SECONDARY_FANOUT; ++secondary_bucket_idx) {
+      if (range_sz >= task_grain_sz) {
+        range_starts.push_back(secondary_bucket_idx);
+        range_sz = 0;
+      }
+      range_sz += (*secondary_bucket_sizes)[secondary_bucket_idx];
+    }
+    range_starts.push_back(SECONDARY_FANOUT);
+    num_pending_subtasks[primary_bucket_idx] = range_starts.size() - 1;
+
+    long range_start_off = 0;
+    for (size_t range_idx = 0; range_idx + 1 < range_starts.size();
+         ++range_idx) {
+      long first_idx = range_starts[range_idx];
+      long end_idx = range_starts[range_idx + 1];
+      long range_sz =
+          std::accumulate(secondary_bucket_sizes->begin() + first_idx,
+                          secondary_bucket_sizes->begin() + end_idx, 0L);
+      auto range_start = primary_bucket_start + range_start_off;
+      range_start_off += range_sz;
+
+      pool.push(thread_idx, [=, &model, &rmi, &scratches, &num_pending_subtasks,
+                             &touch_up_split_bucket, &key_of](long worker_idx) {
+        internal::sort_secondary_buckets(
+            range_start, secondary_bucket_sizes->data(), first_idx, end_idx,
+            primary_bucket_idx, input_sz, model, rmi.enable_dups_detection,
+            scratches[worker_idx], key_of);
+
+        // The last task of the bucket checks the boundaries between the ranges
+        if (--num_pending_subtasks[primary_bucket_idx] == 0) {
+          touch_up_split_bucket(primary_bucket_idx,
+                                secondary_bucket_sizes->data());
         }
+      });
+    }
+  };
+
+  // Give each worker a contiguous chunk of primary buckets to start with
+  for (long primary_bucket_idx = 0; primary_bucket_idx < PRIMARY_FANOUT;
+       ++primary_bucket_idx) {
+    if (primary_bucket_sizes[primary_bucket_idx] == 0) continue;
+    long thread_idx = std::min(
+        num_threads - 1,
+        bucket_start_off[primary_bucket_idx] * num_threads / input_sz);
+    pool.push(thread_idx, [=, &sort_bucket](long worker_idx) {
+      sort_bucket(primary_bucket_idx, worker_idx);
+    });
+  }
 
-        // Cleanup
-        delete[] swap_buffer;
-        delete[] fragments;
-
-        //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
-        //                MODEL-BASED COUNTING SORT                 //
-        //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
-        // Iterate over the secondary buckets
-        for (long secondary_bucket_idx = 0;
-             secondary_bucket_idx < SECONDARY_FANOUT; ++secondary_bucket_idx) {
-          auto secondary_bucket_sz =
-              secondary_bucket_sizes[secondary_bucket_idx];
-          auto secondary_bucket_start_off = num_elms_finalized;
-          auto secondary_bucket_end_off =
-              secondary_bucket_start_off + secondary_bucket_sz;
-
-          // Skip bucket if empty
-          if (secondary_bucket_sz == 0) continue;
-
-          // Check for homogeneity
-          bool is_homogeneous = true;
-          if (rmi.enable_dups_detection) {
-            for (long elm_idx = secondary_bucket_start_off + 1;
-                 elm_idx < secondary_bucket_end_off; ++elm_idx) {
-              if (begin[elm_idx] != begin[elm_idx - 1]) {
-                is_homogeneous = false;
-                break;
-              }
-            }
-          }
-
-          if (!(rmi.enable_dups_detection and is_homogeneous)) {
-            long adjustment_offset =
-                1. *
-                (primary_bucket_idx * SECONDARY_FANOUT + secondary_bucket_idx) *
-                input_sz / (PRIMARY_FANOUT * SECONDARY_FANOUT);
-
-            // Saves the predicted CDFs for the Counting Sort subroutine
-            vector<long> pred_cache_cs(secondary_bucket_sz);
-
-            // Count array for the model-enhanced counting sort subroutine
-            vector<long> cnt_hist(secondary_bucket_sz, 0);
-
-            /*
-             * OPTIMIZATION
-             * We check to see if the first and last element in the current
-             * bucket used the same leaf model to obtain their CDF. If that is
-             * the case, then we don't need to traverse the CDF model for
-             * every element in this bucket, hence decreasing the inference
-             * complexity from O(num_layer) to O(1).
-             */
-
-            long pred_model_first_elm = static_cast<long>(std::max(
-                0., std::min(num_leaf_models - 1.,
-                             root_slope * begin[secondary_bucket_start_off] +
-                                 root_intercept)));
-
-            long pred_model_last_elm = static_cast<long>(std::max(
-                0., std::min(num_leaf_models - 1.,
-                             root_slope * begin[secondary_bucket_end_off - 1] +
-                                 root_intercept)));
-
-            if (pred_model_first_elm == pred_model_last_elm) {
-              // Avoid CDF model traversal and predict the CDF only using the
-              // leaf model
-
-              // Iterate over the elements and place them into the secondary
-              // buckets
-              for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
-                // Find the current element
-                auto cur_key = begin[secondary_bucket_start_off + elm_idx];
-
-                // Predict the CDF
-                double pred_cdf = slopes[pred_model_first_elm] * cur_key +
-                                  intercepts[pred_model_first_elm];
-
-                // Scale the predicted CDF to the input size and save it
-                pred_cache_cs[elm_idx] = static_cast<long>(std::max(
-                    0., std::min(secondary_bucket_sz - 1.,
-                                 (pred_cdf * input_sz) - adjustment_offset)));
-
-                // Update the counts
-                ++cnt_hist[pred_cache_cs[elm_idx]];
-              }
-            } else {
-              // Fully traverse the CDF model again to predict the CDF of the
-              // current element
-
-              // Iterate over the elements and place them into the minor
-              // buckets
-              for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
-                // Find the current element
-                auto cur_key = begin[secondary_bucket_start_off + elm_idx];
-
-                // Predict the model idx in the leaf layer
-                auto model_idx_next_layer = static_cast<long>(std::max(
-                    0., std::min(num_leaf_models - 1.,
-                                 root_slope * cur_key + root_intercept)));
-                // Predict the CDF
-                double pred_cdf = slopes[model_idx_next_layer] * cur_key +
-                                  intercepts[model_idx_next_layer];
-
-                // Scale the predicted CDF to the input size and save it
-                pred_cache_cs[elm_idx] = static_cast<long>(std::max(
-                    0., std::min(secondary_bucket_sz - 1.,
-                                 (pred_cdf * input_sz) - adjustment_offset)));
-
-                // Update the counts
-                ++cnt_hist[pred_cache_cs[elm_idx]];
-              }
-            }
-
-            --cnt_hist[0];
+  pool.run();
 
-            // Calculate the running totals
-            for (long i = 1; i < secondary_bucket_sz; ++i) {
-              cnt_hist[i] += cnt_hist[i - 1];
-            }
+  // Merge the primary buckets across the boundaries where they overlap. This is
+  // rare, and only happens when the model is not monotonic due to rounding
+  // errors.
+  for (long bucket_idx = 1; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+    auto primary_bucket_start = begin + bucket_start_off[bucket_idx];
+    internal::touch_up_boundary(
+        begin, primary_bucket_start,
+        primary_bucket_start + primary_bucket_sizes[bucket_idx], key_of);
+  }
+}
 
-            // Allocate a temporary buffer for placing the keys in sorted
-            // order
-            vector<T> tmp(secondary_bucket_sz);
+}  // namespace internal
 
-            // Re-shuffle the elms based on the calculated cumulative counts
-            for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
-              // Place the element in the predicted position in the array
+namespace parallel {
 
-              tmp[cnt_hist[pred_cache_cs[elm_idx]]] =
-                  begin[secondary_bucket_start_off + elm_idx];
+/**
+ * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
+ * Sort and multiple threads, in ascending order. The number of threads is taken
+ * from the hyperparameters of the given RMI.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+ * @param begin Random-access iterators to the initial position of the
+ * sequence to be used for sorting. The range used is [begin,end), which
+ * contains all the elements between first and last, including the element
+ * pointed by first but not the element pointed by last.
+ * @param end Random-access iterators to the last position of the sequence to
+ * be used for sorting. The range used is [begin,end), which contains all the
+ * elements between first and last, including the element pointed by first but
+ * not the element pointed by last.
+ * @param rmi A trained CDF model of the keys.
+ */
+template <class RandomIt>
+void sort(RandomIt begin, RandomIt end,
+          TwoLayerRMI<typename iterator_traits<RandomIt>::value_type> &rmi) {
+  internal::with_tuned_config<typename iterator_traits<RandomIt>::value_type>(
+      std::distance(begin, end), [&](auto config) {
+        internal::parallel_sort_with_model<decltype(config)>(begin, end, rmi);
+      });
+}
 
-              // Update counts
-              --cnt_hist[pred_cache_cs[elm_idx]];
-            }
+/**
+ * @brief Sorts a sequence of records from [begin, end) by their numerical keys
+ * using Learned Sort and multiple threads, in ascending order. Records with
+ * equal keys may end up in any order.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of
+ * records
+ * @tparam KeyOf The type of a functor that returns the numerical key of a
+ * record
+ * @param begin Random-access iterator to the first record.
+ * @param end Random-access iterator past the last record.
+ * @param key_of The functor that returns the numerical key of a record.
+ * @param params The hyperparameters for the CDF model, which describe the
+ * architecture, sampling ratio and the number of threads.
+ */
+template <class RandomIt, class KeyOf>
+  requires std::is_invocable_v<const KeyOf &,
+                               typename iterator_traits<RandomIt>::reference>
+void sort(RandomIt begin, RandomIt end, const KeyOf &key_of,
+          typename TwoLayerRMI<key_type_t<RandomIt, KeyOf>>::Params &params) {
+  // Sort the inputs that need no CDF model
+  if (internal::sort_without_model(begin, end, params, key_of)) {
+    return;
+  }
 
-            // Write back the temprorary buffer to the original input
-            std::copy(tmp.begin(), tmp.end(),
-                      begin + secondary_bucket_start_off);
-          }
-          // Update the number of finalized elements
-          num_elms_finalized += secondary_bucket_sz;
-        }  // end of iteration over the secondary buckets
+  // Initialize the RMI
+  TwoLayerRMI<key_type_t<RandomIt, KeyOf>> rmi(params);
+
+  // Check if the model can be trained, using the threads of the sort
+  if (rmi.train(begin, end, key_of, rmi.hp.num_threads)) {
+    // Sort the data if the model was successfully trained
+    internal::with_tuned_config<typename iterator_traits<RandomIt>::value_type>(
+        std::distance(begin, end), [&](auto config) {
+          internal::parallel_sort_with_model<decltype(config)>(begin, end, rmi,
+                                                               key_of);
+        });
+  }
 
-      }  // end of processing for non-flagged, non-homogeneous primary buckets
-    }    // end of iteration over primary buckets
+  else {  // Fall back in case the model could not be trained
+    std::sort(begin, end, internal::key_less<KeyOf>{key_of});
   }
+}
 
-  // Touch up
-  learned_sort::utils::insertion_sort(begin, end);
+/**
+ * @brief Sorts a sequence of records from [begin, end) by their numerical keys
+ * using Learned Sort and all the available hardware threads, in ascending
+ * order.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of
+ * records
+ * @tparam KeyOf The type of a functor that returns the numerical key of a
+ * record
+ * @param begin Random-access iterator to the first record.
+ * @param end Random-access iterator past the last record.
+ * @param key_of The functor that returns the numerical key of a record.
+ */
+template <class RandomIt, class KeyOf>
+  requires std::is_invocable_v<const KeyOf &,
+                               typename iterator_traits<RandomIt>::reference>
+void sort(RandomIt begin, RandomIt end, const KeyOf &key_of) {
+  if (begin != end) {
+    typename TwoLayerRMI<key_type_t<RandomIt, KeyOf>>::Params p;
+    learned_sort::parallel::sort(begin, end, key_of, p);
+  }
 }
 
 /**
  * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
- * Sort, in ascending order.
+ * Sort and multiple threads, in ascending order.
  *
  * @tparam RandomIt A bi-directional random iterator over the sequence of keys
  * @param begin Random-access iterators to the initial position of the
@@ -978,57 +3168,19 @@ void sort(RandomIt begin, RandomIt end,
  * elements between first and last, including the element pointed by first but
  * not the element pointed by last.
  * @param params The hyperparameters for the CDF model, which describe the
- * architecture and sampling ratio.
+ * architecture, sampling ratio and the number of threads.
  */
 template <class RandomIt>
 void sort(
     RandomIt begin, RandomIt end,
     typename TwoLayerRMI<typename iterator_traits<RandomIt>::value_type>::Params
         &params) {
-  // Check if the data is already sorted
-  if (*(end - 1) >= *begin && std::is_sorted(begin, end)) {
-    return;
-  }
-
-  // Check if the data is sorted in descending order
-  if (*(end - 1) <= *begin) {
-    auto is_reverse_sorted = true;
-
-    for (auto i = begin; i != end - 1; ++i) {
-      if (*i < *(i + 1)) {
-        is_reverse_sorted = false;
-      }
-    }
-
-    if (is_reverse_sorted) {
-      std::reverse(begin, end);
-      return;
-    }
-  }
-
-  if (std::distance(begin, end) <=
-      std::max<long>(params.fanout * params.threshold,
-                     5 * params.num_leaf_models)) {
-    std::sort(begin, end);
-  } else {
-    // Initialize the RMI
-    TwoLayerRMI<typename iterator_traits<RandomIt>::value_type> rmi(params);
-
-    // Check if the model can be trained
-    if (rmi.train(begin, end)) {
-      // Sort the data if the model was successfully trained
-      learned_sort::sort(begin, end, rmi);
-    }
-
-    else {  // Fall back in case the model could not be trained
-      std::sort(begin, end);
-    }
-  }
+  learned_sort::parallel::sort(begin, end, utils::identity_key(), params);
 }
 
 /**
  * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
- * Sort, in ascending order.
+ * Sort and all the available hardware threads, in ascending order.
  *
  * @tparam RandomIt A bi-directional random iterator over the sequence of keys
  * @param begin Random-access iterators to the initial position of the
@@ -1045,8 +3197,209 @@ void sort(RandomIt begin, RandomIt end) {
   if (begin != end) {
     typename TwoLayerRMI<typename iterator_traits<RandomIt>::value_type>::Params
         p;
-    learned_sort::sort(begin, end, p);
+    learned_sort::parallel::sort(begin, end, p);
+  }
+}
+
+}  // namespace parallel
+
+namespace internal {
+
+// Whether Comp orders the keys in ascending order
+template <class Comp>
+struct is_ascending : std::false_type {};
+template <>
+struct is_ascending<std::ranges::less> : std::true_type {};
+template <class T>
+struct is_ascending<std::less<T>> : std::true_type {};
+
+// Whether Comp orders the keys in descending order
+template <class Comp>
+struct is_descending : std::false_type {};
+template <>
+struct is_descending<std::ranges::greater> : std::true_type {};
+template <class T>
+struct is_descending<std::greater<T>> : std::true_type {};
+
+// Extracts the key of a record through a projection
+template <class Proj>
+struct projected_key {
+  [[no_unique_address]] Proj proj;
+
+  template <class R>
+  auto operator()(const R &r) const {
+    return std::invoke(proj, r);
+  }
+};
+
+// Extracts the key of a record through a projection and maps it to a key of
+// the same type whose ascending order is the descending order of the original
+// keys. This lets the CDF model and the partitioning place the records in
+// descending order directly, instead of sorting them in ascending order and
+// reversing them afterwards.
+template <class Proj>
+struct descending_key {
+  [[no_unique_address]] Proj proj;
+
+  template <class R>
+  auto operator()(const R &r) const {
+    auto key = std::invoke(proj, r);
+    typedef decltype(key) K;
+    if constexpr (std::is_floating_point<K>::value) {
+      return -key;
+    } else {
+      // Unlike the negation, the bitwise complement is decreasing over the
+      // whole range of both signed and unsigned integers
+      return static_cast<K>(~key);
+    }
+  }
+};
+
+// Returns the functor that extracts the keys of the records for the ordering
+// that Comp describes. Only the standard ascending and descending orderings
+// are supported, since the CDF model ranks the keys by their numerical values.
+template <class Comp, class Proj>
+auto make_key_of(Proj proj) {
+  static_assert(is_ascending<Comp>::value || is_descending<Comp>::value,
+                "Only the less and greater comparators are supported");
+
+  if constexpr (is_descending<Comp>::value) {
+    return descending_key<Proj>{proj};
+  } else if constexpr (std::is_same<Proj, std::identity>::value) {
+    return utils::identity_key();
+  } else {
+    return projected_key<Proj>{proj};
+  }
+}
+
+}  // namespace internal
+
+// The type of the numerical keys that Proj projects the elements of the range
+// R to
+template <class R, class Proj>
+using projected_key_t = std::decay_t<
+    std::invoke_result_t<Proj &, std::ranges::range_reference_t<R>>>;
+
+namespace ranges {
+
+/**
+ * @brief Sorts a random-access range by the numerical keys that the projection
+ * returns for its elements using Learned Sort. Elements with equal keys may end
+ * up in any order.
+ *
+ * @tparam R A random-access range, e.g. a vector, an array or a span
+ * @tparam Comp Either std::ranges::less for ascending order, or
+ * std::ranges::greater for descending order
+ * @tparam Proj The type of the projection, e.g. a pointer to a data member
+ * @param r The range to be sorted.
+ * @param comp The comparator that describes the order of the keys. Only its
+ * type is used.
+ * @param proj The projection that returns the numerical key of an element.
+ * @param params The hyperparameters for the CDF model, which describe the
+ * architecture and sampling ratio.
+ * @return An iterator past the last element of the range.
+ */
+template <std::ranges::random_access_range R, class Comp, class Proj>
+  requires std::permutable<std::ranges::iterator_t<R>> &&
+           std::is_arithmetic_v<projected_key_t<R, Proj>>
+std::ranges::borrowed_iterator_t<R> sort(
+    R &&r, Comp /*comp*/, Proj proj,
+    typename TwoLayerRMI<projected_key_t<R, Proj>>::Params &params) {
+  auto begin = std::ranges::begin(r);
+  auto end = std::ranges::next(begin, std::ranges::end(r));
+  if (begin != end) {
+    learned_sort::sort(begin, end, internal::make_key_of<Comp>(proj), params);
+  }
+  return end;
+}
+
+/**
+ * @brief Sorts a random-access range by the numerical keys that the projection
+ * returns for its elements using Learned Sort. Elements with equal keys may end
+ * up in any order.
+ *
+ * @tparam R A random-access range, e.g. a vector, an array or a span
+ * @tparam Comp Either std::ranges::less for ascending order, or
+ * std::ranges::greater for descending order
+ * @tparam Proj The type of the projection, e.g. a pointer to a data member
+ * @param r The range to be sorted.
+ * @param comp The comparator that describes the order of the keys.
+ * @param proj The projection that returns the numerical key of an element.
+ * @return An iterator past the last element of the range.
+ */
+template <std::ranges::random_access_range R, class Comp = std::ranges::less,
+          class Proj = std::identity>
+  requires std::permutable<std::ranges::iterator_t<R>> &&
+           std::is_arithmetic_v<projected_key_t<R, Proj>>
+std::ranges::borrowed_iterator_t<R> sort(R &&r, Comp comp = {},
+                                         Proj proj = {}) {
+  typename TwoLayerRMI<projected_key_t<R, Proj>>::Params p;
+  return learned_sort::ranges::sort(std::forward<R>(r), comp, proj, p);
+}
+
+}  // namespace ranges
+
+namespace parallel {
+namespace ranges {
+
+/**
+ * @brief Sorts a random-access range by the numerical keys that the projection
+ * returns for its elements using Learned Sort and multiple threads. Elements
+ * with equal keys may end up in any order.
+ *
+ * @tparam R A random-access range, e.g. a vector, an array or a span
+ * @tparam Comp Either std::ranges::less for ascending order, or
+ * std::ranges::greater for descending order
+ * @tparam Proj The type of the projection, e.g. a pointer to a data member
+ * @param r The range to be sorted.
+ * @param comp The comparator that describes the order of the keys. Only its
+ * type is used.
+ * @param proj The projection that returns the numerical key of an element.
+ * @param params The hyperparameters for the CDF model, which describe the
+ * architecture, sampling ratio and the number of threads.
+ * @return An iterator past the last element of the range.
+ */
+template <std::ranges::random_access_range R, class Comp, class Proj>
+  requires std::permutable<std::ranges::iterator_t<R>> &&
+           std::is_arithmetic_v<projected_key_t<R, Proj>>
+std::ranges::borrowed_iterator_t<R> sort(
+    R &&r, Comp /*comp*/, Proj proj,
+    typename TwoLayerRMI<projected_key_t<R, Proj>>::Params &params) {
+  auto begin = std::ranges::begin(r);
+  auto end = std::ranges::next(begin, std::ranges::end(r));
+  if (begin != end) {
+    learned_sort::parallel::sort(begin, end, internal::make_key_of<Comp>(proj),
+                                 params);
   }
+  return end;
+}
+
+/**
+ * @brief Sorts a random-access range by the numerical keys that the projection
+ * returns for its elements using Learned Sort and all the available hardware
+ * threads. Elements with equal keys may end up in any order.
+ *
+ * @tparam R A random-access range, e.g. a vector, an array or a span
+ * @tparam Comp Either std::ranges::less for ascending order, or
+ * std::ranges::greater for descending order
+ * @tparam Proj The type of the projection, e.g. a pointer to a data member
+ * @param r The range to be sorted.
+ * @param comp The comparator that describes the order of the keys.
+ * @param proj The projection that returns the numerical key of an element.
+ * @return An iterator past the last element of the range.
+ */
+template <std::ranges::random_access_range R, class Comp = std::ranges::less,
+          class Proj = std::identity>
+  requires std::permutable<std::ranges::iterator_t<R>> &&
+           std::is_arithmetic_v<projected_key_t<R, Proj>>
+std::ranges::borrowed_iterator_t<R> sort(R &&r, Comp comp = {},
+                                         Proj proj = {}) {
+  typename TwoLayerRMI<projected_key_t<R, Proj>>::Params p;
+  return learned_sort::parallel::ranges::sort(std::forward<R>(r), comp, proj,
+                                              p);
 }
 
+}  // namespace ranges
+}  // namespace parallel
+
 }  // namespace learned_sort
@@ -0,0 +1,485 @@
+#pragma once
+
+/**
+ * @file model_file.h
+ * @brief Saving a trained CDF model to a binary file, and sorting with a model
+ * that is mapped from such a file, so that inputs from the same distribution
+ * skip the sampling and the training.
+ *
+ * The file holds a header followed by the arrays of the flat view of the model
+ * (see internal::flat_rmi), each of them aligned to a cache line, so that the
+ * view points into the mapped file and loading the model copies nothing. When
+ * the training sample has heavy keys, the runs of equal keys of the sample are
+ * saved too, from which the equality buckets are found.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "learned_sort.h"
+
+namespace learned_sort {
+namespace internal {
+
+// Identifies the model files, and the version of their layout
+static constexpr char MODEL_FILE_MAGIC[8] = {'L', 'S', 'M', 'O',
+                                             'D', 'E', 'L', '\0'};
+static constexpr uint32_t MODEL_FILE_VERSION = 1;
+
+// The alignment of the arrays of a model file
+static constexpr long MODEL_FILE_ALIGNMENT = 64;
+
+// The kind of the keys of a model, which must match the keys that it sorts
+template <class K>
+constexpr uint32_t model_key_kind() {
+  return std::is_floating_point_v<K> ? 0 : std::is_signed_v<K> ? 1 : 2;
+}
+
+// The header of a model file. The offsets of the arrays are in bytes from the
+// start of the file, and the empty arrays have a zero offset.
+struct model_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t key_sz;
+  uint32_t key_kind;
+  uint32_t params_sz;
+  uint32_t routing;
+  uint32_t enable_dups_detection;
+
+  int64_t num_leaf_models;
+  int64_t num_mid_models;
+  int64_t num_radix_buckets;
+  int64_t num_sample_runs;
+
+  double root_slope;
+  double root_intercept;
+  double root_base_hi;
+  double root_base_lo;
+  double radix_min;
+  double radix_scale;
+
+  int64_t params_offset;
+  int64_t slopes_offset;
+  int64_t intercepts_offset;
+  int64_t base_hi_offset;
+  int64_t base_lo_offset;
+  int64_t mid_slopes_offset;
+  int64_t mid_intercepts_offset;
+  int64_t leaf_starts_offset;
+  int64_t radix_table_offset;
+  int64_t run_keys_offset;
+  int64_t run_sizes_offset;
+  int64_t file_sz;
+};
+
+// Appends the arrays of a model file after its header, and records their
+// offsets in the header
+class model_file_writer {
+ public:
+  // Reserves an aligned array of num_bytes bytes, and returns its offset
+  int64_t reserve(long num_bytes) {
+    if (num_bytes == 0) return 0;
+    const int64_t offset = (file_sz + MODEL_FILE_ALIGNMENT - 1) /
+                           MODEL_FILE_ALIGNMENT * MODEL_FILE_ALIGNMENT;
+    file_sz = offset + num_bytes;
+    return offset;
+  }
+
+  int64_t file_sz = sizeof(model_file_header);
+};
+
+}  // namespace internal
+
+/**
+ * @brief Saves a trained CDF model to a binary file, from which a MappedModel
+ * can sort later inputs from the same distribution.
+ *
+ * @tparam K The type of the keys of the model
+ * @param rmi A trained CDF model.
+ * @param path The path of the file, which is overwritten.
+ * @return true if the model was saved, false if it was not trained or the file
+ * could not be written.
+ */
+template <class K>
+bool save_model(const TwoLayerRMI<K> &rmi, const std::string &path) {
+  static_assert(sizeof(long) == sizeof(int64_t),
+                "The model files store longs as 64-bit integers");
+  static_assert(
+      std::is_trivially_copyable_v<typename TwoLayerRMI<K>::Params>,
+      "The model files store the hyperparameters as raw bytes");
+  if (!rmi.trained) return false;
+
+  internal::flat_model_storage storage;
+  const internal::flat_rmi model = internal::flatten_model(rmi, storage);
+
+  // Keep the runs of the sample only when they hold heavy keys
+  vector<K> run_keys;
+  vector<long> run_sizes;
+  if (internal::has_heavy_keys(rmi.training_sample)) {
+    internal::for_each_sample_run(rmi.training_sample,
+                                  [&](const K &key, long run_sz) {
+                                    run_keys.push_back(key);
+                                    run_sizes.push_back(run_sz);
+                                  });
+  }
+
+  // Lay out the arrays after the header
+  internal::model_file_header header{};
+  std::memcpy(header.magic, internal::MODEL_FILE_MAGIC, sizeof(header.magic));
+  header.version = internal::MODEL_FILE_VERSION;
+  header.key_sz = sizeof(K);
+  header.key_kind = internal::model_key_kind<K>();
+  header.params_sz = sizeof(rmi.hp);
+  header.routing = static_cast<uint32_t>(model.routing);
+  header.enable_dups_detection = rmi.enable_dups_detection;
+  header.num_leaf_models = model.num_leaf_models;
+  header.num_mid_models = model.num_mid_models;
+  header.num_radix_buckets = model.num_radix_buckets;
+  header.num_sample_runs = run_keys.size();
+  header.root_slope = model.root_slope;
+  header.root_intercept = model.root_intercept;
+  header.root_base_hi = model.root_base_hi;
+  header.root_base_lo = model.root_base_lo;
+  header.radix_min = model.radix_min;
+  header.radix_scale = model.radix_scale;
+
+  const long LEAF_BYTES = model.num_leaf_models * sizeof(double);
+  const long MID_BYTES = model.num_mid_models * sizeof(double);
+  internal::model_file_writer writer;
+  header.params_offset = writer.reserve(sizeof(rmi.hp));
+  header.slopes_offset = writer.reserve(LEAF_BYTES);
+  header.intercepts_offset = writer.reserve(LEAF_BYTES);
+  header.base_hi_offset = writer.reserve(model.base_hi ? LEAF_BYTES : 0);
+  header.base_lo_offset = writer.reserve(model.base_lo ? LEAF_BYTES : 0);
+  header.mid_slopes_offset = writer.reserve(MID_BYTES);
+  header.mid_intercepts_offset = writer.reserve(MID_BYTES);
+  header.leaf_starts_offset =
+      writer.reserve(model.leaf_starts ? LEAF_BYTES : 0);
+  header.radix_table_offset = writer.reserve(
+      model.radix_table ? (model.num_radix_buckets + 1) * sizeof(long) : 0);
+  header.run_keys_offset = writer.reserve(run_keys.size() * sizeof(K));
+  header.run_sizes_offset = writer.reserve(run_sizes.size() * sizeof(long));
+  header.file_sz = writer.file_sz;
+
+  // Copy the header and the arrays to their offsets
+  vector<char> bytes(header.file_sz, 0);
+  auto put = [&](int64_t offset, const void *src, long num_bytes) {
+    if (num_bytes > 0) std::memcpy(bytes.data() + offset, src, num_bytes);
+  };
+  put(0, &header, sizeof(header));
+  put(header.params_offset, &rmi.hp, sizeof(rmi.hp));
+  put(header.slopes_offset, model.slopes, LEAF_BYTES);
+  put(header.intercepts_offset, model.intercepts, LEAF_BYTES);
+  if (model.base_hi) {
+    put(header.base_hi_offset, model.base_hi, LEAF_BYTES);
+    put(header.base_lo_offset, model.base_lo, LEAF_BYTES);
+  }
+  put(header.mid_slopes_offset, model.mid_slopes, MID_BYTES);
+  put(header.mid_intercepts_offset, model.mid_intercepts, MID_BYTES);
+  if (model.leaf_starts) {
+    put(header.leaf_starts_offset, model.leaf_starts, LEAF_BYTES);
+  }
+  if (model.radix_table) {
+    put(header.radix_table_offset, model.radix_table,
+        (model.num_radix_buckets + 1) * sizeof(long));
+  }
+  put(header.run_keys_offset, run_keys.data(), run_keys.size() * sizeof(K));
+  put(header.run_sizes_offset, run_sizes.data(),
+      run_sizes.size() * sizeof(long));
+
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file) return false;
+  const bool written =
+      std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  return std::fclose(file) == 0 && written;
+}
+
+/**
+ * @brief A CDF model that is mapped from a file written by save_model. The flat
+ * view of the model points into the mapping, so that opening a model reads
+ * only the pages that the sort touches.
+ *
+ * @tparam T The type of the keys
+ */
+template <class T>
+class MappedModel {
+ public:
+  typedef typename TwoLayerRMI<T>::Params Params;
+
+  MappedModel() = default;
+  ~MappedModel() { this->close(); }
+
+  MappedModel(const MappedModel &) = delete;
+  MappedModel &operator=(const MappedModel &) = delete;
+
+  /**
+   * @brief Maps a model file, and checks that it holds a model of keys of type
+   * T whose arrays lie within the file.
+   *
+   * @param path The path of the file.
+   * @return true if the model was mapped, false otherwise, in which case no
+   * model is open.
+   */
+  bool open(const std::string &path) {
+    this->close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        st.st_size < (off_t)sizeof(internal::model_file_header)) {
+      ::close(fd);
+      return false;
+    }
+    void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) return false;
+    this->data = static_cast<const char *>(data);
+    this->data_sz = st.st_size;
+
+    if (!this->map_arrays()) {
+      this->close();
+      return false;
+    }
+    return true;
+  }
+
+  // Unmaps the model, if one is open
+  void close() {
+    if (this->data) {
+      ::munmap(const_cast<char *>(this->data), this->data_sz);
+    }
+    this->data = nullptr;
+    this->data_sz = 0;
+  }
+
+  bool is_open() const { return this->data != nullptr; }
+
+  // The flat view of the parameters of the model
+  const internal::flat_rmi &model() const { return this->flat_model; }
+
+  // The hyperparameters that the model was trained with
+  const Params &params() const { return this->hp; }
+
+  // Whether the model detects duplicate keys
+  bool enable_dups_detection() const { return this->dups_detection; }
+
+  // Finds the heavy keys of the model for the given number of primary buckets
+  // (see internal::find_heavy_keys)
+  void find_heavy_keys(long primary_fanout,
+                       internal::heavy_keys<T> &heavy) const {
+    internal::find_heavy_keys_in_runs(
+        [&](auto &&visit) {
+          for (long i = 0; i < this->num_sample_runs; ++i) {
+            visit(this->run_keys[i], this->run_sizes[i]);
+          }
+        },
+        this->flat_model, primary_fanout, heavy);
+  }
+
+ private:
+  // Returns the array of count elements of type E at the given offset of the
+  // file, or null if the array is empty or does not fit in the file
+  template <class E>
+  const E *array_at(int64_t offset, int64_t count, bool &valid) const {
+    if (count == 0) return nullptr;
+    if (offset <= 0 || offset > this->data_sz ||
+        offset % internal::MODEL_FILE_ALIGNMENT != 0 || count < 0 ||
+        count > this->data_sz ||
+        offset + count * (int64_t)sizeof(E) > this->data_sz) {
+      valid = false;
+      return nullptr;
+    }
+    return reinterpret_cast<const E *>(this->data + offset);
+  }
+
+  // Returns whether the hyperparameters read from a file are in the ranges
+  // that TwoLayerRMI::train enforces
+  static bool valid_params(const Params &hp) {
+    const auto model_type =
+        static_cast<std::underlying_type_t<cdf_model_type>>(hp.model_type);
+    return hp.batch_sz > 0 && hp.overallocation >= 1 &&
+           model_type >= 0 &&
+           model_type <= static_cast<std::underlying_type_t<cdf_model_type>>(
+                             cdf_model_type::RADIX_SPLINE) &&
+           hp.num_mid_models > 0 && hp.max_error > 0 && hp.radix_bits > 0 &&
+           hp.radix_bits <= Params::MAX_RADIX_BITS;
+  }
+
+  // Returns whether the first keys of the leaf models are in ascending order,
+  // which the binary search over them relies on
+  static bool sorted_leaf_starts(const internal::flat_rmi &m) {
+    for (long i = 1; i < m.num_leaf_models; ++i) {
+      if (!(m.leaf_starts[i - 1] <= m.leaf_starts[i])) return false;
+    }
+    return true;
+  }
+
+  // Returns whether the radix table holds ascending leaf indexes that start at
+  // the first leaf model and end at most past the last one, so that the search
+  // of a leaf model stays within leaf_starts
+  static bool valid_radix_table(const internal::flat_rmi &m) {
+    if (m.radix_table[0] != 0) return false;
+    for (long i = 1; i <= m.num_radix_buckets; ++i) {
+      if (m.radix_table[i] < m.radix_table[i - 1]) return false;
+    }
+    return m.radix_table[m.num_radix_buckets] <= m.num_leaf_models;
+  }
+
+  // Validates the header of the mapped file, and points the flat view of the
+  // model and the runs of the sample into the file
+  bool map_arrays() {
+    internal::model_file_header header;
+    std::memcpy(&header, this->data, sizeof(header));
+    if (std::memcmp(header.magic, internal::MODEL_FILE_MAGIC,
+                    sizeof(header.magic)) != 0 ||
+        header.version != internal::MODEL_FILE_VERSION ||
+        header.key_sz != sizeof(T) ||
+        header.key_kind != internal::model_key_kind<T>() ||
+        header.params_sz != sizeof(Params) ||
+        header.file_sz != this->data_sz || header.num_leaf_models <= 0 ||
+        header.routing >
+            static_cast<uint32_t>(internal::leaf_routing::SEARCH)) {
+      return false;
+    }
+
+    bool valid = true;
+    const auto *params = array_at<char>(header.params_offset,
+                                        sizeof(Params), valid);
+    if (!valid) return false;
+    std::memcpy(&this->hp, params, sizeof(Params));
+    if (!valid_params(this->hp)) return false;
+    this->dups_detection = header.enable_dups_detection;
+
+    const int64_t NUM_LEAF_MODELS = header.num_leaf_models;
+    const auto routing = static_cast<internal::leaf_routing>(header.routing);
+    auto &m = this->flat_model;
+    m = internal::flat_rmi{header.root_slope,
+                           header.root_intercept,
+                           NUM_LEAF_MODELS,
+                           array_at<double>(header.slopes_offset,
+                                            NUM_LEAF_MODELS, valid),
+                           array_at<double>(header.intercepts_offset,
+                                            NUM_LEAF_MODELS, valid),
+                           header.root_base_hi,
+                           header.root_base_lo,
+                           nullptr,
+                           nullptr};
+    if constexpr (utils::uses_key_offsets<T>) {
+      m.base_hi =
+          array_at<double>(header.base_hi_offset, NUM_LEAF_MODELS, valid);
+      m.base_lo =
+          array_at<double>(header.base_lo_offset, NUM_LEAF_MODELS, valid);
+      valid = valid && m.base_hi && m.base_lo;
+    }
+
+    m.routing = routing;
+    if (routing == internal::leaf_routing::MIDDLE_LAYER) {
+      m.num_mid_models = header.num_mid_models;
+      m.mid_slopes = array_at<double>(header.mid_slopes_offset,
+                                      header.num_mid_models, valid);
+      m.mid_intercepts = array_at<double>(header.mid_intercepts_offset,
+                                          header.num_mid_models, valid);
+      valid = valid && m.mid_slopes && m.mid_intercepts;
+    } else if (routing == internal::leaf_routing::SEARCH) {
+      m.leaf_starts = array_at<double>(header.leaf_starts_offset,
+                                       NUM_LEAF_MODELS, valid);
+      valid = valid && m.leaf_starts && sorted_leaf_starts(m);
+      if (header.num_radix_buckets >= this->data_sz) {
+        valid = false;
+      } else if (header.num_radix_buckets > 0) {
+        m.radix_table = array_at<long>(header.radix_table_offset,
+                                       header.num_radix_buckets + 1, valid);
+        m.num_radix_buckets = header.num_radix_buckets;
+        m.radix_min = header.radix_min;
+        m.radix_scale = header.radix_scale;
+        valid = valid && m.radix_table && valid_radix_table(m);
+      }
+    }
+
+    this->num_sample_runs = header.num_sample_runs;
+    this->run_keys =
+        array_at<T>(header.run_keys_offset, header.num_sample_runs, valid);
+    this->run_sizes =
+        array_at<long>(header.run_sizes_offset, header.num_sample_runs, valid);
+    return valid && m.slopes && m.intercepts;
+  }
+
+  // The mapping of the file
+  const char *data = nullptr;
+  int64_t data_sz = 0;
+
+  // The model, whose arrays point into the mapping
+  internal::flat_rmi flat_model{};
+  Params hp;
+  bool dups_detection = true;
+
+  // The runs of equal keys of the training sample, when it has heavy keys
+  const T *run_keys = nullptr;
+  const long *run_sizes = nullptr;
+  long num_sample_runs = 0;
+};
+
+/**
+ * @brief Sorts a sequence of records from [begin, end) by their numerical keys
+ * using Learned Sort and a model that was mapped from a file, in ascending
+ * order. The input is not sampled and the model is not retrained, so the keys
+ * should come from the distribution that the model was trained on. The sort is
+ * correct for any keys, but slower for keys from another distribution.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of
+ * records
+ * @tparam KeyOf The type of a functor that returns the numerical key of a
+ * record
+ * @param begin Random-access iterator to the first record.
+ * @param end Random-access iterator past the last record.
+ * @param key_of The functor that returns the numerical key of a record.
+ * @param model An open model of the keys.
+ */
+template <class RandomIt, class KeyOf>
+  requires std::is_invocable_v<const KeyOf &,
+                               typename iterator_traits<RandomIt>::reference>
+void sort(RandomIt begin, RandomIt end, const KeyOf &key_of,
+          const MappedModel<key_type_t<RandomIt, KeyOf>> &model) {
+  typedef typename iterator_traits<RandomIt>::value_type T;
+  typedef key_type_t<RandomIt, KeyOf> K;
+
+  internal::with_tuned_config<T>(
+      std::distance(begin, end), [&](auto config) {
+        typedef decltype(config) Config;
+        internal::sort_scratch<T, Config> scratch;
+        internal::heavy_keys<K> heavy;
+        model.find_heavy_keys(Config::PRIMARY_FANOUT, heavy);
+        internal::sort_with_model(begin, end, model.model(), heavy,
+                                  model.params(),
+                                  model.enable_dups_detection(), scratch,
+                                  key_of);
+      });
+}
+
+/**
+ * @brief Sorts a sequence of numerical keys from [begin, end) using Learned
+ * Sort and a model that was mapped from a file, in ascending order.
+ *
+ * @tparam RandomIt A bi-directional random iterator over the sequence of keys
+ * @param begin Random-access iterator to the first key.
+ * @param end Random-access iterator past the last key.
+ * @param model An open model of the keys.
+ */
+template <class RandomIt>
+void sort(
+    RandomIt begin, RandomIt end,
+    const MappedModel<typename iterator_traits<RandomIt>::value_type> &model) {
+  learned_sort::sort(begin, end, utils::identity_key(), model);
+}
+
+}  // namespace learned_sort
@@ -1,8 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <thread>
 #include <vector>
 
+#include "sort_stats.h"
+#include "utils.h"
+
 using namespace std;
 
 namespace learned_sort {
@@ -20,7 +27,31 @@ struct linear_model {
   double intercept = 0;
 };
 
-// An implementation of a 2-layer RMI model
+// The kinds of CDF models that can be trained on the sample of the input
+enum class cdf_model_type {
+  // A linear root model that predicts which of num_leaf_models linear models
+  // to use for a key
+  TWO_LAYER_RMI,
+
+  // A linear root model that predicts which of num_mid_models linear models to
+  // use for a key, which in turn predicts which of num_leaf_models linear
+  // models to use
+  THREE_LAYER_RMI,
+
+  // Linear segments that predict the rank of every key of the sample within
+  // max_error positions, whose leaf is found by a binary search over the first
+  // keys of the segments
+  PIECEWISE_LINEAR,
+
+  // A linear spline whose points are chosen so that the spline predicts the
+  // rank of every key of the sample within max_error positions, and a radix
+  // table over the top radix_bits bits of the keys that narrows the search of
+  // the spline segment of a key
+  RADIX_SPLINE
+};
+
+// An implementation of a 2-layer RMI model, which can also train the other
+// kinds of CDF models (see cdf_model_type)
 template <class T>
 class TwoLayerRMI {
  public:
@@ -31,6 +62,42 @@ class TwoLayerRMI {
     float sampling_rate;
     long threshold;
     long num_leaf_models;
+    long num_threads;
+    long batch_sz;
+
+    // Whether the keys are partitioned into the primary buckets out of place,
+    // through buckets that have room for `overallocation` times their
+    // expected size. This avoids the in-place defragmentation, at the cost of
+    // about overallocation times the input size in extra memory. The parallel
+    // sorting routines always partition in place.
+    bool out_of_place;
+    float overallocation;
+
+    // The kind of CDF model to train, and the hyperparameters of the models
+    // other than the 2-layer RMI. The maximum error is measured in positions
+    // of the sample.
+    cdf_model_type model_type;
+    long num_mid_models;
+    double max_error;
+    long radix_bits;
+
+    // The number of contiguous keys in each run of the sample. With runs of
+    // one key (the default), the sample takes keys at a fixed stride. Longer
+    // runs start at pseudo-random positions, which share the cache lines and
+    // the pages of the input between several sampled keys and do not alias
+    // with periodic inputs, but carry less information about locally ordered
+    // inputs, whose neighbouring keys are close to each other.
+    long sampling_block_sz;
+
+    // Whether the sample is grown in rounds until the model converges, instead
+    // of taking sampling_rate of the input. Each round doubles the sample, up
+    // to max_sampling_rate of the input, and estimates the relative variance
+    // of the sizes of `fanout` buckets of the model on held-out keys. The
+    // rounds stop once that estimate falls below max_bucket_imbalance, or when
+    // it no longer improves.
+    bool progressive_sampling;
+    float max_sampling_rate;
+    double max_bucket_imbalance;
 
     // Default hyperparameters
     static constexpr long DEFAULT_FANOUT = 1e3;
@@ -38,6 +105,21 @@ class TwoLayerRMI {
     static constexpr long DEFAULT_THRESHOLD = 100;
     static constexpr long DEFAULT_NUM_LEAF_MODELS = 1000;
     static constexpr long MIN_SORTING_SIZE = 1e4;
+    static constexpr long MIN_SAMPLE_SZ_PER_THREAD = 1 << 16;
+    static constexpr long DEFAULT_BATCH_SZ = 256;
+    static constexpr float DEFAULT_OVERALLOCATION = 1.1;
+    static constexpr long DEFAULT_NUM_MID_MODELS = 32;
+    static constexpr double DEFAULT_MAX_ERROR = 32;
+    static constexpr long DEFAULT_RADIX_BITS = 12;
+    static constexpr long MAX_RADIX_BITS = 24;
+    static constexpr long DEFAULT_SAMPLING_BLOCK_SZ = 1;
+    static constexpr float DEFAULT_MAX_SAMPLING_RATE = .05;
+    static constexpr double DEFAULT_MAX_BUCKET_IMBALANCE = .02;
+
+    // The default number of threads used by the parallel sorting routines
+    static long default_num_threads() {
+      return std::max<long>(1, std::thread::hardware_concurrency());
+    }
 
     // Default constructor
     Params() {
@@ -45,6 +127,18 @@ class TwoLayerRMI {
       this->sampling_rate = DEFAULT_SAMPLING_RATE;
       this->threshold = DEFAULT_THRESHOLD;
       this->num_leaf_models = DEFAULT_NUM_LEAF_MODELS;
+      this->num_threads = default_num_threads();
+      this->batch_sz = DEFAULT_BATCH_SZ;
+      this->out_of_place = false;
+      this->overallocation = DEFAULT_OVERALLOCATION;
+      this->model_type = cdf_model_type::TWO_LAYER_RMI;
+      this->num_mid_models = DEFAULT_NUM_MID_MODELS;
+      this->max_error = DEFAULT_MAX_ERROR;
+      this->radix_bits = DEFAULT_RADIX_BITS;
+      this->sampling_block_sz = DEFAULT_SAMPLING_BLOCK_SZ;
+      this->progressive_sampling = false;
+      this->max_sampling_rate = DEFAULT_MAX_SAMPLING_RATE;
+      this->max_bucket_imbalance = DEFAULT_MAX_BUCKET_IMBALANCE;
     }
 
     // Constructor with custom hyperparameter values
@@ -54,6 +148,18 @@ class TwoLayerRMI {
       this->sampling_rate = sampling_rate;
       this->threshold = threshold;
       this->num_leaf_models = DEFAULT_NUM_LEAF_MODELS;
+      this->num_threads = default_num_threads();
+      this->batch_sz = batch_sz;
+      this->out_of_place = false;
+      this->overallocation = overallocation;
+      this->model_type = cdf_model_type::TWO_LAYER_RMI;
+      this->num_mid_models = DEFAULT_NUM_MID_MODELS;
+      this->max_error = DEFAULT_MAX_ERROR;
+      this->radix_bits = DEFAULT_RADIX_BITS;
+      this->sampling_block_sz = DEFAULT_SAMPLING_BLOCK_SZ;
+      this->progressive_sampling = false;
+      this->max_sampling_rate = DEFAULT_MAX_SAMPLING_RATE;
+      this->max_bucket_imbalance = DEFAULT_MAX_BUCKET_IMBALANCE;
     }
   };
 
@@ -65,19 +171,81 @@ class TwoLayerRMI {
   Params hp;
   bool enable_dups_detection;
 
+  // The keys from which the root and the leaf models measure the offsets of
+  // the keys, when they take offsets (see utils::uses_key_offsets)
+  T root_base;
+  vector<T> leaf_bases;
+
+  // The middle layer of a 3-layer RMI, whose models take the same input as the
+  // root model and predict the leaf models
+  vector<linear_model> mid_models;
+
+  // The inputs of the root model for the first key of each leaf, by which the
+  // leaf models of the piecewise-linear and radix-spline models are searched
+  vector<double> leaf_starts;
+
+  // The radix table of the radix-spline model, whose entry r is the first leaf
+  // whose start falls in the radix bucket r or after it, where the radix bucket
+  // of a root input x is (x - radix_min) * radix_scale
+  vector<long> radix_table;
+  double radix_min;
+  double radix_scale;
+
+  // The training points of the middle and the leaf models, which are the keys
+  // of a range of the sorted sample: the points of model i are at the indices
+  // [ranges[i], ranges[i + 1]) of the sample. They are kept between trainings
+  // so that retraining the RMI reuses their memory.
+  vector<long> mid_ranges;
+  vector<long> leaf_ranges;
+
+  // The keys on which progressive sampling estimates the bucket imbalance of
+  // the model, which are taken apart from the training sample
+  vector<T> held_out_sample;
+
   // CDF model constructor
-  TwoLayerRMI(Params p) {
+  TwoLayerRMI(Params p) { this->reset(p); }
+
+  // Discards the trained model and sets new hyperparameters, while keeping the
+  // memory of the model and of its training data
+  void reset(Params p) {
     this->trained = false;
     this->hp = p;
     this->leaf_models.resize(p.num_leaf_models);
+    this->leaf_bases.resize(p.num_leaf_models);
+    this->mid_models.clear();
+    this->leaf_starts.clear();
+    this->radix_table.clear();
+    this->radix_min = this->radix_scale = 0;
     this->enable_dups_detection = true;
   }
 
+  // Returns the input of a model with the given base for a key
+  static double model_input(const T &key, const T &base) {
+    if constexpr (utils::uses_key_offsets<T>) {
+      return utils::key_distance(key, base);
+    } else {
+      return key;
+    }
+  }
+
+  // Sets the intercept of a model so that its line passes through the given
+  // training point. Models that take offsets use the key of that point as
+  // their base, which leaves no large terms to cancel out in their predictions.
+  static void fit_intercept(linear_model &model, T &base,
+                            const training_point<T> &p) {
+    if constexpr (utils::uses_key_offsets<T>) {
+      base = p.x;
+      model.intercept = p.y;
+    } else {
+      model.intercept = p.y - model.slope * p.x;
+    }
+  }
+
   // Pretty-printing function
   void print() {
     printf("[0][0]: slope=%0.5f; intercept=%0.5f;\n", root_model.slope,
            root_model.intercept);
-    for (int model_idx = 0; model_idx < hp.num_leaf_models; ++model_idx) {
+    for (int model_idx = 0; model_idx < (int)leaf_models.size(); ++model_idx) {
       printf("[%i][1]: slope=%0.5f; intercept=%0.5f;\n", model_idx,
              leaf_models[model_idx].slope, leaf_models[model_idx].intercept);
     }
@@ -86,7 +254,8 @@ class TwoLayerRMI {
 
   /**
    * @brief Train a CDF function with an RMI architecture, using linear spline
-   * interpolation.
+   * interpolation, or with the other kind of CDF model set by the model_type
+   * hyperparameter (see cdf_model_type).
    *
    * @param begin Random-access iterators to the initial position of the
    * sequence to be used for sorting. The range used is [begin,end), which
@@ -98,7 +267,27 @@ class TwoLayerRMI {
    * not the element pointed by last.
    * @return true if the model was trained successfully, false otherwise.
    */
-  bool train(vector<T>::iterator begin, vector<T>::iterator end) {
+  template <class RandomIt>
+  bool train(RandomIt begin, RandomIt end) {
+    return this->train(begin, end, [](const T &key) { return key; });
+  }
+
+  /**
+   * @brief Train a CDF function with an RMI architecture, using linear spline
+   * interpolation, or with the other kind of CDF model set by the model_type
+   * hyperparameter, on the keys of a sequence of records.
+   *
+   * @param begin Random-access iterator to the first record.
+   * @param end Random-access iterator past the last record.
+   * @param key_of A functor that returns the numerical key of a record.
+   * @param num_threads The number of threads that take the sample, sort it and
+   * count its unique keys. Each thread gets at least MIN_SAMPLE_SZ_PER_THREAD
+   * keys of the sample.
+   * @return true if the model was trained successfully, false otherwise.
+   */
+  template <class RandomIt, class KeyOf>
+  bool train(RandomIt begin, RandomIt end, const KeyOf &key_of,
+             long num_threads = 1) {
     // Determine input size
     const long INPUT_SZ = std::distance(begin, end);
 
@@ -122,122 +311,505 @@ class TwoLayerRMI {
            << TwoLayerRMI<T>::Params::DEFAULT_THRESHOLD << ")." << endl;
     }
 
-    // Initialize the CDF model
-    static const long NUM_LAYERS = 2;
-    vector<vector<vector<training_point<T>>>> training_data(NUM_LAYERS);
-    for (long layer_idx = 0; layer_idx < NUM_LAYERS; ++layer_idx) {
-      training_data[layer_idx].resize(hp.num_leaf_models);
+    if (this->hp.batch_sz <= 0) {
+      this->hp.batch_sz = TwoLayerRMI<T>::Params::DEFAULT_BATCH_SZ;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid batch size. Using default ("
+           << TwoLayerRMI<T>::Params::DEFAULT_BATCH_SZ << ")." << endl;
+    }
+
+    if (this->hp.overallocation < 1) {
+      this->hp.overallocation = TwoLayerRMI<T>::Params::DEFAULT_OVERALLOCATION;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid overallocation. Using default ("
+           << TwoLayerRMI<T>::Params::DEFAULT_OVERALLOCATION << ")." << endl;
+    }
+
+    if (this->hp.num_mid_models <= 0) {
+      this->hp.num_mid_models = TwoLayerRMI<T>::Params::DEFAULT_NUM_MID_MODELS;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid number of middle models. Using "
+              "default ("
+           << TwoLayerRMI<T>::Params::DEFAULT_NUM_MID_MODELS << ")." << endl;
+    }
+
+    if (not(this->hp.max_error > 0)) {
+      this->hp.max_error = TwoLayerRMI<T>::Params::DEFAULT_MAX_ERROR;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid maximum error. Using default ("
+           << TwoLayerRMI<T>::Params::DEFAULT_MAX_ERROR << ")." << endl;
+    }
+
+    if (this->hp.radix_bits <= 0 or
+        this->hp.radix_bits > TwoLayerRMI<T>::Params::MAX_RADIX_BITS) {
+      this->hp.radix_bits = TwoLayerRMI<T>::Params::DEFAULT_RADIX_BITS;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid number of radix bits. Using "
+              "default ("
+           << TwoLayerRMI<T>::Params::DEFAULT_RADIX_BITS << ")." << endl;
+    }
+
+    if (this->hp.sampling_block_sz <= 0) {
+      this->hp.sampling_block_sz =
+          TwoLayerRMI<T>::Params::DEFAULT_SAMPLING_BLOCK_SZ;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid sampling block size. Using "
+              "default ("
+           << TwoLayerRMI<T>::Params::DEFAULT_SAMPLING_BLOCK_SZ << ")." << endl;
+    }
+
+    if (this->hp.max_sampling_rate <= 0 or this->hp.max_sampling_rate > 1) {
+      this->hp.max_sampling_rate =
+          TwoLayerRMI<T>::Params::DEFAULT_MAX_SAMPLING_RATE;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid maximum sampling rate. Using "
+              "default ("
+           << TwoLayerRMI<T>::Params::DEFAULT_MAX_SAMPLING_RATE << ")." << endl;
+    }
+
+    if (not(this->hp.max_bucket_imbalance >= 0)) {
+      this->hp.max_bucket_imbalance =
+          TwoLayerRMI<T>::Params::DEFAULT_MAX_BUCKET_IMBALANCE;
+      cerr << "\33[93;1mWARNING\33[0m: Invalid maximum bucket imbalance. "
+              "Using default ("
+           << TwoLayerRMI<T>::Params::DEFAULT_MAX_BUCKET_IMBALANCE << ")."
+           << endl;
     }
 
     //----------------------------------------------------------//
     //                           SAMPLE                         //
     //----------------------------------------------------------//
+    LS_STATS_PHASE(SAMPLING);
 
-    // Determine sample size
-    const long SAMPLE_SZ = std::min<long>(
-        INPUT_SZ, std::max<long>(this->hp.sampling_rate * INPUT_SZ,
-                                 TwoLayerRMI<T>::Params::MIN_SORTING_SIZE));
+    if (this->hp.progressive_sampling) {
+      if (!this->train_progressively(begin, INPUT_SZ, key_of, num_threads)) {
+        return false;
+      }
+    } else {
+      // Determine sample size
+      const long SAMPLE_SZ = std::min<long>(
+          INPUT_SZ, std::max<long>(this->hp.sampling_rate * INPUT_SZ,
+                                   TwoLayerRMI<T>::Params::MIN_SORTING_SIZE));
+
+      this->take_sample(begin, INPUT_SZ, key_of, SAMPLE_SZ,
+                        this->hp.sampling_block_sz, 0, this->training_sample,
+                        num_threads);
+      utils::parallel_sort(
+          this->training_sample,
+          sample_threads(num_threads, this->training_sample.size()));
+
+      // Stop early if the array has very few unique values
+      if (!this->check_unique_keys(num_threads)) {
+        return false;
+      }
 
-    // Create a sample array
-    this->training_sample.reserve(SAMPLE_SZ);
+      //----------------------------------------------------------//
+      //                     TRAIN THE MODELS                     //
+      //----------------------------------------------------------//
 
-    // Start sampling
-    long offset = static_cast<long>(1. * INPUT_SZ / SAMPLE_SZ);
-    for (auto i = begin; i < end; i += offset) {
-      // NOTE:  We don't directly assign SAMPLE_SZ to this->training_sample_sz
-      //        to avoid issues with divisibility
-      this->training_sample.push_back(*i);
+      this->fit_model();
     }
 
-    // Sort the sample using the provided comparison function
-    std::sort(this->training_sample.begin(), this->training_sample.end());
+    // NOTE:
+    // The last stage (layer) of this model contains weights that predict the
+    // CDF of the keys (i.e. Range is [0-1]) When using this model to predict
+    // the position of the keys in the sorted order, you MUST scale the weights
+    // of the last layer to whatever range you are predicting for. The inner
+    // layers of the model have already been extrapolated to the length of the
+    // stage.git
+    //
+    // This is a design choice to help with the portability of the model.
+    //
+    this->trained = true;
 
-    // Count the number of unique keys
-    auto sample_cpy = this->training_sample;
-    long num_unique_elms = std::distance(
-        sample_cpy.begin(), std::unique(sample_cpy.begin(), sample_cpy.end()));
+    return true;
+  }
+
+  // Returns the radix bucket of an input of the root model, which is the index
+  // of the entry of the radix table that narrows the search of its leaf
+  long radix_bucket(double x) const {
+    return static_cast<long>(
+        std::max(0., std::min((1L << hp.radix_bits) - 1.,
+                              (x - this->radix_min) * this->radix_scale)));
+  }
+
+ private:
+  // Limits the number of threads that work on a sample of SAMPLE_SZ keys, so
+  // that each thread gets at least MIN_SAMPLE_SZ_PER_THREAD keys of it
+  static long sample_threads(long num_threads, long SAMPLE_SZ) {
+    return std::max(
+        1L, std::min(num_threads,
+                     SAMPLE_SZ /
+                         TwoLayerRMI<T>::Params::MIN_SAMPLE_SZ_PER_THREAD));
+  }
+
+  // Takes a sample of about SAMPLE_SZ keys of the input into `sample`. The
+  // input is split into stretches of BLOCK_SZ * offset keys, and the sample
+  // takes a run of BLOCK_SZ contiguous keys from each of them, where only the
+  // last stretch may be shorter. The runs of one key start at their stretch
+  // when no seed is given, and the other runs at a pseudo-random position of
+  // their stretch, which the seed varies.
+  // NOTE:  We don't directly use SAMPLE_SZ as the number of sampled keys to
+  //        avoid issues with divisibility
+  template <class RandomIt, class KeyOf>
+  void take_sample(RandomIt begin, long INPUT_SZ, const KeyOf &key_of,
+                   long SAMPLE_SZ, long BLOCK_SZ, unsigned long seed,
+                   vector<T> &sample, long num_threads) const {
+    const long offset = static_cast<long>(1. * INPUT_SZ / SAMPLE_SZ);
+    const long STRETCH_SZ = BLOCK_SZ * offset;
+    const long NUM_FULL_STRETCHES = INPUT_SZ / STRETCH_SZ;
+    const long LAST_STRETCH_SZ = INPUT_SZ - NUM_FULL_STRETCHES * STRETCH_SZ;
+    const long num_samples = NUM_FULL_STRETCHES * BLOCK_SZ +
+                             std::min(BLOCK_SZ, LAST_STRETCH_SZ);
+    sample.resize(num_samples);
+
+    // Each thread takes the runs of a range of stretches
+    num_threads = sample_threads(num_threads, num_samples);
+    const long NUM_STRETCHES = NUM_FULL_STRETCHES + (LAST_STRETCH_SZ > 0);
+    utils::run_in_parallel(num_threads, [&](long thread_idx) {
+      const long stretches_end = (thread_idx + 1) * NUM_STRETCHES / num_threads;
+      for (long stretch_idx = thread_idx * NUM_STRETCHES / num_threads;
+           stretch_idx < stretches_end; ++stretch_idx) {
+        const long stretch_sz = stretch_idx < NUM_FULL_STRETCHES
+                                    ? STRETCH_SZ
+                                    : LAST_STRETCH_SZ;
+        const long run_sz = std::min(BLOCK_SZ, stretch_sz);
+        long run_start = stretch_idx * STRETCH_SZ;
+        if (BLOCK_SZ > 1 or seed != 0) {
+          run_start += utils::mix_bits(stretch_idx ^ seed) %
+                       (stretch_sz - run_sz + 1);
+        }
+        auto *out = &sample[stretch_idx * BLOCK_SZ];
+        for (long i = 0; i < run_sz; ++i) {
+          out[i] = key_of(begin[run_start + i]);
+        }
+      }
+    });
+  }
+
+  // Counts the unique keys of the sorted sample, and checks that there are at
+  // least 2 unique training examples per leaf model. Duplicate detection is
+  // disabled when nearly all the keys of the sample are unique.
+  bool check_unique_keys(long num_threads) {
+    const long SAMPLE_SZ = this->training_sample.size();
+    num_threads = sample_threads(num_threads, SAMPLE_SZ);
+    auto chunk_begin = [&](long thread_idx) {
+      return thread_idx * SAMPLE_SZ / num_threads;
+    };
+
+    vector<long> chunk_unique_elms(num_threads, 0);
+    utils::run_in_parallel(num_threads, [&](long thread_idx) {
+      const long chunk_end = chunk_begin(thread_idx + 1);
+      long num_unique = 0;
+      for (long i = std::max(1L, chunk_begin(thread_idx)); i < chunk_end; ++i) {
+        num_unique += this->training_sample[i - 1] != this->training_sample[i];
+      }
+      chunk_unique_elms[thread_idx] = num_unique;
+    });
+    long num_unique_elms = 1;
+    for (auto num_unique : chunk_unique_elms) {
+      num_unique_elms += num_unique;
+    }
 
-    // Stop early if the array has very few unique values. We need at least 2
-    // unique training examples per leaf model.
     if (num_unique_elms < 2 * this->hp.num_leaf_models) {
       return false;
-    } else if (num_unique_elms > .9 * training_sample.size()) {
+    } else if (num_unique_elms > .9 * SAMPLE_SZ) {
       this->enable_dups_detection = false;
     }
+    return true;
+  }
 
-    //----------------------------------------------------------//
-    //                     TRAIN THE MODELS                     //
-    //----------------------------------------------------------//
+  // Trains the kind of CDF model set by the model_type hyperparameter on the
+  // sorted sample
+  void fit_model() {
+    LS_STATS_PHASE(TRAINING);
+    switch (this->hp.model_type) {
+      case cdf_model_type::PIECEWISE_LINEAR:
+        this->train_piecewise_linear();
+        break;
+      case cdf_model_type::RADIX_SPLINE:
+        this->train_radix_spline();
+        break;
+      default:
+        this->train_rmi();
+    }
+  }
 
-    // Populate the training data for the root model
-    for (long i = 0; i < SAMPLE_SZ; ++i) {
-      training_data[0][0].push_back(
-          {this->training_sample[i], 1. * i / SAMPLE_SZ});
+  // Grows the training sample in rounds (see Params::progressive_sampling).
+  // The first round takes PROGRESSIVE_KEYS_PER_LEAF keys per leaf model, and
+  // the held-out keys are taken at a pseudo-random position of each stretch of
+  // the input, so that their buckets are independent of each other. A round
+  // whose sample has too few unique keys is followed by a larger one.
+  template <class RandomIt, class KeyOf>
+  bool train_progressively(RandomIt begin, long INPUT_SZ, const KeyOf &key_of,
+                           long num_threads) {
+    constexpr long PROGRESSIVE_KEYS_PER_LEAF = 16;
+    constexpr long HELD_OUT_KEYS_PER_BUCKET = 16;
+    constexpr unsigned long HELD_OUT_SEED = 0x5851f42d4c957f2dUL;
+
+    // A round that does not reduce the estimated imbalance by this factor ends
+    // the sampling, as the model has converged
+    constexpr double MIN_IMPROVEMENT = .8;
+
+    const long MAX_SAMPLE_SZ = std::min<long>(
+        INPUT_SZ, std::max<long>(this->hp.max_sampling_rate * INPUT_SZ,
+                                 TwoLayerRMI<T>::Params::MIN_SORTING_SIZE));
+    this->take_sample(begin, INPUT_SZ, key_of,
+                      std::min(INPUT_SZ,
+                               HELD_OUT_KEYS_PER_BUCKET * this->hp.fanout),
+                      1, HELD_OUT_SEED, this->held_out_sample, num_threads);
+
+    long sample_sz = std::min(
+        MAX_SAMPLE_SZ,
+        std::max(TwoLayerRMI<T>::Params::MIN_SORTING_SIZE,
+                 PROGRESSIVE_KEYS_PER_LEAF * this->hp.num_leaf_models));
+    double prev_imbalance = std::numeric_limits<double>::infinity();
+    bool fitted = false;
+    while (true) {
+      this->take_sample(begin, INPUT_SZ, key_of, sample_sz,
+                        this->hp.sampling_block_sz, 0, this->training_sample,
+                        num_threads);
+      utils::parallel_sort(
+          this->training_sample,
+          sample_threads(num_threads, this->training_sample.size()));
+
+      this->enable_dups_detection = true;
+      fitted = this->check_unique_keys(num_threads);
+      if (fitted) {
+        this->fit_model();
+        const double imbalance = this->estimate_bucket_imbalance();
+        if (imbalance <= this->hp.max_bucket_imbalance or
+            imbalance > MIN_IMPROVEMENT * prev_imbalance) {
+          break;
+        }
+        prev_imbalance = imbalance;
+      }
+
+      if (sample_sz == MAX_SAMPLE_SZ) break;
+      sample_sz = std::min(MAX_SAMPLE_SZ, 2 * sample_sz);
     }
+    return fitted;
+  }
+
+  // Returns the CDF that the trained model predicts for a key. This is the
+  // scalar counterpart of the inference of the sorting routines, which only
+  // serves to evaluate the model while it is trained.
+  double predict_cdf(const T &key) const {
+    const double x = model_input(key, this->root_base);
+    const long NUM_LEAF_MODELS = this->leaf_models.size();
+    long leaf_idx;
+    if (!this->leaf_starts.empty()) {
+      leaf_idx = std::upper_bound(this->leaf_starts.begin(),
+                                  this->leaf_starts.end(), x) -
+                 this->leaf_starts.begin() - 1;
+    } else {
+      double next = this->root_model.slope * x + this->root_model.intercept;
+      if (!this->mid_models.empty()) {
+        const long NUM_MID_MODELS = this->mid_models.size();
+        const auto &mid_model = this->mid_models[std::max(
+            0L, std::min(NUM_MID_MODELS - 1, static_cast<long>(next)))];
+        next = mid_model.slope * x + mid_model.intercept;
+      }
+      leaf_idx = static_cast<long>(next);
+    }
+    leaf_idx = std::max(0L, std::min(NUM_LEAF_MODELS - 1, leaf_idx));
+
+    const auto &leaf_model = this->leaf_models[leaf_idx];
+    return leaf_model.slope * model_input(key, this->leaf_bases[leaf_idx]) +
+           leaf_model.intercept;
+  }
+
+  // Estimates the relative variance of the sizes of `fanout` buckets of equal
+  // predicted CDF from the buckets of the held-out keys. The variance of the
+  // counts of the held-out keys adds the one of sampling them, which is about
+  // their mean count, so that it is subtracted.
+  double estimate_bucket_imbalance() const {
+    LS_STATS_PHASE(TRAINING);
+    const long NUM_BUCKETS = this->hp.fanout;
+    vector<long> bucket_sizes(NUM_BUCKETS, 0);
+    for (const auto &key : this->held_out_sample) {
+      const long bucket_idx =
+          static_cast<long>(this->predict_cdf(key) * NUM_BUCKETS);
+      ++bucket_sizes[std::max(0L, std::min(NUM_BUCKETS - 1, bucket_idx))];
+    }
+
+    const double mean = 1. * this->held_out_sample.size() / NUM_BUCKETS;
+    double var = 0;
+    for (auto sz : bucket_sizes) {
+      var += (sz - mean) * (sz - mean) / NUM_BUCKETS;
+    }
+    return std::max(0., var / (mean * mean) - 1. / mean);
+  }
+
+  // Returns the training point of the key at the given index of the sorted
+  // sample, whose y is its rank in the sample scaled to [0, 1)
+  training_point<T> sample_point(long i) const {
+    return {this->training_sample[i], 1. * i / this->training_sample.size()};
+  }
+
+  // Splits the sorted sample into the ranges of the training points of
+  // num_models models, given the model that route(i) predicts for the key at
+  // index i. As the models of a layer are fitted in key order, the predictions
+  // do not decrease along the sample, so the start of each range is found by a
+  // binary search after the start of the previous range.
+  template <class Route>
+  void split_sample(long num_models, const Route &route, vector<long> &ranges) {
+    const long SAMPLE_SZ = this->training_sample.size();
+    ranges.resize(num_models + 1);
+    ranges[0] = 0;
+    ranges[num_models] = SAMPLE_SZ;
+    for (long model_idx = 1; model_idx < num_models; ++model_idx) {
+      long lo = ranges[model_idx - 1];
+      long hi = SAMPLE_SZ;
+      while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (route(mid) < model_idx) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      ranges[model_idx] = lo;
+    }
+  }
+
+  // Trains a 2-layer or a 3-layer RMI on the sorted sample
+  void train_rmi() {
+    const long SAMPLE_SZ = this->training_sample.size();
+    const bool THREE_LAYERS =
+        this->hp.model_type == cdf_model_type::THREE_LAYER_RMI;
+    const long NUM_LEAF_MODELS = this->hp.num_leaf_models;
+    const long NUM_MID_MODELS = THREE_LAYERS ? this->hp.num_mid_models : 0;
+
+    // Initialize the CDF model
+    this->leaf_models.resize(NUM_LEAF_MODELS);
+    this->leaf_bases.resize(NUM_LEAF_MODELS);
+    this->mid_models.resize(NUM_MID_MODELS);
+    this->leaf_starts.clear();
+    this->radix_table.clear();
 
     // Train the root model using linear interpolation
-    auto *current_training_data = &training_data[0][0];
     linear_model *current_model = &(this->root_model);
 
     // Find the min and max values in the training set
-    training_point<T> min = current_training_data->front();
-    training_point<T> max = current_training_data->back();
+    training_point<T> min = sample_point(0);
+    training_point<T> max = sample_point(SAMPLE_SZ - 1);
 
     // Calculate the slope and intercept terms, assuming min.y = 0 and max.y
-    current_model->slope = 1. / (max.x - min.x);
-    current_model->intercept = -current_model->slope * min.x;
+    current_model->slope = 1. / utils::key_distance(max.x, min.x);
+    fit_intercept(*current_model, this->root_base, min);
 
     // Extrapolate for the number of models in the next layer
-    current_model->slope *= this->hp.num_leaf_models - 1;
-    current_model->intercept *= this->hp.num_leaf_models - 1;
-
-    // Populate the training data for the next layer
-    for (const auto &d : *current_training_data) {
-      // Predict the model index in next layer
-      long rank = current_model->slope * d.x + current_model->intercept;
+    const long NUM_NEXT_MODELS =
+        THREE_LAYERS ? NUM_MID_MODELS : NUM_LEAF_MODELS;
+    current_model->slope *= NUM_NEXT_MODELS - 1;
+    current_model->intercept *= NUM_NEXT_MODELS - 1;
+
+    // Predicts the model index in the next layer for the key at index i,
+    // normalized between 0 and the number of models in the next layer
+    auto predict_next = [&](long i) {
+      long rank = this->root_model.slope *
+                      model_input(this->training_sample[i], this->root_base) +
+                  this->root_model.intercept;
+      return std::max(static_cast<long>(0),
+                      std::min(NUM_NEXT_MODELS - 1, rank));
+    };
+
+    if (!THREE_LAYERS) {
+      this->split_sample(NUM_LEAF_MODELS, predict_next, this->leaf_ranges);
+      this->train_leaf_models();
+      return;
+    }
 
-      // Normalize the rank between 0 and the number of models in the next layer
-      rank = std::max(static_cast<long>(0),
-                      std::min(this->hp.num_leaf_models - 1, rank));
+    // Train the middle models using linear interpolation, extrapolated for the
+    // number of leaf models. They take the input of the root model, so that
+    // they need no bases of their own. An empty model predicts the last leaf
+    // model predicted by the models before it.
+    this->split_sample(NUM_MID_MODELS, predict_next, this->mid_ranges);
+    double prev_leaf = 0;
+    for (long model_idx = 0; model_idx < NUM_MID_MODELS; ++model_idx) {
+      current_model = &(this->mid_models[model_idx]);
+      const long range_begin = this->mid_ranges[model_idx];
+      const long range_end = this->mid_ranges[model_idx + 1];
+
+      if (range_begin == range_end) {
+        current_model->slope = 0;
+        current_model->intercept = prev_leaf;
+        continue;
+      }
 
-      // Place the data in the predicted training bucket
-      training_data[1][rank].push_back(d);
+      min = sample_point(range_begin);
+      max = sample_point(range_end - 1);
+      const double min_x = model_input(min.x, this->root_base);
+      const double max_x = model_input(max.x, this->root_base);
+      current_model->slope =
+          max_x > min_x ? (NUM_LEAF_MODELS - 1) * (max.y - min.y) /
+                              (max_x - min_x)
+                        : 0;
+      current_model->intercept =
+          (NUM_LEAF_MODELS - 1) * min.y - current_model->slope * min_x;
+      prev_leaf = (NUM_LEAF_MODELS - 1) * max.y;
     }
 
-    // Train the leaf models
-    for (long model_idx = 0; model_idx < this->hp.num_leaf_models;
-         ++model_idx) {
+    // Route the keys to the leaf models through the middle models
+    this->split_sample(
+        NUM_LEAF_MODELS,
+        [&](long i) {
+          const double x =
+              model_input(this->training_sample[i], this->root_base);
+          const auto &mid_model = this->mid_models[predict_next(i)];
+          long rank = mid_model.slope * x + mid_model.intercept;
+          return std::max(static_cast<long>(0),
+                          std::min(NUM_LEAF_MODELS - 1, rank));
+        },
+        this->leaf_ranges);
+    this->train_leaf_models();
+  }
+
+  // Trains the leaf models of an RMI by linear spline interpolation of the
+  // ranges of the sample that the layer above routed to them
+  void train_leaf_models() {
+    const long NUM_LEAF_MODELS = this->leaf_models.size();
+    training_point<T> min, max;
+
+    // The last training point of the previous model, which is a fictive point
+    // after an empty first model
+    training_point<T> prev_last;
+
+    // The models with a zero slope take any base
+    std::fill(this->leaf_bases.begin(), this->leaf_bases.end(),
+              this->training_sample.front());
+    for (long model_idx = 0; model_idx < NUM_LEAF_MODELS; ++model_idx) {
       // Update iterator variables
-      current_training_data = &training_data[1][model_idx];
-      current_model = &(this->leaf_models[model_idx]);
+      const long range_begin = this->leaf_ranges[model_idx];
+      const long range_end = this->leaf_ranges[model_idx + 1];
+      linear_model *current_model = &(this->leaf_models[model_idx]);
 
       // Interpolate the min points in the training buckets
       if (model_idx == 0) {
         // The current model is the first model in the current layer
 
-        if (current_training_data->size() < 2) {
+        if (range_end - range_begin < 2) {
           // Case 1: The first model in this layer is empty
           current_model->slope = 0;
           current_model->intercept = 0;
 
-          // Insert a fictive training point to avoid propagating more than one
+          // Use a fictive training point to avoid propagating more than one
           // empty initial models.
-          training_point<T> tp;
-          tp.x = 0;
-          tp.y = 0;
-          current_training_data->push_back(tp);
+          prev_last.x = 0;
+          prev_last.y = 0;
+          if constexpr (utils::uses_key_offsets<T>) {
+            // The next model takes offsets from this point, which must not be
+            // greater than its keys even when they are negative
+            prev_last.x = this->training_sample.front();
+          }
         } else {
           // Case 2: The first model in this layer is not empty
 
-          min = current_training_data->front();
-          max = current_training_data->back();
+          min = sample_point(range_begin);
+          max = sample_point(range_end - 1);
 
           // Hallucinating as if min.y = 0
-          current_model->slope = (1. * max.y) / (max.x - min.x);
-          current_model->intercept = min.y - current_model->slope * min.x;
+          current_model->slope =
+              (1. * max.y) / utils::key_distance(max.x, min.x);
+          fit_intercept(*current_model, this->leaf_bases[model_idx], min);
+          prev_last = max;
         }
-      } else if (model_idx == this->hp.num_leaf_models - 1) {
-        if (current_training_data->empty()) {
+      } else if (model_idx == NUM_LEAF_MODELS - 1) {
+        if (range_begin == range_end) {
           // Case 3: The final model in this layer is empty
 
           current_model->slope = 0;
@@ -245,59 +817,175 @@ class TwoLayerRMI {
         } else {
           // Case 4: The last model in this layer is not empty
 
-          min = training_data[1][model_idx - 1].back();
-          max = current_training_data->back();
+          min = prev_last;
+          max = sample_point(range_end - 1);
 
           // Hallucinating as if max.y = 1
-          current_model->slope = (1. - min.y) / (max.x - min.x);
-          current_model->intercept = min.y - current_model->slope * min.x;
+          current_model->slope =
+              (1. - min.y) / utils::key_distance(max.x, min.x);
+          fit_intercept(*current_model, this->leaf_bases[model_idx], min);
         }
       } else {
         // The current model is not the first model in the current layer
 
-        if (current_training_data->empty()) {
-          // Case 5: The intermediate model in this layer is empty
+        if (range_begin == range_end) {
+          // Case 5: The intermediate model in this layer is empty. If the
+          // previous model was empty too, this uses the fictive training point.
           current_model->slope = 0;
-          current_model->intercept = training_data[1][model_idx - 1]
-                                         .back()
-                                         .y;  // If the previous model
-                                              // was empty too, it will
-                                              // use the fictive
-                                              // training points
-
-          // Insert a fictive training point to avoid propagating more than one
-          // empty initial models.
-          // NOTE: This will _NOT_ throw to DIV/0 due to identical x's and y's
-          // because it is working backwards.
-          training_point<T> tp;
-          tp.x = training_data[1][model_idx - 1].back().x;
-          tp.y = training_data[1][model_idx - 1].back().y;
-          current_training_data->push_back(tp);
+          current_model->intercept = prev_last.y;
         } else {
           // Case 6: The intermediate leaf model is not empty
 
-          min = training_data[1][model_idx - 1].back();
-          max = current_training_data->back();
+          min = prev_last;
+          max = sample_point(range_end - 1);
 
-          current_model->slope = (max.y - min.y) / (max.x - min.x);
-          current_model->intercept = min.y - current_model->slope * min.x;
+          current_model->slope =
+              (max.y - min.y) / utils::key_distance(max.x, min.x);
+          fit_intercept(*current_model, this->leaf_bases[model_idx], min);
+          prev_last = max;
         }
       }
     }
+  }
 
-    // NOTE:
-    // The last stage (layer) of this model contains weights that predict the
-    // CDF of the keys (i.e. Range is [0-1]) When using this model to predict
-    // the position of the keys in the sorted order, you MUST scale the weights
-    // of the last layer to whatever range you are predicting for. The inner
-    // layers of the model have already been extrapolated to the length of the
-    // stage.git
-    //
-    // This is a design choice to help with the portability of the model.
-    //
-    this->trained = true;
+  // Discards the leaves of the previous model before the leaves of a
+  // piecewise-linear or a radix-spline model are appended. The root model of
+  // these models only sets the base of the root inputs.
+  void clear_search_leaves() {
+    this->root_model = linear_model();
+    this->root_base = this->training_sample.front();
+    this->mid_models.clear();
+    this->leaf_models.clear();
+    this->leaf_bases.clear();
+    this->leaf_starts.clear();
+    this->radix_table.clear();
+    this->radix_min = this->radix_scale = 0;
+  }
 
-    return true;
+  // Appends a leaf model that starts at the key of the sample at start_idx,
+  // whose slope is given in sample positions per unit of the keys
+  void add_search_leaf(long start_idx, double slope) {
+    const double SAMPLE_SZ = this->training_sample.size();
+    const T &start = this->training_sample[start_idx];
+
+    linear_model model;
+    model.slope = slope / SAMPLE_SZ;
+    T base = start;
+    fit_intercept(model, base, {start, start_idx / SAMPLE_SZ});
+
+    this->leaf_models.push_back(model);
+    this->leaf_bases.push_back(base);
+    this->leaf_starts.push_back(model_input(start, this->root_base));
+  }
+
+  // Trains a piecewise-linear model with the shrinking cone algorithm. A
+  // segment starts at a key of the sample and is extended over the next
+  // distinct keys for as long as some line through its first key predicts the
+  // ranks of all of them within max_error positions. The segment takes the
+  // slope in the middle of the cone of such lines.
+  void train_piecewise_linear() {
+    const auto &sample = this->training_sample;
+    const long SAMPLE_SZ = sample.size();
+    const double MAX_ERROR = this->hp.max_error;
+    this->clear_search_leaves();
+
+    long segment_start = 0;
+    double min_slope = 0;
+    double max_slope = std::numeric_limits<double>::infinity();
+    for (long i = 1; i < SAMPLE_SZ; ++i) {
+      // Only the first occurrence of each key is a training point
+      if (sample[i] == sample[i - 1]) continue;
+
+      const double dx = utils::key_distance(sample[i], sample[segment_start]);
+      const double dy = i - segment_start;
+      if ((dy + MAX_ERROR) / dx < min_slope or
+          (dy - MAX_ERROR) / dx > max_slope) {
+        // The cone of the segment cannot be narrowed to this key
+        this->add_search_leaf(segment_start, (min_slope + max_slope) / 2);
+        segment_start = i;
+        min_slope = 0;
+        max_slope = std::numeric_limits<double>::infinity();
+      } else {
+        min_slope = std::max(min_slope, (dy - MAX_ERROR) / dx);
+        max_slope = std::min(max_slope, (dy + MAX_ERROR) / dx);
+      }
+    }
+
+    // The last segment has no slope when it holds a single key
+    this->add_search_leaf(
+        segment_start,
+        std::isinf(max_slope) ? 0. : (min_slope + max_slope) / 2);
+  }
+
+  // Trains a radix-spline model with the greedy spline corridor algorithm. The
+  // spline starts at the first key of the sample, and the corridor holds the
+  // slopes of the lines from the last spline point that predict the ranks of
+  // all the distinct keys since that point within max_error positions. When
+  // the line to a key leaves the corridor, the previous key becomes a spline
+  // point. The radix table is then built over the starts of the segments.
+  void train_radix_spline() {
+    const auto &sample = this->training_sample;
+    const long SAMPLE_SZ = sample.size();
+    const double MAX_ERROR = this->hp.max_error;
+    this->clear_search_leaves();
+
+    long last_point = 0;
+    long prev_key = 0;
+    double min_slope = 0;
+    double max_slope = std::numeric_limits<double>::infinity();
+    for (long i = 1; i < SAMPLE_SZ; ++i) {
+      // Only the first occurrence of each key is a training point
+      if (sample[i] == sample[i - 1]) continue;
+
+      double dx = utils::key_distance(sample[i], sample[last_point]);
+      double dy = i - last_point;
+      if (dy / dx < min_slope or dy / dx > max_slope) {
+        // The previous key ends the segment of the last spline point, which
+        // passes through both keys
+        this->add_search_leaf(
+            last_point,
+            (prev_key - last_point) /
+                utils::key_distance(sample[prev_key], sample[last_point]));
+        last_point = prev_key;
+        dx = utils::key_distance(sample[i], sample[last_point]);
+        dy = i - last_point;
+        min_slope = 0;
+        max_slope = std::numeric_limits<double>::infinity();
+      }
+      min_slope = std::max(min_slope, (dy - MAX_ERROR) / dx);
+      max_slope = std::min(max_slope, (dy + MAX_ERROR) / dx);
+      prev_key = i;
+    }
+
+    // The last key ends the last segment, which is extrapolated beyond it
+    this->add_search_leaf(
+        last_point,
+        prev_key == last_point
+            ? 0.
+            : (prev_key - last_point) /
+                  utils::key_distance(sample[prev_key], sample[last_point]));
+
+    // The radix buckets split the range of the root inputs of the sample into
+    // 2^radix_bits buckets of a power-of-two width, so that the radix bucket of
+    // a key is found without rounding errors
+    const long NUM_RADIX_BUCKETS = 1L << this->hp.radix_bits;
+    const double range =
+        model_input(sample.back(), this->root_base) - this->leaf_starts[0];
+    int range_exp;
+    std::frexp(range, &range_exp);
+    this->radix_min = this->leaf_starts[0];
+    this->radix_scale = std::ldexp(1., this->hp.radix_bits - range_exp);
+
+    const long NUM_LEAF_MODELS = this->leaf_starts.size();
+    this->radix_table.resize(NUM_RADIX_BUCKETS + 1);
+    long leaf_idx = 0;
+    for (long r = 0; r <= NUM_RADIX_BUCKETS; ++r) {
+      while (leaf_idx < NUM_LEAF_MODELS and
+             this->radix_bucket(this->leaf_starts[leaf_idx]) < r) {
+        ++leaf_idx;
+      }
+      this->radix_table[r] = leaf_idx;
+    }
   }
 };
 }  // namespace learned_sort
\ No newline at end of file
@@ -0,0 +1,270 @@
+#pragma once
+
+/**
+ * @file sort_stats.h
+ * @brief Per-phase timings and counters of Learned Sort. They are only
+ * collected when LEARNED_SORT_STATS is defined before the library is included,
+ * and otherwise the instrumentation of the sorting routines compiles to
+ * nothing.
+ */
+
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+
+namespace learned_sort {
+
+// The phases of a sort that are timed separately
+enum class sort_phase {
+  SAMPLING,
+  TRAINING,
+  PRIMARY_PARTITION,
+  DEFRAGMENTATION,
+  SECONDARY_PARTITION,
+  COUNTING_SORT,
+  TOUCH_UP,
+  NUM_PHASES
+};
+
+/**
+ * @brief The wall time of each phase of the sorts that run while it is
+ * collected (see collect_stats), and counters of the work that they do.
+ *
+ * The phases do not overlap, so a phase that runs within another one is only
+ * counted in its own time. The time of the sort that falls in no phase, such as
+ * the checks for sorted inputs, is the total time minus the phase times. Only
+ * the work of the thread that collects the statistics is recorded, so the
+ * parallel sort only records the work that runs on the calling thread.
+ */
+struct sort_stats {
+  // Whether the sorting routines are instrumented, which the
+  // LEARNED_SORT_STATS macro sets at compile time
+#ifdef LEARNED_SORT_STATS
+  static constexpr bool ENABLED = true;
+#else
+  static constexpr bool ENABLED = false;
+#endif
+
+  static constexpr int NUM_PHASES = static_cast<int>(sort_phase::NUM_PHASES);
+
+  // The histograms of the bucket sizes have a bin for the empty buckets, and
+  // bin b > 0 counts the buckets of [2^(b-1), 2^b) keys
+  static constexpr int NUM_HISTOGRAM_BINS = 40;
+
+  // The wall time of the collection, and of each phase within it
+  double total_ms = 0;
+  double phase_ms[NUM_PHASES]{0};
+
+  // The histograms of the sizes of the primary and the secondary buckets
+  long primary_bucket_hist[NUM_HISTOGRAM_BINS]{0};
+  long secondary_bucket_hist[NUM_HISTOGRAM_BINS]{0};
+
+  // The primary and secondary buckets that were not sorted because all their
+  // keys are equal
+  long homogeneous_buckets_skipped = 0;
+
+  // The fragments that the defragmentation swapped into their buckets
+  long fragments_swapped = 0;
+
+  // The positions that the touch-up moved keys by, and the buckets whose
+  // touch-up gave up and sorted them from scratch
+  long touch_up_moves = 0;
+  long touch_up_fallbacks = 0;
+
+  // Returns the name of a phase
+  static const char *phase_name(int phase) {
+    static const char *const NAMES[NUM_PHASES] = {"sampling",
+                                                  "training",
+                                                  "primary_partition",
+                                                  "defragmentation",
+                                                  "secondary_partition",
+                                                  "counting_sort",
+                                                  "touch_up"};
+    return NAMES[phase];
+  }
+
+  // Returns the histogram bin of a bucket of bucket_sz keys
+  static int histogram_bin(long bucket_sz) {
+    int bin = 0;
+    while (bucket_sz > 0 && bin < NUM_HISTOGRAM_BINS - 1) {
+      bucket_sz >>= 1;
+      ++bin;
+    }
+    return bin;
+  }
+
+  // Prints the timings and the counters, and the non-empty bins of the
+  // histograms
+  void print(std::ostream &os) const {
+    os << std::fixed << std::setprecision(3);
+    os << "total_ms: " << total_ms << "\n";
+    for (int phase = 0; phase < NUM_PHASES; ++phase) {
+      os << "  " << phase_name(phase) << "_ms: " << phase_ms[phase] << "\n";
+    }
+    os << "homogeneous_buckets_skipped: " << homogeneous_buckets_skipped
+       << "\nfragments_swapped: " << fragments_swapped
+       << "\ntouch_up_moves: " << touch_up_moves
+       << "\ntouch_up_fallbacks: " << touch_up_fallbacks << "\n";
+    print_histogram(os, "primary_bucket_sizes", primary_bucket_hist);
+    print_histogram(os, "secondary_bucket_sizes", secondary_bucket_hist);
+    os.unsetf(std::ios::floatfield);
+  }
+
+ private:
+  static void print_histogram(std::ostream &os, const char *name,
+                              const long *hist) {
+    os << name << ":\n";
+    for (int bin = 0; bin < NUM_HISTOGRAM_BINS; ++bin) {
+      if (hist[bin] == 0) continue;
+      if (bin == 0) {
+        os << "  0: ";
+      } else {
+        os << "  [" << (1L << (bin - 1)) << ", " << (1L << bin) << "): ";
+      }
+      os << hist[bin] << "\n";
+    }
+  }
+};
+
+namespace internal {
+
+// The statistics that the current thread collects into, if any, and the phase
+// that is being timed
+struct stats_collector {
+  typedef std::chrono::steady_clock clock;
+
+  sort_stats *stats = nullptr;
+  int phase = -1;
+  clock::time_point phase_start;
+
+  static stats_collector &of_this_thread() {
+    thread_local stats_collector collector;
+    return collector;
+  }
+
+  // Adds the time since the start of the current phase to that phase, and
+  // starts timing the given phase
+  void switch_phase(int next_phase) {
+    const auto now = clock::now();
+    if (phase >= 0) {
+      stats->phase_ms[phase] +=
+          std::chrono::duration<double, std::milli>(now - phase_start).count();
+    }
+    phase = next_phase;
+    phase_start = now;
+  }
+};
+
+// Times a phase for as long as it is in scope, and pauses the enclosing phase
+// meanwhile
+class phase_scope {
+ public:
+  explicit phase_scope(sort_phase phase)
+      : collector(stats_collector::of_this_thread()) {
+    if (!collector.stats) return;
+    enclosing_phase = collector.phase;
+    collector.switch_phase(static_cast<int>(phase));
+  }
+
+  phase_scope(const phase_scope &) = delete;
+  phase_scope &operator=(const phase_scope &) = delete;
+
+  // Times the rest of the scope as another phase
+  void next(sort_phase phase) {
+    if (collector.stats) collector.switch_phase(static_cast<int>(phase));
+  }
+
+  ~phase_scope() {
+    if (collector.stats) collector.switch_phase(enclosing_phase);
+  }
+
+ private:
+  stats_collector &collector;
+  int enclosing_phase = -1;
+};
+
+// Returns the statistics that the current thread collects into, or nullptr
+inline sort_stats *current_stats() {
+  return stats_collector::of_this_thread().stats;
+}
+
+}  // namespace internal
+
+/**
+ * @brief Collects the statistics of the sorts that the current thread runs
+ * while it is in scope. The statistics are reset first, and the total time is
+ * that of the whole scope. Without LEARNED_SORT_STATS, only the total time is
+ * measured.
+ *
+ * @code
+ * learned_sort::sort_stats stats;
+ * {
+ *   learned_sort::collect_stats collect(stats);
+ *   learned_sort::sort(arr.begin(), arr.end());
+ * }
+ * stats.print(std::cout);
+ * @endcode
+ */
+class collect_stats {
+ public:
+  explicit collect_stats(sort_stats &stats)
+      : stats(stats),
+        collector(internal::stats_collector::of_this_thread()),
+        prev_stats(collector.stats),
+        prev_phase(collector.phase),
+        start(internal::stats_collector::clock::now()) {
+    stats = sort_stats();
+    collector.stats = &stats;
+    collector.phase = -1;
+  }
+
+  collect_stats(const collect_stats &) = delete;
+  collect_stats &operator=(const collect_stats &) = delete;
+
+  ~collect_stats() {
+    stats.total_ms = std::chrono::duration<double, std::milli>(
+                         internal::stats_collector::clock::now() - start)
+                         .count();
+    collector.stats = prev_stats;
+    collector.phase = prev_phase;
+  }
+
+ private:
+  sort_stats &stats;
+  internal::stats_collector &collector;
+  sort_stats *prev_stats;
+  int prev_phase;
+  internal::stats_collector::clock::time_point start;
+};
+
+}  // namespace learned_sort
+
+// The instrumentation of the sorting routines. LS_STATS_PHASE times the rest
+// of the enclosing block as a phase, and LS_STATS_NEXT_PHASE switches that
+// block to another phase. LS_STATS_ADD adds to a counter, and LS_STATS_BUCKET
+// adds a bucket to a histogram of bucket sizes.
+#ifdef LEARNED_SORT_STATS
+#define LS_STATS_PHASE(phase)                                 \
+  ::learned_sort::internal::phase_scope ls_stats_phase_scope( \
+      ::learned_sort::sort_phase::phase)
+#define LS_STATS_NEXT_PHASE(phase) \
+  ls_stats_phase_scope.next(::learned_sort::sort_phase::phase)
+#define LS_STATS_ADD(counter, n)                                      \
+  do {                                                                \
+    if (auto *ls_stats = ::learned_sort::internal::current_stats()) { \
+      ls_stats->counter += (n);                                       \
+    }                                                                 \
+  } while (0)
+#define LS_STATS_BUCKET(hist, bucket_sz)                              \
+  do {                                                                \
+    if (auto *ls_stats = ::learned_sort::internal::current_stats()) { \
+      ++ls_stats->hist[::learned_sort::sort_stats::histogram_bin(     \
+          bucket_sz)];                                                \
+    }                                                                 \
+  } while (0)
+#else
+#define LS_STATS_PHASE(phase)
+#define LS_STATS_NEXT_PHASE(phase)
+#define LS_STATS_ADD(counter, n)
+#define LS_STATS_BUCKET(hist, bucket_sz)
+#endif
@@ -0,0 +1,96 @@
+#pragma once
+
+/**
+ * @file task_pool.h
+ * @brief A work-stealing pool of tasks, used for balancing the sorting of the
+ * buckets across threads when their sizes are skewed.
+ */
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+namespace learned_sort {
+namespace utils {
+
+// A pool of worker threads that execute tasks from per-worker queues. Each
+// worker takes tasks from the back of its own queue, and once the queue is
+// empty, it steals tasks from the front of the queues of the other workers.
+class WorkStealingPool {
+ public:
+  // A task receives the index of the worker that executes it, which can be
+  // used for pushing more tasks to the same worker
+  typedef std::function<void(long)> Task;
+
+  explicit WorkStealingPool(long num_threads)
+      : queues(num_threads), num_pending_tasks(0) {}
+
+  long num_threads() const { return queues.size(); }
+
+  // Adds a task to the queue of a worker. Running tasks may call this too.
+  void push(long thread_idx, Task task) {
+    ++num_pending_tasks;
+    std::lock_guard<std::mutex> lock(queues[thread_idx].mutex);
+    queues[thread_idx].tasks.push_back(std::move(task));
+  }
+
+  // Executes the tasks, including the ones that get pushed in the meantime,
+  // and returns once all of them have finished
+  void run() {
+    run_in_parallel(num_threads(), [&](long thread_idx) {
+      Task task;
+      while (num_pending_tasks > 0) {
+        if (pop(thread_idx, task) || steal(thread_idx, task)) {
+          task(thread_idx);
+          task = nullptr;
+          --num_pending_tasks;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+ private:
+  // Aligned to avoid false sharing between the queues of different workers
+  struct alignas(64) queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // Takes the most recently pushed task of a worker
+  bool pop(long thread_idx, Task &task) {
+    std::lock_guard<std::mutex> lock(queues[thread_idx].mutex);
+    if (queues[thread_idx].tasks.empty()) return false;
+    task = std::move(queues[thread_idx].tasks.back());
+    queues[thread_idx].tasks.pop_back();
+    return true;
+  }
+
+  // Takes the oldest task from the queue of another worker
+  bool steal(long thread_idx, Task &task) {
+    for (long i = 1; i < num_threads(); ++i) {
+      auto &victim = queues[(thread_idx + i) % num_threads()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<queue> queues;
+
+  // The number of tasks that were pushed but have not finished yet
+  std::atomic<long> num_pending_tasks;
+};
+
+}  // namespace utils
+}  // namespace learned_sort
@@ -1,5 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <climits>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
 namespace learned_sort {
 namespace utils {
 
@@ -9,10 +21,55 @@ inline T _get_key(T a) {
   return a;
 }
 
-template <class RandomIt>
-void insertion_sort(RandomIt begin, RandomIt end) {
+// Whether the CDF models take keys of type T as offsets from a base key of each
+// model, rather than as the keys themselves. This is the case for the integers
+// that do not fit in the mantissa of a double, where neighboring keys would be
+// rounded to the same double and collapse into the same bucket.
+template <class T>
+inline constexpr bool uses_key_offsets =
+    std::is_integral<T>::value && sizeof(T) > 4;
+
+// The distance of key a from key b, where a >= b. It is exact for the keys that
+// use offsets, even when the subtraction would overflow T.
+template <class T>
+inline double key_distance(const T &a, const T &b) {
+  if constexpr (uses_key_offsets<T>) {
+    typedef std::make_unsigned_t<T> U;
+    return static_cast<double>(static_cast<U>(a) - static_cast<U>(b));
+  } else {
+    return a - b;
+  }
+}
+
+// Splits an integer key into its upper and lower 32 bits, which are both exact
+// in a double. Signed keys are mapped to unsigned ones that have the same
+// order, so that the offset of a key from a base key is (hi - base_hi) * 2^32 +
+// (lo - base_lo).
+template <class T>
+inline void split_key(const T &key, double &hi, double &lo) {
+  typedef std::make_unsigned_t<T> U;
+  U bits = static_cast<U>(key);
+  if constexpr (std::is_signed<T>::value) {
+    bits ^= U(1) << (sizeof(U) * CHAR_BIT - 1);
+  }
+  hi = static_cast<double>(bits >> 32);
+  lo = static_cast<double>(bits & 0xffffffffu);
+}
+
+// Extracts the key of a record that is a numerical key itself
+struct identity_key {
+  template <class T>
+  const T &operator()(const T &key) const {
+    return key;
+  }
+};
+
+// Sorts the records in [begin, end) by the keys that key_of extracts
+template <class RandomIt, class KeyOf = identity_key>
+void insertion_sort(RandomIt begin, RandomIt end,
+                    const KeyOf &key_of = KeyOf()) {
   // Determine the data type
-  typedef typename iterator_traits<RandomIt>::value_type T;
+  typedef typename std::iterator_traits<RandomIt>::value_type T;
 
   // Determine the input size
   const size_t input_sz = std::distance(begin, end);
@@ -22,15 +79,323 @@ void insertion_sort(RandomIt begin, RandomIt end) {
   RandomIt cmp_idx;
   T key;
   for (auto i = begin + 1; i != end; ++i) {
-    key = i[0];
+    key = std::move(i[0]);
     cmp_idx = i - 1;
-    while (cmp_idx >= begin && cmp_idx[0] > key) {
-      cmp_idx[1] = cmp_idx[0];
+    while (cmp_idx >= begin && key_of(cmp_idx[0]) > key_of(key)) {
+      cmp_idx[1] = std::move(cmp_idx[0]);
       --cmp_idx;
     }
-    cmp_idx[1] = key;
+    cmp_idx[1] = std::move(key);
+  }
+}
+
+// Sorts the records in [begin, end) by insertion, as long as every record moves
+// fewer than max_displacement positions and at most max_moves moves are made
+// in total. Returns false when the sort is abandoned, in which case the records
+// are a permutation of the input that is not necessarily sorted. The number of
+// moves that were made is written to num_moves_out when it is given.
+template <class RandomIt, class KeyOf = identity_key>
+bool bounded_insertion_sort(RandomIt begin, RandomIt end, long max_displacement,
+                            long max_moves, const KeyOf &key_of = KeyOf(),
+                            long *num_moves_out = nullptr) {
+  // Determine the data type
+  typedef typename std::iterator_traits<RandomIt>::value_type T;
+
+  long num_moves = 0;
+  if (end - begin <= 1) {
+    if (num_moves_out) *num_moves_out = num_moves;
+    return true;
   }
+
+  for (auto i = begin + 1; i != end; ++i) {
+    // Skip the records that are already in place
+    if (!(key_of(i[-1]) > key_of(i[0]))) continue;
+
+    // Shift the larger records to the right until the hole reaches the
+    // position of the current record, or until it has moved too far
+    T key = std::move(i[0]);
+    auto hole = i;
+    long displacement = 0;
+    do {
+      hole[0] = std::move(hole[-1]);
+      --hole;
+    } while (++displacement < max_displacement && hole != begin &&
+             key_of(hole[-1]) > key_of(key));
+    hole[0] = std::move(key);
+
+    num_moves += displacement;
+    if (displacement >= max_displacement || num_moves > max_moves) {
+      if (num_moves_out) *num_moves_out = num_moves;
+      return false;
+    }
+  }
+
+  if (num_moves_out) *num_moves_out = num_moves;
+  return true;
+}
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+
+// Compares the keys in [0, n) to keys[0] a block of vectors at a time, and
+// returns false as soon as a block holds a different key. Otherwise, returns
+// true and writes to num_checked the number of leading keys that were compared,
+// which leaves fewer keys than a block to the caller. The floating-point keys
+// are compared as numbers, so that a NaN is different from every key and the
+// zeros of either sign are equal, and the integers are compared bitwise.
+template <class T>
+inline bool leading_keys_equal(const T *keys, long n, long &num_checked) {
+#if defined(__AVX512F__)
+  constexpr long VECTOR_WIDTH = 64 / sizeof(T);
+#else
+  constexpr long VECTOR_WIDTH = 32 / sizeof(T);
+#endif
+  // The vectors that are compared before checking for a different key
+  constexpr long BLOCK_SZ = 4 * VECTOR_WIDTH;
+
+  long i = 0;
+  if constexpr (std::is_same<T, double>::value) {
+#if defined(__AVX512F__)
+    const __m512d first = _mm512_set1_pd(keys[0]);
+    for (; i + BLOCK_SZ <= n; i += BLOCK_SZ) {
+      const __mmask8 eq =
+          _mm512_cmp_pd_mask(first, _mm512_loadu_pd(keys + i), _CMP_EQ_OQ) &
+          _mm512_cmp_pd_mask(first, _mm512_loadu_pd(keys + i + 8),
+                             _CMP_EQ_OQ) &
+          _mm512_cmp_pd_mask(first, _mm512_loadu_pd(keys + i + 16),
+                             _CMP_EQ_OQ) &
+          _mm512_cmp_pd_mask(first, _mm512_loadu_pd(keys + i + 24),
+                             _CMP_EQ_OQ);
+      if (eq != 0xff) return false;
+    }
+#else
+    const __m256d first = _mm256_set1_pd(keys[0]);
+    for (; i + BLOCK_SZ <= n; i += BLOCK_SZ) {
+      const __m256d eq = _mm256_and_pd(
+          _mm256_and_pd(
+              _mm256_cmp_pd(first, _mm256_loadu_pd(keys + i), _CMP_EQ_OQ),
+              _mm256_cmp_pd(first, _mm256_loadu_pd(keys + i + 4), _CMP_EQ_OQ)),
+          _mm256_and_pd(
+              _mm256_cmp_pd(first, _mm256_loadu_pd(keys + i + 8), _CMP_EQ_OQ),
+              _mm256_cmp_pd(first, _mm256_loadu_pd(keys + i + 12),
+                            _CMP_EQ_OQ)));
+      if (_mm256_movemask_pd(eq) != 0xf) return false;
+    }
+#endif
+  } else if constexpr (std::is_same<T, float>::value) {
+#if defined(__AVX512F__)
+    const __m512 first = _mm512_set1_ps(keys[0]);
+    for (; i + BLOCK_SZ <= n; i += BLOCK_SZ) {
+      const __mmask16 eq =
+          _mm512_cmp_ps_mask(first, _mm512_loadu_ps(keys + i), _CMP_EQ_OQ) &
+          _mm512_cmp_ps_mask(first, _mm512_loadu_ps(keys + i + 16),
+                             _CMP_EQ_OQ) &
+          _mm512_cmp_ps_mask(first, _mm512_loadu_ps(keys + i + 32),
+                             _CMP_EQ_OQ) &
+          _mm512_cmp_ps_mask(first, _mm512_loadu_ps(keys + i + 48),
+                             _CMP_EQ_OQ);
+      if (eq != 0xffff) return false;
+    }
+#else
+    const __m256 first = _mm256_set1_ps(keys[0]);
+    for (; i + BLOCK_SZ <= n; i += BLOCK_SZ) {
+      const __m256 eq = _mm256_and_ps(
+          _mm256_and_ps(
+              _mm256_cmp_ps(first, _mm256_loadu_ps(keys + i), _CMP_EQ_OQ),
+              _mm256_cmp_ps(first, _mm256_loadu_ps(keys + i + 8), _CMP_EQ_OQ)),
+          _mm256_and_ps(
+              _mm256_cmp_ps(first, _mm256_loadu_ps(keys + i + 16), _CMP_EQ_OQ),
+              _mm256_cmp_ps(first, _mm256_loadu_ps(keys + i + 24),
+                            _CMP_EQ_OQ)));
+      if (_mm256_movemask_ps(eq) != 0xff) return false;
+    }
+#endif
+  } else {
+    // The integers are equal when all their 64-bit words are, so the first key
+    // is broadcast to a vector at its own width and compared word by word
+    typedef std::make_unsigned_t<T> U;
+    const U key = static_cast<U>(keys[0]);
+#if defined(__AVX512F__)
+    const __m512i first =
+        sizeof(T) == 8   ? _mm512_set1_epi64(key)
+        : sizeof(T) == 4 ? _mm512_set1_epi32(key)
+        : sizeof(T) == 2 ? _mm512_set1_epi16(key)
+                         : _mm512_set1_epi8(key);
+    auto load = [&](long j) { return _mm512_loadu_si512(keys + j); };
+    for (; i + BLOCK_SZ <= n; i += BLOCK_SZ) {
+      const __mmask8 eq =
+          _mm512_cmpeq_epi64_mask(first, load(i)) &
+          _mm512_cmpeq_epi64_mask(first, load(i + VECTOR_WIDTH)) &
+          _mm512_cmpeq_epi64_mask(first, load(i + 2 * VECTOR_WIDTH)) &
+          _mm512_cmpeq_epi64_mask(first, load(i + 3 * VECTOR_WIDTH));
+      if (eq != 0xff) return false;
+    }
+#else
+    const __m256i first =
+        sizeof(T) == 8   ? _mm256_set1_epi64x(key)
+        : sizeof(T) == 4 ? _mm256_set1_epi32(key)
+        : sizeof(T) == 2 ? _mm256_set1_epi16(key)
+                         : _mm256_set1_epi8(key);
+    auto load = [&](long j) {
+      return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + j));
+    };
+    for (; i + BLOCK_SZ <= n; i += BLOCK_SZ) {
+      const __m256i eq = _mm256_and_si256(
+          _mm256_and_si256(_mm256_cmpeq_epi64(first, load(i)),
+                           _mm256_cmpeq_epi64(first, load(i + VECTOR_WIDTH))),
+          _mm256_and_si256(
+              _mm256_cmpeq_epi64(first, load(i + 2 * VECTOR_WIDTH)),
+              _mm256_cmpeq_epi64(first, load(i + 3 * VECTOR_WIDTH))));
+      if (_mm256_movemask_epi8(eq) != -1) return false;
+    }
+#endif
+  }
+  num_checked = i;
+  return true;
+}
+
+#endif
+
+// Whether the keys of the n records from begin are all equal. When the records
+// are contiguous numerical keys, they are compared to the first key with
+// vector instructions if AVX2 or AVX-512 is available.
+template <class RandomIt, class KeyOf = identity_key>
+bool all_keys_equal(RandomIt begin, long n, const KeyOf &key_of = KeyOf()) {
+  // Determine the data type
+  typedef typename std::iterator_traits<RandomIt>::value_type T;
+
+  if (n <= 1) return true;
+
+  long elm_idx = 1;
+#if defined(__AVX2__) || defined(__AVX512F__)
+  if constexpr (std::is_same<KeyOf, identity_key>::value &&
+                std::contiguous_iterator<RandomIt> &&
+                ((std::is_integral<T>::value && sizeof(T) <= 8) ||
+                 std::is_same<T, float>::value ||
+                 std::is_same<T, double>::value)) {
+    long num_checked = 0;
+    if (!leading_keys_equal(std::to_address(begin), n, num_checked)) {
+      return false;
+    }
+    elm_idx = std::max(num_checked, 1L);
+  }
+#endif
+
+  // Compare the remaining keys one by one
+  for (; elm_idx < n; ++elm_idx) {
+    if (key_of(begin[elm_idx]) != key_of(begin[0])) return false;
+  }
+  return true;
+}
+
+// Scrambles the bits of x with the finalizer of splitmix64, which gives
+// pseudo-random numbers that are reproducible and need no shared state
+inline unsigned long mix_bits(unsigned long x) {
+  x += 0x9e3779b97f4a7c15UL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+  return x ^ (x >> 31);
+}
+
+// Runs fn(thread_idx) for each thread_idx in [0, num_threads), using the
+// calling thread as the first worker, and waits for all of them to finish
+template <class Fn>
+void run_in_parallel(long num_threads, Fn &&fn) {
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads - 1);
+  for (long thread_idx = 1; thread_idx < num_threads; ++thread_idx) {
+    workers.emplace_back(fn, thread_idx);
+  }
+  fn(0);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+// Sorts a vector with num_threads threads by parallel sorting by regular
+// sampling. The threads sort equal chunks of the keys, and regularly spaced
+// keys of the sorted chunks give the splitters of num_threads ranges of keys.
+// Each thread then gathers the parts of the chunks that fall in its range and
+// merges them pairwise, so that no two threads write to the same keys.
+template <class T>
+void parallel_sort(std::vector<T> &keys, long num_threads) {
+  const long n = keys.size();
+  if (num_threads <= 1 || n < num_threads * num_threads) {
+    std::sort(keys.begin(), keys.end());
+    return;
+  }
+
+  // Sort the chunks
+  auto chunk_begin = [&](long chunk_idx) {
+    return chunk_idx * n / num_threads;
+  };
+  run_in_parallel(num_threads, [&](long thread_idx) {
+    std::sort(keys.begin() + chunk_begin(thread_idx),
+              keys.begin() + chunk_begin(thread_idx + 1));
+  });
+
+  // Pick the splitters among num_threads regularly spaced keys of each chunk
+  std::vector<T> samples;
+  samples.reserve(num_threads * num_threads);
+  for (long chunk_idx = 0; chunk_idx < num_threads; ++chunk_idx) {
+    const long chunk_sz = chunk_begin(chunk_idx + 1) - chunk_begin(chunk_idx);
+    for (long i = 0; i < num_threads; ++i) {
+      samples.push_back(
+          keys[chunk_begin(chunk_idx) + i * chunk_sz / num_threads]);
+    }
+  }
+  std::sort(samples.begin(), samples.end());
+
+  // Find where each range starts in each chunk, where range r holds the keys in
+  // [samples[r * num_threads], samples[(r + 1) * num_threads])
+  std::vector<long> part_begin(num_threads * (num_threads + 1));
+  auto part = [&](long chunk_idx, long range_idx) -> long & {
+    return part_begin[chunk_idx * (num_threads + 1) + range_idx];
+  };
+  run_in_parallel(num_threads, [&](long chunk_idx) {
+    auto first = keys.begin() + chunk_begin(chunk_idx);
+    auto last = keys.begin() + chunk_begin(chunk_idx + 1);
+    part(chunk_idx, 0) = chunk_begin(chunk_idx);
+    for (long range_idx = 1; range_idx < num_threads; ++range_idx) {
+      first = std::lower_bound(first, last, samples[range_idx * num_threads]);
+      part(chunk_idx, range_idx) = first - keys.begin();
+    }
+    part(chunk_idx, num_threads) = chunk_begin(chunk_idx + 1);
+  });
+
+  // Each range starts after the parts of the ranges before it
+  std::vector<long> range_begin(num_threads + 1, 0);
+  for (long range_idx = 0; range_idx < num_threads; ++range_idx) {
+    range_begin[range_idx + 1] = range_begin[range_idx];
+    for (long chunk_idx = 0; chunk_idx < num_threads; ++chunk_idx) {
+      range_begin[range_idx + 1] +=
+          part(chunk_idx, range_idx + 1) - part(chunk_idx, range_idx);
+    }
+  }
+
+  // Merge the parts of each range
+  std::vector<T> sorted(n);
+  run_in_parallel(num_threads, [&](long range_idx) {
+    std::vector<long> runs{range_begin[range_idx]};
+    for (long chunk_idx = 0; chunk_idx < num_threads; ++chunk_idx) {
+      runs.push_back(std::copy(keys.begin() + part(chunk_idx, range_idx),
+                               keys.begin() + part(chunk_idx, range_idx + 1),
+                               sorted.begin() + runs.back()) -
+                     sorted.begin());
+    }
+    while (runs.size() > 2) {
+      std::vector<long> merged_runs{runs[0]};
+      for (size_t i = 2; i < runs.size(); i += 2) {
+        std::inplace_merge(sorted.begin() + runs[i - 2],
+                           sorted.begin() + runs[i - 1],
+                           sorted.begin() + runs[i]);
+        merged_runs.push_back(runs[i]);
+      }
+      if (runs.size() % 2 == 0) merged_runs.push_back(runs.back());
+      runs.swap(merged_runs);
+    }
+  });
+  keys.swap(sorted);
 }
 
 }  // namespace utils
-}  // namespace learned_sort
\ No newline at end of file
+}  // namespace learned_sort
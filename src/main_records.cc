@@ -0,0 +1,231 @@
+/**
+ * @brief Driver file for the performance benchmarks on records that carry a
+ * payload next to their key
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+
+#include "ips4o.hpp"
+#include "learned_sort.h"
+#include "utils.h"
+
+using namespace std;
+
+// NOTE: You may change the key type here
+typedef double data_t;
+
+// NOTE: You may change the distribution here.
+// For a list of supported distributions see src/utils.h
+distr_t DATA_DISTR = NORMAL;
+
+// NOTE: You may change the input size here
+constexpr size_t INPUT_SZ = 50'000'000;
+
+constexpr size_t REP_LARGE_INPUTS = 5;
+constexpr size_t REP_SMALL_INPUTS = 10;
+
+static void benchmark_arguments(benchmark::internal::Benchmark *b) {
+  b->Arg(INPUT_SZ);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Returns the key of a record
+struct key_of_record {
+  template <class R>
+  data_t operator()(const R &r) const {
+    return r.key;
+  }
+};
+
+// Compares two records by their keys
+struct record_less {
+  template <class R>
+  bool operator()(const R &a, const R &b) const {
+    return a.key < b.key;
+  }
+};
+
+template <class Record>
+class RecordBenchmarks : public benchmark::Fixture {
+ public:
+  RecordBenchmarks() {
+    if (INPUT_SZ < 1e8)
+      Repetitions(REP_SMALL_INPUTS);
+    else
+      Repetitions(REP_LARGE_INPUTS);
+  }
+
+ protected:
+  void SetUp(const ::benchmark::State &state) {
+    // Generate the synthetic keys and wrap them into records
+    size_t size = state.range(0);
+    arr =
+        make_records<sizeof(Record)>(generate_data<data_t>(DATA_DISTR, size));
+
+    // Calculate the checksum
+    cksm = get_checksum(arr);
+  }
+
+  void TearDown(const ::benchmark::State &state) {
+    // Verify that the array's checksum is correct
+    if (get_checksum(arr) != cksm) {
+      cerr << "Incorrect checksum! Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // Verify that the records are sorted
+    for (size_t i = 1; i < arr.size(); i++) {
+      if (arr[i].key < arr[i - 1].key) {
+        cout << "Unsorted records in position " << i << ": ..."
+             << arr[i - 1].key << ", " << arr[i].key << ".\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    // Verify that the payloads were moved with their keys
+    if (!payloads_match_keys(arr)) {
+      cerr << "Payloads were separated from their keys! Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // Cleanup
+    arr.clear();
+  }
+
+  // Input array
+  vector<Record> arr;
+
+  // Checksum
+  long long cksm;
+};
+
+#define RECORD_SORT_BENCHMARK_DEFINE(SortFnName, RecordSz, SortFnCall)      \
+  BENCHMARK_TEMPLATE_DEFINE_F(RecordBenchmarks, SortFnName##_##RecordSz##B, \
+                              record<data_t, RecordSz>)                     \
+  (benchmark::State & state) {                                              \
+    for (auto _ : state) {                                                  \
+      SortFnCall;                                                           \
+    }                                                                       \
+  }                                                                         \
+  BENCHMARK_REGISTER_F(RecordBenchmarks, SortFnName##_##RecordSz##B)        \
+      ->Apply(benchmark_arguments);
+
+// Register the benchmarks for 16-byte records
+RECORD_SORT_BENCHMARK_DEFINE(LearnedSort, 16,
+                             learned_sort::sort(arr.begin(), arr.end(),
+                                                key_of_record()))
+RECORD_SORT_BENCHMARK_DEFINE(LearnedSortParallel, 16,
+                             learned_sort::parallel::sort(arr.begin(),
+                                                          arr.end(),
+                                                          key_of_record()))
+RECORD_SORT_BENCHMARK_DEFINE(IS4o, 16,
+                             ips4o::sort(arr.begin(), arr.end(), record_less()))
+RECORD_SORT_BENCHMARK_DEFINE(StdSort, 16,
+                             std::sort(arr.begin(), arr.end(), record_less()))
+
+// Register the benchmarks for 32-byte records
+RECORD_SORT_BENCHMARK_DEFINE(LearnedSort, 32,
+                             learned_sort::sort(arr.begin(), arr.end(),
+                                                key_of_record()))
+RECORD_SORT_BENCHMARK_DEFINE(LearnedSortParallel, 32,
+                             learned_sort::parallel::sort(arr.begin(),
+                                                          arr.end(),
+                                                          key_of_record()))
+RECORD_SORT_BENCHMARK_DEFINE(IS4o, 32,
+                             ips4o::sort(arr.begin(), arr.end(), record_less()))
+RECORD_SORT_BENCHMARK_DEFINE(StdSort, 32,
+                             std::sort(arr.begin(), arr.end(), record_less()))
+
+// A table with a key column and two payload columns, which is reordered by the
+// permutation that sorts the keys
+class ArgsortBenchmarks : public benchmark::Fixture {
+ public:
+  ArgsortBenchmarks() {
+    if (INPUT_SZ < 1e8)
+      Repetitions(REP_SMALL_INPUTS);
+    else
+      Repetitions(REP_LARGE_INPUTS);
+  }
+
+ protected:
+  void SetUp(const ::benchmark::State &state) {
+    // Generate the synthetic keys, the row ids, and a copy of the keys
+    size_t size = state.range(0);
+    keys = generate_data<data_t>(DATA_DISTR, size);
+    ids.resize(size);
+    std::iota(ids.begin(), ids.end(), 0);
+    key_copies = keys;
+    perm.resize(size);
+  }
+
+  void TearDown(const ::benchmark::State &state) {
+    // Verify that the rows are sorted and that they were kept together
+    for (size_t i = 0; i < keys.size(); i++) {
+      if ((i > 0 && keys[i] < keys[i - 1]) || key_copies[i] != keys[i]) {
+        cout << "Unsorted or broken rows in position " << i << ".\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    // Cleanup
+    keys.clear();
+    ids.clear();
+    key_copies.clear();
+    perm.clear();
+  }
+
+  // The columns of the table
+  vector<data_t> keys;
+  vector<long> ids;
+  vector<data_t> key_copies;
+
+  // The permutation that sorts the keys
+  vector<uint32_t> perm;
+};
+
+#define ARGSORT_BENCHMARK_DEFINE(SortFnName, ArgsortFnCall)               \
+  BENCHMARK_DEFINE_F(ArgsortBenchmarks, SortFnName)                       \
+  (benchmark::State & state) {                                            \
+    for (auto _ : state) {                                                \
+      ArgsortFnCall;                                                      \
+      learned_sort::apply_permutation(perm.begin(), perm.end(), keys, ids, \
+                                      key_copies);                        \
+    }                                                                     \
+  }                                                                       \
+  BENCHMARK_REGISTER_F(ArgsortBenchmarks, SortFnName)                     \
+      ->Apply(benchmark_arguments);
+
+// Compares the keys at two positions of the table
+#define INDIRECT_LESS \
+  [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; }
+
+// Register the benchmarks for computing and applying the permutation
+ARGSORT_BENCHMARK_DEFINE(LearnedArgsort,
+                         learned_sort::argsort(keys.begin(), keys.end(),
+                                               perm.begin()))
+ARGSORT_BENCHMARK_DEFINE(IS4oIndirect,
+                         std::iota(perm.begin(), perm.end(), 0);
+                         ips4o::sort(perm.begin(), perm.end(), INDIRECT_LESS))
+ARGSORT_BENCHMARK_DEFINE(StdSortIndirect,
+                         std::iota(perm.begin(), perm.end(), 0);
+                         std::sort(perm.begin(), perm.end(), INDIRECT_LESS))
+
+// Run the benchmark
+BENCHMARK_MAIN();
@@ -25,6 +25,7 @@
 #include "ips4o.hpp"
 #include "pdqsort.h"
 #include "learned_sort.h"
+#include "perf_counters.h"
 #include "radix_sort.h"
 #include "ska_sort.hpp"
 #include "utils.h"
@@ -99,12 +100,18 @@ class Benchmarks : public benchmark::Fixture {
   long long cksm;
 };
 
+// Each benchmark also reports the hardware performance counters of the sorts
+// (see perf_counters.h), averaged over its iterations
 #define SORT_BENCHMARK_DEFINE(SortFnName, SortFnCall) \
   BENCHMARK_DEFINE_F(Benchmarks, SortFnName)          \
   (benchmark::State & state) {                        \
+    perf_counters counters;                           \
     for (auto _ : state) {                            \
+      counters.start();                               \
       SortFnCall;                                     \
+      counters.stop();                                \
     }                                                 \
+    counters.report(state);                           \
   }                                                   \
   BENCHMARK_REGISTER_F(Benchmarks, SortFnName)->Apply(benchmark_arguments);
 
@@ -112,6 +119,8 @@ class Benchmarks : public benchmark::Fixture {
 SORT_BENCHMARK_DEFINE(LearnedSort,
                       learned_sort::sort(arr.begin(),
                       arr.end()))
+SORT_BENCHMARK_DEFINE(LearnedSortParallel,
+                      learned_sort::parallel::sort(arr.begin(), arr.end()))
 SORT_BENCHMARK_DEFINE(RadixSort, radix_sort(arr.begin(), arr.end()))
 SORT_BENCHMARK_DEFINE(IS4o, ips4o::sort(arr.begin(), arr.end()))
 SORT_BENCHMARK_DEFINE(StdSort, std::sort(arr.begin(), arr.end()))
@@ -121,5 +130,36 @@ SORT_BENCHMARK_DEFINE(SkaSort, ska_sort(arr.begin(), arr.end()))
 SORT_BENCHMARK_DEFINE(Timsort, gfx::timsort(arr.begin(), arr.end()))
 SORT_BENCHMARK_DEFINE(PDQS, pdqsort(arr.begin(), arr.end()))
 
+#ifdef LEARNED_SORT_STATS
+static bool stats_displayed = false;
+
+// Sorts with Learned Sort while collecting the timings and the counters of its
+// phases, which are reported as counters and printed for the first repetition
+BENCHMARK_DEFINE_F(Benchmarks, LearnedSortStats)(benchmark::State &state) {
+  learned_sort::sort_stats stats;
+  for (auto _ : state) {
+    learned_sort::collect_stats collect(stats);
+    learned_sort::sort(arr.begin(), arr.end());
+  }
+
+  for (int phase = 0; phase < learned_sort::sort_stats::NUM_PHASES; ++phase) {
+    state.counters[string(learned_sort::sort_stats::phase_name(phase)) +
+                   "_ms"] = stats.phase_ms[phase];
+  }
+  state.counters["homogeneous_skipped"] = stats.homogeneous_buckets_skipped;
+  state.counters["fragments_swapped"] = stats.fragments_swapped;
+  state.counters["touch_up_moves"] = stats.touch_up_moves;
+
+  if (!stats_displayed) {
+    cout << "LearnedSort statistics:" << endl;
+    stats.print(cout);
+    stats_displayed = true;
+  }
+}
+BENCHMARK_REGISTER_F(Benchmarks, LearnedSortStats)
+    ->Apply(benchmark_arguments)
+    ->Iterations(1);
+#endif
+
 // Run the benchmark
 BENCHMARK_MAIN();
@@ -0,0 +1,611 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ * @brief Driver file for the benchmarks that measure the effect of the
+ * individual optimizations and hyperparameters of LearnedSort
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <malloc.h>
+#include <new>
+#include <string>
+
+#include "learned_sort.h"
+#include "utils.h"
+
+using namespace std;
+
+// NOTE: You may change the data type here
+typedef double data_t;
+
+// NOTE: You may change the input size here
+constexpr size_t INPUT_SZ = 50'000'000;
+
+constexpr size_t REP_LARGE_INPUTS = 5;
+constexpr size_t REP_SMALL_INPUTS = 10;
+
+// The distributions on which the optimizations are measured
+static const distr_t TUNING_DISTRS[] = {NORMAL, UNIFORM};
+
+// Counts the calls to the global allocation functions and tracks the allocated
+// memory, so that the benchmarks can report the allocator traffic and the peak
+// memory of the sorting algorithms
+static std::atomic<long> num_allocs{0};
+static std::atomic<long> live_bytes{0};
+static std::atomic<long> peak_bytes{0};
+
+void *operator new(size_t sz) {
+  ++num_allocs;
+  if (void *ptr = std::malloc(sz ? sz : 1)) {
+    long live = live_bytes += malloc_usable_size(ptr);
+    long peak = peak_bytes;
+    while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+    }
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t sz) { return ::operator new(sz); }
+
+void operator delete(void *ptr) noexcept {
+  live_bytes -= malloc_usable_size(ptr);
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept { ::operator delete(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { ::operator delete(ptr); }
+
+void operator delete[](void *ptr, size_t) noexcept { ::operator delete(ptr); }
+
+class TuningBenchmarks : public benchmark::Fixture {
+ public:
+  TuningBenchmarks() {
+    if (INPUT_SZ < 1e8)
+      Repetitions(REP_SMALL_INPUTS);
+    else
+      Repetitions(REP_LARGE_INPUTS);
+  }
+
+ protected:
+  // The first argument of each benchmark is the input size and the second one
+  // is the data distribution
+  void SetUp(const ::benchmark::State &state) {
+    // Generate the synthetic data
+    size_t size = state.range(0);
+    arr = generate_data<data_t>(static_cast<distr_t>(state.range(1)), size);
+
+    // Calculate the checksum
+    cksm = get_checksum(arr);
+  }
+
+  void TearDown(const ::benchmark::State &state) {
+    // Verify that the array's checksum is correct
+    if (get_checksum(arr) != cksm) {
+      cerr << "Incorrect checksum! Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // Verify that the array is sorted
+    if (!std::is_sorted(arr.begin(), arr.end())) {
+      cerr << "The array is not sorted! Exiting." << endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // Cleanup
+    arr.clear();
+  }
+
+  // Input array
+  vector<data_t> arr;
+
+  // Checksum
+  long long cksm;
+};
+
+//----------------------------------------------------------//
+//           BATCHED PREDICTION IN THE PARTITIONING         //
+//----------------------------------------------------------//
+
+// Sorts with different batch sizes for the primary partitioning. A batch size
+// of 1 interleaves the prediction of each key with its placement.
+static void batch_sz_arguments(benchmark::internal::Benchmark *b) {
+  for (auto distr : TUNING_DISTRS) {
+    for (long batch_sz : {1, 16, 64, 256, 1024, 4096}) {
+      b->Args({INPUT_SZ, distr, batch_sz});
+    }
+  }
+  b->ArgNames({"n", "distr", "batch_sz"});
+  b->Iterations(1);
+  b->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK_DEFINE_F(TuningBenchmarks, BatchSize)(benchmark::State &state) {
+  learned_sort::TwoLayerRMI<data_t>::Params p;
+  p.batch_sz = state.range(2);
+  for (auto _ : state) {
+    learned_sort::sort(arr.begin(), arr.end(), p);
+  }
+}
+BENCHMARK_REGISTER_F(TuningBenchmarks, BatchSize)->Apply(batch_sz_arguments);
+
+//----------------------------------------------------------//
+//                    ALLOCATOR TRAFFIC                     //
+//----------------------------------------------------------//
+
+static void alloc_arguments(benchmark::internal::Benchmark *b) {
+  for (auto distr : TUNING_DISTRS) {
+    b->Args({INPUT_SZ, distr});
+  }
+  b->ArgNames({"n", "distr"});
+  b->Iterations(1);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Reports the number of allocations made by one sort
+BENCHMARK_DEFINE_F(TuningBenchmarks, Allocations)(benchmark::State &state) {
+  long allocs_before = num_allocs;
+  for (auto _ : state) {
+    learned_sort::sort(arr.begin(), arr.end());
+  }
+  state.counters["allocs"] = num_allocs - allocs_before;
+}
+BENCHMARK_REGISTER_F(TuningBenchmarks, Allocations)->Apply(alloc_arguments);
+
+//----------------------------------------------------------//
+//            IN-PLACE AND OUT-OF-PLACE PARTITIONING        //
+//----------------------------------------------------------//
+
+// The third argument selects the out-of-place partitioning, and the fourth one
+// is its overallocation in percent
+static void placement_arguments(benchmark::internal::Benchmark *b) {
+  for (auto distr : TUNING_DISTRS) {
+    b->Args({INPUT_SZ, distr, 0, 0});
+    for (long overallocation_pct : {100, 110, 125, 150}) {
+      b->Args({INPUT_SZ, distr, 1, overallocation_pct});
+    }
+  }
+  b->ArgNames({"n", "distr", "out_of_place", "overallocation_pct"});
+  b->Iterations(1);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Reports the peak memory that one sort allocates besides the input
+BENCHMARK_DEFINE_F(TuningBenchmarks, Placement)(benchmark::State &state) {
+  learned_sort::TwoLayerRMI<data_t>::Params p;
+  p.out_of_place = state.range(2);
+  if (p.out_of_place) p.overallocation = state.range(3) / 100.;
+
+  peak_bytes = live_bytes.load();
+  long bytes_before = live_bytes;
+  for (auto _ : state) {
+    learned_sort::sort(arr.begin(), arr.end(), p);
+  }
+  state.counters["peak_extra_MB"] = (peak_bytes - bytes_before) / 1e6;
+}
+BENCHMARK_REGISTER_F(TuningBenchmarks, Placement)->Apply(placement_arguments);
+
+//----------------------------------------------------------//
+//                REPEATED SORTS OF MEDIUM INPUTS           //
+//----------------------------------------------------------//
+
+static void repeated_sorts_arguments(benchmark::internal::Benchmark *b) {
+  for (auto distr : TUNING_DISTRS) {
+    for (long n : {1'000'000, 5'000'000, 20'000'000}) {
+      b->Args({n, distr});
+    }
+  }
+  b->ArgNames({"n", "distr"});
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Sorts the same input repeatedly, restoring it before each sort. The restoring
+// is not timed, and the allocations are reported per sort.
+template <class SortFn>
+static void repeated_sorts(benchmark::State &state, vector<data_t> &arr,
+                           SortFn sort_fn) {
+  const vector<data_t> input = arr;
+  long allocs_before = num_allocs;
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::copy(input.begin(), input.end(), arr.begin());
+    state.ResumeTiming();
+    sort_fn();
+  }
+  state.counters["allocs"] = benchmark::Counter(
+      num_allocs - allocs_before, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK_DEFINE_F(TuningBenchmarks, RepeatedFreeFunction)
+(benchmark::State &state) {
+  repeated_sorts(state, arr,
+                 [&] { learned_sort::sort(arr.begin(), arr.end()); });
+}
+BENCHMARK_REGISTER_F(TuningBenchmarks, RepeatedFreeFunction)
+    ->Apply(repeated_sorts_arguments);
+
+BENCHMARK_DEFINE_F(TuningBenchmarks, RepeatedLearnedSorter)
+(benchmark::State &state) {
+  learned_sort::LearnedSorter<data_t> sorter;
+  repeated_sorts(state, arr, [&] { sorter.sort(arr.begin(), arr.end()); });
+}
+BENCHMARK_REGISTER_F(TuningBenchmarks, RepeatedLearnedSorter)
+    ->Apply(repeated_sorts_arguments);
+
+//----------------------------------------------------------//
+//          FANOUTS AND FRAGMENT CAPACITIES PER KEY SIZE    //
+//----------------------------------------------------------//
+
+static void config_arguments(benchmark::internal::Benchmark *b) {
+  for (auto distr : TUNING_DISTRS) {
+    for (long n : {1'000'000, 5'000'000, 20'000'000}) {
+      b->Args({n, distr});
+    }
+  }
+  b->ArgNames({"n", "distr"});
+  b->Iterations(1);
+  b->Repetitions(REP_SMALL_INPUTS);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Trains a model and sorts with the given fanouts and fragment capacities, on
+// keys of the given type
+template <class Key, class Config>
+static void PartitioningConfig(benchmark::State &state) {
+  auto arr = generate_data<Key>(static_cast<distr_t>(state.range(1)),
+                                state.range(0));
+  for (auto _ : state) {
+    typename learned_sort::TwoLayerRMI<Key>::Params p;
+    learned_sort::TwoLayerRMI<Key> rmi(p);
+    if (!rmi.train(arr.begin(), arr.end())) {
+      state.SkipWithError("The model could not be trained");
+      break;
+    }
+    learned_sort::internal::sort_scratch<Key, Config> scratch;
+    learned_sort::internal::sort_with_model(arr.begin(), arr.end(), rmi,
+                                            scratch);
+  }
+
+  if (!std::is_sorted(arr.begin(), arr.end())) {
+    cerr << "The array is not sorted! Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+#define CONFIG_BENCHMARK_DEFINE(Key, ...)                               \
+  BENCHMARK_TEMPLATE(PartitioningConfig, Key,                           \
+                     learned_sort::partitioning_config<__VA_ARGS__>)    \
+      ->Apply(config_arguments);
+
+// The original configuration and the ones that were tuned for 4-byte and
+// 8-byte keys (see learned_sort::tuned_configs)
+CONFIG_BENCHMARK_DEFINE(float, 1000, 100, 100, 100)
+CONFIG_BENCHMARK_DEFINE(float, 500, 50, 128, 128)
+CONFIG_BENCHMARK_DEFINE(float, 1000, 50, 256, 128)
+CONFIG_BENCHMARK_DEFINE(float, 1000, 50, 128, 128)
+CONFIG_BENCHMARK_DEFINE(float, 500, 50, 128, 64)
+CONFIG_BENCHMARK_DEFINE(double, 1000, 100, 100, 100)
+CONFIG_BENCHMARK_DEFINE(double, 500, 50, 128, 128)
+CONFIG_BENCHMARK_DEFINE(double, 500, 50, 256, 64)
+CONFIG_BENCHMARK_DEFINE(double, 500, 50, 128, 64)
+CONFIG_BENCHMARK_DEFINE(double, 250, 50, 128, 32)
+
+//----------------------------------------------------------//
+//            CONFIGURATION CHOSEN FOR THE HOST             //
+//----------------------------------------------------------//
+
+static void autotuned_arguments(benchmark::internal::Benchmark *b) {
+  for (auto distr : TUNING_DISTRS) {
+    for (long n : {1'000'000, 5'000'000, 20'000'000, 50'000'000}) {
+      b->Args({n, distr});
+    }
+  }
+  b->ArgNames({"n", "distr"});
+  b->Iterations(1);
+  b->Repetitions(REP_SMALL_INPUTS);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Sorts keys of the given type, and reports the detected cache sizes and the
+// configuration that was chosen for them next to the throughput
+template <class Key>
+static void Autotuned(benchmark::State &state) {
+  const long n = state.range(0);
+  auto arr = generate_data<Key>(static_cast<distr_t>(state.range(1)), n);
+  for (auto _ : state) {
+    learned_sort::sort(arr.begin(), arr.end());
+  }
+
+  if (!std::is_sorted(arr.begin(), arr.end())) {
+    cerr << "The array is not sorted! Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  const auto &caches = learned_sort::utils::get_cache_sizes();
+  state.counters["L1d_KB"] = caches.l1d >> 10;
+  state.counters["L2_KB"] = caches.l2 >> 10;
+  learned_sort::internal::with_tuned_config<Key>(n, [&](auto config) {
+    typedef decltype(config) Config;
+    state.counters["primary_fanout"] = Config::PRIMARY_FANOUT;
+    state.counters["secondary_fanout"] = Config::SECONDARY_FANOUT;
+    state.counters["primary_capacity"] = Config::PRIMARY_FRAGMENT_CAPACITY;
+    state.counters["secondary_capacity"] = Config::SECONDARY_FRAGMENT_CAPACITY;
+  });
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK_TEMPLATE(Autotuned, float)->Apply(autotuned_arguments);
+BENCHMARK_TEMPLATE(Autotuned, double)->Apply(autotuned_arguments);
+
+//----------------------------------------------------------//
+//                   KINDS OF CDF MODELS                    //
+//----------------------------------------------------------//
+
+// The distributions on which the kinds of CDF models are compared, which
+// include multi-modal and skewed ones that a 2-layer RMI fits poorly
+static const distr_t CDF_MODEL_DISTRS[] = {NORMAL,    UNIFORM,     MIX_GAUSS,
+                                           LOGNORMAL, EXPONENTIAL, ZIPF};
+
+static void cdf_model_arguments(benchmark::internal::Benchmark *b) {
+  for (auto distr : CDF_MODEL_DISTRS) {
+    for (auto model_type : {learned_sort::cdf_model_type::TWO_LAYER_RMI,
+                            learned_sort::cdf_model_type::THREE_LAYER_RMI,
+                            learned_sort::cdf_model_type::PIECEWISE_LINEAR,
+                            learned_sort::cdf_model_type::RADIX_SPLINE}) {
+      b->Args({INPUT_SZ, distr, static_cast<long>(model_type)});
+    }
+  }
+  b->ArgNames({"n", "distr", "model"});
+  b->Iterations(1);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Reports the sizes of the primary buckets that the trained model predicts for
+// the input: their variance relative to the square of their mean, and the size
+// of the largest one
+static void report_bucket_sizes(benchmark::State &state,
+                                const vector<data_t> &arr,
+                                const learned_sort::TwoLayerRMI<data_t> &rmi) {
+  learned_sort::internal::flat_model_storage storage;
+  const auto model = learned_sort::internal::flatten_model(rmi, storage);
+  learned_sort::internal::with_tuned_config<data_t>(arr.size(), [&](auto cfg) {
+    constexpr long FANOUT = decltype(cfg)::PRIMARY_FANOUT;
+    const learned_sort::internal::bucket_map map{1. * FANOUT, 0., FANOUT - 1.};
+    vector<long> bucket_sizes(FANOUT, 0);
+    for (const auto &key : arr) {
+      ++bucket_sizes[learned_sort::internal::predict_bucket(model, map, key)];
+    }
+
+    const double mean = 1. * arr.size() / FANOUT;
+    double var = 0;
+    for (auto sz : bucket_sizes) {
+      var += (sz - mean) * (sz - mean) / FANOUT;
+    }
+    state.counters["bucket_sz_rel_var"] = var / (mean * mean);
+    state.counters["max_bucket_sz"] =
+        *std::max_element(bucket_sizes.begin(), bucket_sizes.end());
+  });
+}
+
+// Sorts with each kind of CDF model (see learned_sort::cdf_model_type), and
+// reports the number of leaf models and the balance of the primary buckets
+BENCHMARK_DEFINE_F(TuningBenchmarks, CDFModels)(benchmark::State &state) {
+  learned_sort::TwoLayerRMI<data_t>::Params p;
+  p.model_type = static_cast<learned_sort::cdf_model_type>(state.range(2));
+
+  learned_sort::TwoLayerRMI<data_t> rmi(p);
+  if (!rmi.train(arr.begin(), arr.end())) {
+    state.SkipWithError("The model could not be trained");
+    return;
+  }
+  report_bucket_sizes(state, arr, rmi);
+  state.counters["leaf_models"] = rmi.leaf_models.size();
+
+  for (auto _ : state) {
+    learned_sort::sort(arr.begin(), arr.end(), p);
+  }
+}
+BENCHMARK_REGISTER_F(TuningBenchmarks, CDFModels)->Apply(cdf_model_arguments);
+
+//----------------------------------------------------------//
+//                    SAMPLING OF THE INPUT                 //
+//----------------------------------------------------------//
+
+// The distributions on which the sampling modes are compared, which include
+// periodic ones that alias with the stride of the sample
+static const distr_t SAMPLING_DISTRS[] = {NORMAL, UNIFORM, MODULO, ROOT_DUPS};
+
+static void sampling_arguments(benchmark::internal::Benchmark *b) {
+  for (auto distr : SAMPLING_DISTRS) {
+    for (long block_sz : {1, 8, 64}) {
+      b->Args({INPUT_SZ, distr, block_sz});
+    }
+  }
+  b->ArgNames({"n", "distr", "block"});
+  b->Iterations(1);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Measures the training of the model with runs of the given number of keys in
+// the sample (see TwoLayerRMI::Params::sampling_block_sz), and reports the
+// balance of the primary buckets of the trained model and the time that the
+// sort takes with it
+BENCHMARK_DEFINE_F(TuningBenchmarks, Sampling)(benchmark::State &state) {
+  learned_sort::TwoLayerRMI<data_t>::Params p;
+  p.sampling_block_sz = state.range(2);
+
+  learned_sort::TwoLayerRMI<data_t> rmi(p);
+  bool trained = false;
+  for (auto _ : state) {
+    rmi.reset(p);
+    trained = rmi.train(arr.begin(), arr.end());
+  }
+  if (trained) report_bucket_sizes(state, arr, rmi);
+
+  auto start = chrono::steady_clock::now();
+  learned_sort::sort(arr.begin(), arr.end(), p);
+  state.counters["sort_ms"] =
+      chrono::duration<double, milli>(chrono::steady_clock::now() - start)
+          .count();
+}
+BENCHMARK_REGISTER_F(TuningBenchmarks, Sampling)->Apply(sampling_arguments);
+
+// The distributions on which the progressive sampling is compared with the
+// fixed sampling rate, from smooth ones to spiky ones
+static const distr_t PROGRESSIVE_SAMPLING_DISTRS[] = {
+    NORMAL, UNIFORM, LOGNORMAL, MIX_GAUSS, ZIPF, ROOT_DUPS};
+
+static void progressive_sampling_arguments(
+    benchmark::internal::Benchmark *b) {
+  for (auto distr : PROGRESSIVE_SAMPLING_DISTRS) {
+    for (long progressive : {0, 1}) {
+      b->Args({INPUT_SZ, distr, progressive});
+    }
+  }
+  b->ArgNames({"n", "distr", "progressive"});
+  b->Iterations(1);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Measures the training of the model with a fixed sampling rate and with
+// progressive sampling (see TwoLayerRMI::Params::progressive_sampling), and
+// reports the size of the sample, the balance of the primary buckets of the
+// trained model and the time that the sort takes with it
+BENCHMARK_DEFINE_F(TuningBenchmarks, ProgressiveSampling)
+(benchmark::State &state) {
+  learned_sort::TwoLayerRMI<data_t>::Params p;
+  p.progressive_sampling = state.range(2);
+
+  learned_sort::TwoLayerRMI<data_t> rmi(p);
+  bool trained = false;
+  for (auto _ : state) {
+    rmi.reset(p);
+    trained = rmi.train(arr.begin(), arr.end());
+  }
+  if (trained) report_bucket_sizes(state, arr, rmi);
+  state.counters["sample_sz"] = rmi.training_sample.size();
+
+  auto start = chrono::steady_clock::now();
+  learned_sort::sort(arr.begin(), arr.end(), p);
+  state.counters["sort_ms"] =
+      chrono::duration<double, milli>(chrono::steady_clock::now() - start)
+          .count();
+}
+BENCHMARK_REGISTER_F(TuningBenchmarks, ProgressiveSampling)
+    ->Apply(progressive_sampling_arguments);
+
+//----------------------------------------------------------//
+//           PRECISION OF THE MODEL FOR 64-BIT KEYS         //
+//----------------------------------------------------------//
+
+// Estimates the work of the insertion sort that touches up the output of the
+// model-based counting sort, as the expected number of moves among the keys
+// that are predicted to the same position. The model is evaluated on the
+// offsets of the keys from the bases of its models like in the sorting
+// routines, or on the keys converted to doubles when in_double is set, in which
+// case the keys above 2^53 are rounded together with their neighbors.
+static double touchup_moves(const vector<unsigned long> &keys,
+                            const learned_sort::TwoLayerRMI<unsigned long> &rmi,
+                            bool in_double) {
+  const long n = keys.size();
+  const long num_leaf_models = rmi.hp.num_leaf_models;
+  double root_intercept = rmi.root_model.intercept;
+  vector<double> slopes(num_leaf_models), intercepts(num_leaf_models);
+  vector<double> base_hi(num_leaf_models), base_lo(num_leaf_models);
+  double root_base_hi, root_base_lo;
+  learned_sort::internal::split_bases(rmi, root_base_hi, root_base_lo,
+                                      base_hi.data(), base_lo.data());
+  for (long i = 0; i < num_leaf_models; ++i) {
+    slopes[i] = rmi.leaf_models[i].slope;
+    intercepts[i] = rmi.leaf_models[i].intercept;
+  }
+
+  // Move the bases of the models into their intercepts
+  if (in_double) {
+    root_intercept -= rmi.root_model.slope * rmi.root_base;
+    for (long i = 0; i < num_leaf_models; ++i) {
+      intercepts[i] -= slopes[i] * rmi.leaf_bases[i];
+    }
+  }
+
+  const learned_sort::internal::flat_rmi model{
+      rmi.root_model.slope, root_intercept, num_leaf_models,
+      slopes.data(),        intercepts.data(), root_base_hi,
+      root_base_lo,         base_hi.data(),    base_lo.data()};
+  const learned_sort::internal::bucket_map map{1. * n, 0., n - 1.};
+
+  // Count the keys that are predicted to each position
+  vector<unsigned> cnt(n, 0);
+  for (const auto &key : keys) {
+    ++cnt[in_double ? learned_sort::internal::predict_bucket(
+                          model, map, static_cast<double>(key))
+                    : learned_sort::internal::predict_bucket(model, map, key)];
+  }
+
+  double moves = 0;
+  for (auto c : cnt) {
+    moves += c * (c - 1.) / 4;
+  }
+  return moves;
+}
+
+// Sorts a real dataset of 64-bit keys (see the `data/` directory), and reports
+// the touch-up work when the model is evaluated on doubles and on offsets
+static void TouchUp(benchmark::State &state, const string &dataset) {
+  // Read the input file
+  std::ifstream ifs("data/" + dataset + ".txt");
+  std::istream_iterator<unsigned long> start(ifs), end;
+  vector<unsigned long> keys(start, end);
+  if (keys.empty()) {
+    state.SkipWithError(("Cannot read data/" + dataset + ".txt").c_str());
+    return;
+  }
+
+  vector<unsigned long> arr;
+  for (auto _ : state) {
+    state.PauseTiming();
+    arr = keys;
+    state.ResumeTiming();
+    learned_sort::sort(arr.begin(), arr.end());
+  }
+
+  if (!std::is_sorted(arr.begin(), arr.end())) {
+    cerr << "The array is not sorted! Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  learned_sort::TwoLayerRMI<unsigned long>::Params p;
+  learned_sort::TwoLayerRMI<unsigned long> rmi(p);
+  if (rmi.train(keys.begin(), keys.end())) {
+    state.counters["touchup_moves_double"] = touchup_moves(keys, rmi, true);
+    state.counters["touchup_moves_offsets"] = touchup_moves(keys, rmi, false);
+  }
+}
+BENCHMARK_CAPTURE(TouchUp, OSM, string("OSM/Cell_IDs"))
+    ->Iterations(REP_LARGE_INPUTS)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(TouchUp, FB, string("FB/IDs"))
+    ->Iterations(REP_LARGE_INPUTS)
+    ->Unit(benchmark::kMillisecond);
+
+// Run the benchmark
+BENCHMARK_MAIN();
@@ -0,0 +1,147 @@
+#pragma once
+
+/**
+ * @file perf_counters.h
+ * @brief Hardware performance counters of the benchmarks, which are read
+ * through perf_event_open and reported as benchmark counters.
+ */
+
+#include <benchmark/benchmark.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A hardware event that the benchmarks count, and the name of its counter
+struct perf_event_spec {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+// The events that tell whether a sort is bound by the memory or by the CPU
+static const perf_event_spec PERF_EVENTS[] = {
+    {"LLC_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB_misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}};
+
+/**
+ * @brief Counts the events of PERF_EVENTS in the user space of the calling
+ * thread, and of the threads that it spawns and joins while counting, such as
+ * the workers of the parallel sorts.
+ *
+ * Each event is counted on its own, so that the events that the host does not
+ * support (e.g., in virtual machines, or when perf_event_paranoid forbids it)
+ * are left out without losing the others. The counts are scaled up when the
+ * kernel multiplexes more events than the hardware has counters for.
+ */
+class perf_counters {
+ public:
+  perf_counters() {
+    static bool warned = false;
+    for (const auto &event : PERF_EVENTS) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = event.type;
+      attr.config = event.config;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fd < 0) {
+        if (!warned) {
+          cerr << "\33[93;1mWARNING\33[0m: Cannot count " << event.name
+               << " (" << strerror(errno) << "), so it is not reported."
+               << endl;
+        }
+        continue;
+      }
+      counters.push_back({event.name, fd, 0, {0, 0, 0}});
+    }
+    warned = true;
+  }
+
+  perf_counters(const perf_counters &) = delete;
+  perf_counters &operator=(const perf_counters &) = delete;
+
+  ~perf_counters() {
+    for (auto &counter : counters) {
+      close(counter.fd);
+    }
+  }
+
+  // Starts counting. The counts of the joined threads cannot be reset, so the
+  // counts at the start are subtracted from the ones at the stop instead.
+  void start() {
+    for (auto &counter : counters) {
+      read_values(counter.fd, counter.start_values);
+    }
+    for (auto &counter : counters) {
+      ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  // Stops counting, and adds the counts since start() to the totals
+  void stop() {
+    for (auto &counter : counters) {
+      ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (auto &counter : counters) {
+      uint64_t values[3];
+      if (!read_values(counter.fd, values)) continue;
+      const double count = values[0] - counter.start_values[0];
+      const double enabled = values[1] - counter.start_values[1];
+      const double running = values[2] - counter.start_values[2];
+      if (running > 0) counter.total += count * enabled / running;
+    }
+  }
+
+  // Reports the totals as counters of the benchmark that are averaged over
+  // its iterations, and the instructions per cycle when both were counted
+  void report(benchmark::State &state) const {
+    double instructions = 0, cycles = 0;
+    for (const auto &counter : counters) {
+      state.counters[counter.name] =
+          benchmark::Counter(counter.total, benchmark::Counter::kAvgIterations);
+      if (counter.name == string("instructions")) instructions = counter.total;
+      if (counter.name == string("cycles")) cycles = counter.total;
+    }
+    if (cycles > 0) state.counters["IPC"] = instructions / cycles;
+  }
+
+ private:
+  struct counter {
+    const char *name;
+    int fd;
+    double total;
+
+    // The count, and the times that the event was enabled and running, at the
+    // start of the current measurement
+    uint64_t start_values[3];
+  };
+
+  // Reads the count of an event and the times that it was enabled and running
+  static bool read_values(int fd, uint64_t *values) {
+    return read(fd, values, 3 * sizeof(uint64_t)) == 3 * sizeof(uint64_t);
+  }
+
+  vector<counter> counters;
+};
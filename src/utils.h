@@ -163,4 +163,43 @@ vector<T> generate_data(distr_t data_distr, size_t size) {
       break;
   }
 }
+
+// A record of Sz bytes, which holds a numerical key and a payload
+template <class K, size_t Sz>
+struct record {
+  K key;
+  char payload[Sz - sizeof(K)];
+};
+
+// Returns the i-th byte of the payload of a record with the given key
+template <class K>
+char payload_byte(const K &key, size_t i) {
+  return reinterpret_cast<const char *>(&key)[i % sizeof(K)] ^
+         static_cast<char>(i);
+}
+
+// Wraps each key into a record of Sz bytes, whose payload is derived from the
+// key, so that it can be checked that the payloads were moved with their keys
+template <size_t Sz, class K>
+vector<record<K, Sz>> make_records(const vector<K> &keys) {
+  vector<record<K, Sz>> records(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    records[i].key = keys[i];
+    for (size_t j = 0; j < sizeof(records[i].payload); ++j) {
+      records[i].payload[j] = payload_byte(keys[i], j);
+    }
+  }
+  return records;
+}
+
+// Checks that the payload of every record still matches its key
+template <class K, size_t Sz>
+bool payloads_match_keys(const vector<record<K, Sz>> &records) {
+  for (const auto &r : records) {
+    for (size_t j = 0; j < sizeof(r.payload); ++j) {
+      if (r.payload[j] != payload_byte(r.key, j)) return false;
+    }
+  }
+  return true;
+}
 #endif  // UTILS_H
\ No newline at end of file
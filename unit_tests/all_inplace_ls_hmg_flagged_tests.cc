@@ -527,3 +527,224 @@ TEST(LEARNED_SORT_TEST, ChiSquaredLong) {
   // Test that it is sorted
   ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
 }
+
+TEST(LEARNED_SORT_TEST, CacheFittingConfigs) {
+  typedef learned_sort::tuned_configs<8>::large_input_configs configs;
+
+  // Caches that fit the first, the second, and none of the configurations
+  const learned_sort::utils::cache_sizes caches[] = {
+      {48 << 10, 2 << 20, 32 << 20},
+      {32 << 10, 1 << 20, 32 << 20},
+      {16 << 10, 128 << 10, 1 << 20}};
+  const long expected_primary_fragments_sz[] = {1'024'000, 512'000, 256'000};
+
+  for (long cache_idx = 0; cache_idx < 3; ++cache_idx) {
+    // Generate random input
+    auto arr = normal_distr<double>(TEST_SIZE);
+
+    // Calculate the checksum
+    auto cksm = get_checksum(arr);
+
+    // Sort with the configuration that fits the caches
+    learned_sort::TwoLayerRMI<double>::Params p;
+    learned_sort::TwoLayerRMI<double> rmi(p);
+    ASSERT_TRUE(rmi.train(arr.begin(), arr.end()));
+    learned_sort::internal::with_fitting_config<double>(
+        configs(), caches[cache_idx], [&](auto config) {
+          typedef decltype(config) Config;
+          ASSERT_EQ(expected_primary_fragments_sz[cache_idx],
+                    sizeof(double) * Config::PRIMARY_FANOUT *
+                        Config::PRIMARY_FRAGMENT_CAPACITY);
+
+          learned_sort::internal::sort_scratch<double, Config> scratch;
+          learned_sort::internal::sort_with_model(arr.begin(), arr.end(), rmi,
+                                                  scratch);
+        });
+
+    // Test that the checksum is the same
+    ASSERT_EQ(cksm, get_checksum(arr));
+
+    // Test that it is sorted
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  }
+}
+
+TEST(LEARNED_SORT_TEST, DenseUnsignedLongAbove2To53) {
+  // Generate random keys that are closer to each other than the spacing of the
+  // doubles around 2^63
+  std::mt19937_64 gen(42);
+  vector<unsigned long> arr(TEST_SIZE);
+  for (auto &key : arr) {
+    key = (1ul << 63) + gen() % (1ul << 30);
+  }
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(LEARNED_SORT_TEST, FullRangeLong) {
+  // Generate random keys that span the whole range of long
+  std::mt19937_64 gen(42);
+  vector<long> arr(TEST_SIZE);
+  for (auto &key : arr) {
+    key = gen();
+  }
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(LEARNED_SORT_TEST, KeyOffsetsPredictions) {
+  // Generate random keys around 2^63 and sort them
+  std::mt19937_64 gen(42);
+  vector<unsigned long> arr(TEST_SIZE);
+  for (auto &key : arr) {
+    key = (1ul << 63) + gen() % (1ul << 30);
+  }
+  std::sort(arr.begin(), arr.end());
+
+  // Train the model and flatten it like the sorting routines do
+  learned_sort::TwoLayerRMI<unsigned long>::Params p;
+  learned_sort::TwoLayerRMI<unsigned long> rmi(p);
+  ASSERT_TRUE(rmi.train(arr.begin(), arr.end()));
+  const long num_leaf_models = rmi.hp.num_leaf_models;
+  vector<double> slopes(num_leaf_models), intercepts(num_leaf_models);
+  vector<double> base_hi(num_leaf_models), base_lo(num_leaf_models);
+  double root_base_hi, root_base_lo;
+  learned_sort::internal::split_bases(rmi, root_base_hi, root_base_lo,
+                                      base_hi.data(), base_lo.data());
+  for (long i = 0; i < num_leaf_models; ++i) {
+    slopes[i] = rmi.leaf_models[i].slope;
+    intercepts[i] = rmi.leaf_models[i].intercept;
+  }
+  const learned_sort::internal::flat_rmi model{
+      rmi.root_model.slope, rmi.root_model.intercept, num_leaf_models,
+      slopes.data(),        intercepts.data(),        root_base_hi,
+      root_base_lo,         base_hi.data(),           base_lo.data()};
+  const learned_sort::internal::bucket_map map{1. * arr.size(), 0.,
+                                               arr.size() - 1.};
+
+  // Test that the batched predictions are identical to the scalar ones
+  vector<long> pred_buckets(arr.size());
+  learned_sort::internal::predict_buckets(arr.begin(), arr.size(), model, -1,
+                                          map, pred_buckets.data());
+  for (size_t i = 0; i < arr.size(); ++i) {
+    ASSERT_EQ(pred_buckets[i],
+              learned_sort::internal::predict_bucket(model, map, arr[i]));
+  }
+
+  // Test that the keys are spread over the positions, rather than rounded
+  // together with their neighbors
+  std::sort(pred_buckets.begin(), pred_buckets.end());
+  long num_distinct = std::unique(pred_buckets.begin(), pred_buckets.end()) -
+                      pred_buckets.begin();
+  ASSERT_GT(num_distinct, arr.size() / 2);
+}
+
+// Generates uniform keys where a third of the keys are replaced by a few heavy
+// keys, which are spread over the range of the other keys
+vector<double> uniform_with_heavy_keys(size_t size) {
+  std::mt19937_64 gen(42);
+  std::uniform_real_distribution<double> distr(0, 1);
+  vector<double> arr(size);
+  for (size_t i = 0; i < size; ++i) {
+    arr[i] = i % 3 == 0 ? (gen() % 20) / 20. : distr(gen);
+  }
+  return arr;
+}
+
+TEST(LEARNED_SORT_TEST, HeavyKeys) {
+  // Generate random input
+  auto arr = uniform_with_heavy_keys(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(LEARNED_SORT_TEST, ParallelHeavyKeys) {
+  // Generate random input
+  auto arr = uniform_with_heavy_keys(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = 4;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(LEARNED_SORT_TEST, FindHeavyKeys) {
+  // Generate random input and train a model on it
+  auto arr = uniform_with_heavy_keys(TEST_SIZE);
+  learned_sort::TwoLayerRMI<double>::Params p;
+  learned_sort::TwoLayerRMI<double> rmi(p);
+  ASSERT_TRUE(rmi.train(arr.begin(), arr.end()));
+
+  // Flatten the model like the sorting routines do
+  const long num_leaf_models = rmi.hp.num_leaf_models;
+  vector<double> slopes(num_leaf_models), intercepts(num_leaf_models);
+  for (long i = 0; i < num_leaf_models; ++i) {
+    slopes[i] = rmi.leaf_models[i].slope;
+    intercepts[i] = rmi.leaf_models[i].intercept;
+  }
+  const learned_sort::internal::flat_rmi model{
+      rmi.root_model.slope, rmi.root_model.intercept, num_leaf_models,
+      slopes.data(),        intercepts.data(),        0,
+      0,                    nullptr,                  nullptr};
+
+  // Find the heavy keys
+  const long primary_fanout = 1000;
+  learned_sort::internal::heavy_keys<double> heavy;
+  learned_sort::internal::find_heavy_keys(rmi.training_sample, model,
+                                          primary_fanout, heavy);
+
+  // Test that exactly the repeated keys were found
+  ASSERT_EQ(20, heavy.keys.size());
+
+  // Test that each heavy key is listed under its predicted bucket
+  const learned_sort::internal::bucket_map primary_map{
+      1. * primary_fanout, 0., primary_fanout - 1.};
+  long num_listed = 0;
+  for (long bucket_idx = 0; bucket_idx < primary_fanout; ++bucket_idx) {
+    for (long i = 0; i < heavy.count(bucket_idx); ++i) {
+      ASSERT_EQ(bucket_idx, learned_sort::internal::predict_bucket(
+                                model, primary_map, heavy.of(bucket_idx)[i]));
+      ++num_listed;
+    }
+  }
+  ASSERT_EQ(20, num_listed);
+}
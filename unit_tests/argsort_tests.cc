@@ -0,0 +1,181 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+// Whether perm is a permutation of the positions of keys that sorts them
+template <class T, class Index>
+bool is_sorting_permutation(const vector<T> &keys, const vector<Index> &perm) {
+  if (perm.size() != keys.size()) return false;
+
+  vector<char> seen(keys.size(), 0);
+  for (size_t i = 0; i < perm.size(); ++i) {
+    if (perm[i] >= keys.size() || seen[perm[i]]) return false;
+    seen[perm[i]] = 1;
+    if (i > 0 && keys[perm[i]] < keys[perm[i - 1]]) return false;
+  }
+  return true;
+}
+
+TEST(ARGSORT_TEST, NormalDoubleUint32) {
+  // Generate random input
+  auto keys = normal_distr<double>(TEST_SIZE);
+  auto cksm = get_checksum(keys);
+
+  // Compute the permutation
+  vector<uint32_t> perm(keys.size());
+  learned_sort::argsort(keys.begin(), keys.end(), perm.begin());
+
+  // Test that the keys were left untouched
+  ASSERT_EQ(cksm, get_checksum(keys));
+
+  // Test that the permutation sorts the keys
+  ASSERT_TRUE(is_sorting_permutation(keys, perm));
+}
+
+TEST(ARGSORT_TEST, UniformLongUint64) {
+  // Generate random input
+  auto keys = uniform_distr<long>(TEST_SIZE);
+
+  // Compute the permutation
+  vector<uint64_t> perm(keys.size());
+  learned_sort::argsort(keys.begin(), keys.end(), perm.begin());
+
+  // Test that the permutation sorts the keys
+  ASSERT_TRUE(is_sorting_permutation(keys, perm));
+}
+
+TEST(ARGSORT_TEST, TwoDupsFloatUint32) {
+  // Generate random input
+  auto keys = two_dups_distr<float>(TEST_SIZE);
+
+  // Compute the permutation
+  vector<uint32_t> perm(keys.size());
+  learned_sort::argsort(keys.begin(), keys.end(), perm.begin());
+
+  // Test that the permutation sorts the keys
+  ASSERT_TRUE(is_sorting_permutation(keys, perm));
+}
+
+TEST(ARGSORT_TEST, ReverseSortedUnsignedUint32) {
+  // Generate random input
+  auto keys = reverse_sorted_uniform_distr<unsigned>(TEST_SIZE);
+
+  // Compute the permutation
+  vector<uint32_t> perm(keys.size());
+  learned_sort::argsort(keys.begin(), keys.end(), perm.begin());
+
+  // Test that the permutation sorts the keys
+  ASSERT_TRUE(is_sorting_permutation(keys, perm));
+}
+
+TEST(ARGSORT_TEST, SmallInputs) {
+  for (size_t sz : {0, 1, 2, 100, 10'000}) {
+    // Generate random input
+    auto keys = lognormal_distr<double>(sz);
+
+    // Compute the permutation
+    vector<uint32_t> perm(keys.size());
+    learned_sort::argsort(keys.begin(), keys.end(), perm.begin());
+
+    // Test that the permutation sorts the keys
+    ASSERT_TRUE(is_sorting_permutation(keys, perm));
+  }
+}
+
+TEST(ARGSORT_TEST, NarrowIndexType) {
+  // The positions of 300 keys do not fit in 8 bits
+  auto keys = uniform_distr<long>(300);
+  vector<uint8_t> perm(keys.size());
+  ASSERT_FALSE(learned_sort::argsort(keys.begin(), keys.end(), perm.begin()));
+
+  // The positions of 256 keys do
+  keys.resize(256);
+  perm.resize(keys.size());
+  ASSERT_TRUE(learned_sort::argsort(keys.begin(), keys.end(), perm.begin()));
+  ASSERT_TRUE(is_sorting_permutation(keys, perm));
+}
+
+TEST(ARGSORT_TEST, ApplyPermutation) {
+  // Generate a table with a key column and two payload columns
+  auto keys = mix_of_gauss_distr<double>(TEST_SIZE);
+  vector<long> ids(keys.size());
+  vector<float> values(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ids[i] = i;
+    values[i] = i * .5f;
+  }
+
+  // Compute the permutation
+  vector<uint32_t> perm(keys.size());
+  learned_sort::argsort(keys.begin(), keys.end(), perm.begin());
+  ASSERT_TRUE(is_sorting_permutation(keys, perm));
+
+  // Reorder all the columns
+  auto expected_keys = keys;
+  learned_sort::apply_permutation(perm.begin(), perm.end(), keys, ids, values);
+
+  // Test that the keys are sorted and that the rows were kept together
+  ASSERT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ASSERT_EQ(ids[i], perm[i]);
+    ASSERT_EQ(keys[i], expected_keys[perm[i]]);
+    ASSERT_EQ(values[i], perm[i] * .5f);
+  }
+}
+
+TEST(ARGSORT_TEST, BlockedPermutation) {
+  // Generate a table with a key column and a payload column
+  auto keys = uniform_distr<double>(TEST_SIZE);
+  vector<long> ids(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ids[i] = i;
+  }
+
+  // Compute the permutation
+  vector<uint32_t> perm(keys.size());
+  ASSERT_TRUE(learned_sort::argsort(keys.begin(), keys.end(), perm.begin()));
+
+  // Reorder the columns through blocks that are much smaller than the columns,
+  // and through blocks that are larger than them
+  for (long block_bits : {4, 30}) {
+    auto permuted_keys = keys;
+    auto permuted_ids = ids;
+    learned_sort::internal::blocked_permutation<uint32_t> blocked(
+        perm.begin(), perm.size(), block_bits);
+    vector<double> key_buffer(keys.size());
+    vector<long> id_buffer(keys.size());
+    blocked.permute(permuted_keys, key_buffer.data());
+    blocked.permute(permuted_ids, id_buffer.data());
+
+    // Test that the rows were reordered like by a direct gather
+    for (size_t i = 0; i < keys.size(); ++i) {
+      ASSERT_EQ(permuted_keys[i], keys[perm[i]]);
+      ASSERT_EQ(permuted_ids[i], perm[i]);
+    }
+  }
+}
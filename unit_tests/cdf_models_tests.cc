@@ -0,0 +1,166 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+using learned_sort::cdf_model_type;
+
+extern size_t TEST_SIZE;
+
+// The kinds of CDF models other than the default 2-layer RMI
+static const cdf_model_type OTHER_CDF_MODELS[] = {
+    cdf_model_type::THREE_LAYER_RMI, cdf_model_type::PIECEWISE_LINEAR,
+    cdf_model_type::RADIX_SPLINE};
+
+// Sorts a copy of the keys with each of the other kinds of CDF models, and
+// checks that the copies are sorted and keep their keys
+template <class T>
+void sort_with_each_model(const vector<T> &keys, long num_threads = 1) {
+  for (auto model_type : OTHER_CDF_MODELS) {
+    auto arr = keys;
+    auto cksm = get_checksum(arr);
+
+    typename learned_sort::TwoLayerRMI<T>::Params p;
+    p.model_type = model_type;
+    p.num_threads = num_threads;
+    if (num_threads > 1) {
+      learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+    } else {
+      learned_sort::sort(arr.begin(), arr.end(), p);
+    }
+
+    ASSERT_EQ(cksm, get_checksum(arr));
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  }
+}
+
+TEST(CDF_MODELS_TEST, MixGaussDouble) {
+  sort_with_each_model(mix_of_gauss_distr<double>(TEST_SIZE));
+}
+
+TEST(CDF_MODELS_TEST, LognormalDouble) {
+  sort_with_each_model(lognormal_distr<double>(TEST_SIZE));
+}
+
+TEST(CDF_MODELS_TEST, NormalLong) {
+  sort_with_each_model(normal_distr<long>(TEST_SIZE));
+}
+
+TEST(CDF_MODELS_TEST, RootDupsUnsigned) {
+  sort_with_each_model(root_dups_distr<unsigned>(TEST_SIZE));
+}
+
+TEST(CDF_MODELS_TEST, UniformFullRangeUnsignedLong) {
+  std::mt19937_64 gen(42);
+  vector<unsigned long> arr(TEST_SIZE);
+  for (auto &key : arr) {
+    key = gen();
+  }
+  sort_with_each_model(arr);
+}
+
+TEST(CDF_MODELS_TEST, ParallelMixGaussDouble) {
+  sort_with_each_model(mix_of_gauss_distr<double>(TEST_SIZE), 4);
+}
+
+TEST(CDF_MODELS_TEST, SearchModelsErrorBound) {
+  // Train each search model on a sample of the whole input
+  auto arr = lognormal_distr<double>(200'000);
+  for (auto model_type : {cdf_model_type::PIECEWISE_LINEAR,
+                          cdf_model_type::RADIX_SPLINE}) {
+    learned_sort::TwoLayerRMI<double>::Params p;
+    p.model_type = model_type;
+    p.sampling_rate = 1;
+    learned_sort::TwoLayerRMI<double> rmi(p);
+    ASSERT_TRUE(rmi.train(arr.begin(), arr.end()));
+    learned_sort::internal::flat_model_storage storage;
+    const auto model = learned_sort::internal::flatten_model(rmi, storage);
+    ASSERT_EQ(learned_sort::internal::leaf_routing::SEARCH, model.routing);
+
+    // Test that the first occurrence of each key of the sample is predicted
+    // within the maximum error of its rank
+    const auto &sample = rmi.training_sample;
+    const learned_sort::internal::bucket_map rank_map{
+        1. * sample.size(), .5, sample.size() - 1.};
+    for (size_t i = 0; i < sample.size(); ++i) {
+      if (i > 0 && sample[i] == sample[i - 1]) continue;
+      long pred_rank =
+          learned_sort::internal::predict_bucket(model, rank_map, sample[i]);
+      ASSERT_LE(std::abs(pred_rank - (long)i), p.max_error + 1);
+    }
+  }
+}
+
+TEST(CDF_MODELS_TEST, RadixTableNarrowsSearch) {
+  // Train a radix spline on keys that take offsets
+  std::mt19937_64 gen(42);
+  vector<unsigned long> arr(200'000);
+  for (auto &key : arr) {
+    key = gen() >> (gen() % 40);
+  }
+  learned_sort::TwoLayerRMI<unsigned long>::Params p;
+  p.model_type = cdf_model_type::RADIX_SPLINE;
+  learned_sort::TwoLayerRMI<unsigned long> rmi(p);
+  ASSERT_TRUE(rmi.train(arr.begin(), arr.end()));
+  learned_sort::internal::flat_model_storage storage;
+  auto model = learned_sort::internal::flatten_model(rmi, storage);
+  ASSERT_EQ(1L << p.radix_bits, model.num_radix_buckets);
+
+  // Test that the radix table finds the same leaves as a full binary search
+  auto full_search = model;
+  full_search.num_radix_buckets = 0;
+  for (auto key : arr) {
+    ASSERT_EQ(learned_sort::internal::predict_leaf(full_search, key),
+              learned_sort::internal::predict_leaf(model, key));
+  }
+}
+
+TEST(CDF_MODELS_TEST, MiddleLayerBatchedPredictions) {
+  // Train a 3-layer RMI on keys that take offsets
+  std::mt19937_64 gen(42);
+  std::normal_distribution<double> distr(0, 1);
+  vector<long> arr(200'000);
+  for (auto &key : arr) {
+    key = distr(gen) * 1e17;
+  }
+  learned_sort::TwoLayerRMI<long>::Params p;
+  p.model_type = cdf_model_type::THREE_LAYER_RMI;
+  learned_sort::TwoLayerRMI<long> rmi(p);
+  ASSERT_TRUE(rmi.train(arr.begin(), arr.end()));
+  learned_sort::internal::flat_model_storage storage;
+  const auto model = learned_sort::internal::flatten_model(rmi, storage);
+  ASSERT_EQ(learned_sort::internal::leaf_routing::MIDDLE_LAYER, model.routing);
+
+  // Test that the batched predictions are the ones of the scalar traversal
+  const learned_sort::internal::bucket_map map{1. * arr.size(), 0.,
+                                               arr.size() - 1.};
+  vector<long> pred_buckets(arr.size());
+  learned_sort::internal::predict_buckets(arr.begin(), arr.size(), model, -1,
+                                          map, pred_buckets.data());
+  for (size_t i = 0; i < arr.size(); ++i) {
+    ASSERT_EQ(learned_sort::internal::predict_bucket(model, map, arr[i]),
+              pred_buckets[i]);
+  }
+}
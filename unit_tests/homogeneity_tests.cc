@@ -0,0 +1,149 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+// Checks all_keys_equal on runs of equal keys of every length up to a few
+// blocks of vectors, and on the same runs with a different key at each
+// position, which covers the vector blocks and the keys that are left after
+// them
+template <class T>
+void check_all_keys_equal(T key, T other_key) {
+  for (long n = 0; n <= 300; ++n) {
+    vector<T> arr(n, key);
+    ASSERT_TRUE(learned_sort::utils::all_keys_equal(arr.begin(), n)) << n;
+
+    for (long pos = 0; n > 1 && pos < n; ++pos) {
+      arr[pos] = other_key;
+      ASSERT_FALSE(learned_sort::utils::all_keys_equal(arr.begin(), n))
+          << n << " " << pos;
+      arr[pos] = key;
+    }
+  }
+}
+
+TEST(HOMOGENEITY_TEST, AllKeysEqualDouble) {
+  check_all_keys_equal<double>(1.5, 1.5000000000000002);
+}
+
+TEST(HOMOGENEITY_TEST, AllKeysEqualFloat) {
+  check_all_keys_equal<float>(-3.25f, -3.2500002f);
+}
+
+TEST(HOMOGENEITY_TEST, AllKeysEqualUnsignedLong) {
+  check_all_keys_equal<unsigned long>(1UL << 63, (1UL << 63) | 1);
+}
+
+TEST(HOMOGENEITY_TEST, AllKeysEqualInt) {
+  check_all_keys_equal<int>(-1, numeric_limits<int>::max());
+}
+
+TEST(HOMOGENEITY_TEST, AllKeysEqualShortAndChar) {
+  check_all_keys_equal<short>(-2, 2);
+  check_all_keys_equal<unsigned char>(255, 254);
+}
+
+TEST(HOMOGENEITY_TEST, AllKeysEqualComparesFloatsAsNumbers) {
+  // The zeros of either sign are equal
+  vector<double> zeros(100, 0.);
+  zeros[37] = -0.;
+  zeros[99] = -0.;
+  ASSERT_TRUE(learned_sort::utils::all_keys_equal(zeros.begin(), 100));
+
+  // A NaN differs from every key, including another NaN, wherever it is
+  const double nan = numeric_limits<double>::quiet_NaN();
+  vector<double> nans(100, nan);
+  ASSERT_FALSE(learned_sort::utils::all_keys_equal(nans.begin(), 100));
+  ASSERT_FALSE(learned_sort::utils::all_keys_equal(nans.begin(), 2));
+
+  // A single key is homogeneous, whatever it is
+  ASSERT_TRUE(learned_sort::utils::all_keys_equal(nans.begin(), 1));
+}
+
+TEST(HOMOGENEITY_TEST, AllKeysEqualOfRecords) {
+  // Records whose keys are equal but whose payloads differ
+  vector<pair<double, long>> records(100);
+  for (long i = 0; i < 100; ++i) {
+    records[i] = {4., i};
+  }
+  auto key_of = [](const pair<double, long> &record) { return record.first; };
+  ASSERT_TRUE(
+      learned_sort::utils::all_keys_equal(records.begin(), 100, key_of));
+
+  records[64].first = 5.;
+  ASSERT_FALSE(
+      learned_sort::utils::all_keys_equal(records.begin(), 100, key_of));
+}
+
+TEST(HOMOGENEITY_TEST, RepeatedKeysFloat) {
+  // Generate keys that are each repeated many times, so that many buckets
+  // are homogeneous
+  const size_t size = max(TEST_SIZE, (size_t)1'000'000);
+  vector<float> arr(size);
+  for (size_t i = 0; i < size; ++i) {
+    arr[i] = i / 64;
+  }
+  std::shuffle(arr.begin(), arr.end(), std::mt19937(42));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(HOMOGENEITY_TEST, RepeatedKeysUnsigned) {
+  // Generate keys that are each repeated many times, so that many buckets
+  // are homogeneous
+  const size_t size = max(TEST_SIZE, (size_t)1'000'000);
+  vector<unsigned> arr(size);
+  for (size_t i = 0; i < size; ++i) {
+    arr[i] = i / 64;
+  }
+  std::shuffle(arr.begin(), arr.end(), std::mt19937(42));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
@@ -0,0 +1,180 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+TEST(LEARNED_SORTER_TEST, RepeatedDouble) {
+  learned_sort::LearnedSorter<double> sorter;
+
+  // Sort inputs of different distributions and sizes with the same sorter
+  vector<vector<double>> inputs = {
+      normal_distr<double>(TEST_SIZE), lognormal_distr<double>(TEST_SIZE / 2),
+      mix_of_gauss_distr<double>(TEST_SIZE), two_dups_distr<double>(TEST_SIZE),
+      normal_distr<double>(TEST_SIZE / 4)};
+
+  for (auto &arr : inputs) {
+    // Calculate the checksum
+    auto cksm = get_checksum(arr);
+
+    // Sort
+    sorter.sort(arr.begin(), arr.end());
+
+    // Test that the checksum is the same
+    ASSERT_EQ(cksm, get_checksum(arr));
+
+    // Test that it is sorted
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  }
+}
+
+TEST(LEARNED_SORTER_TEST, RepeatedUnsigned) {
+  learned_sort::LearnedSorter<unsigned> sorter;
+
+  // Sort inputs that need no model between inputs that need one
+  vector<vector<unsigned>> inputs = {
+      uniform_distr<unsigned>(TEST_SIZE),
+      sorted_uniform_distr<unsigned>(TEST_SIZE),
+      zipf_distr<unsigned>(TEST_SIZE), identical_distr<unsigned>(TEST_SIZE),
+      root_dups_distr<unsigned>(TEST_SIZE), uniform_distr<unsigned>(1000)};
+
+  for (auto &arr : inputs) {
+    // Calculate the checksum
+    auto cksm = get_checksum(arr);
+
+    // Sort
+    sorter.sort(arr.begin(), arr.end());
+
+    // Test that the checksum is the same
+    ASSERT_EQ(cksm, get_checksum(arr));
+
+    // Test that it is sorted
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  }
+}
+
+TEST(LEARNED_SORTER_TEST, SameAsFreeFunction) {
+  // Generate random input
+  auto arr = exponential_distr<double>(TEST_SIZE);
+  auto expected = arr;
+
+  // Sort the input twice with the same sorter, and once with the free function
+  learned_sort::LearnedSorter<double> sorter;
+  auto first = arr;
+  sorter.sort(first.begin(), first.end());
+  sorter.sort(arr.begin(), arr.end());
+  learned_sort::sort(expected.begin(), expected.end());
+
+  // Test that all the results are identical
+  ASSERT_EQ(expected, first);
+  ASSERT_EQ(expected, arr);
+}
+
+TEST(LEARNED_SORTER_TEST, SmallAndLargeInputs) {
+  learned_sort::LearnedSorter<float> sorter;
+
+  // Sort inputs on both sides of the size that selects the tuned configuration
+  const long large_input_sz = learned_sort::tuned_configs<4>::LARGE_INPUT_SZ;
+  vector<vector<float>> inputs = {normal_distr<float>(large_input_sz / 2),
+                                  normal_distr<float>(large_input_sz * 2),
+                                  normal_distr<float>(large_input_sz / 2)};
+
+  for (auto &arr : inputs) {
+    // Calculate the checksum
+    auto cksm = get_checksum(arr);
+
+    // Sort
+    sorter.sort(arr.begin(), arr.end());
+
+    // Test that the checksum is the same
+    ASSERT_EQ(cksm, get_checksum(arr));
+
+    // Test that it is sorted
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  }
+}
+
+TEST(LEARNED_SORTER_TEST, ReusedModelDetectsDrift) {
+  learned_sort::LearnedSorter<double> sorter;
+  sorter.set_model_reuse(true);
+
+  // The inputs must be large enough to be sorted with the model
+  const size_t INPUT_SZ = std::max<size_t>(TEST_SIZE, 500'000);
+
+  // Sort batches of the same distribution, then a batch that is four times as
+  // spread out, and then batches of that distribution
+  vector<pair<vector<double>, bool>> inputs = {
+      {normal_distr<double>(INPUT_SZ), false},
+      {normal_distr<double>(INPUT_SZ), false},
+      {normal_distr<double>(INPUT_SZ / 2), false},
+      {normal_distr<double>(INPUT_SZ, 0, 4), true},
+      {normal_distr<double>(INPUT_SZ, 0, 4), false},
+      {normal_distr<double>(INPUT_SZ, 0, 4), false}};
+
+  for (auto &[arr, drifted] : inputs) {
+    // Calculate the checksum
+    auto cksm = get_checksum(arr);
+
+    // Sort
+    sorter.sort(arr.begin(), arr.end());
+
+    // Test that the checksum is the same
+    ASSERT_EQ(cksm, get_checksum(arr));
+
+    // Test that it is sorted
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+
+    // Test that only the batch of the new distribution found the model drifted,
+    // and that the model was retrained after it
+    ASSERT_EQ(drifted, sorter.drift().drifted);
+  }
+}
+
+TEST(LEARNED_SORTER_TEST, ReusedModelOnlyReportsDrift) {
+  learned_sort::TwoLayerRMI<unsigned>::Params p;
+  p.out_of_place = true;
+  learned_sort::LearnedSorter<unsigned> sorter(p);
+  sorter.set_model_reuse(true, false);
+  const size_t INPUT_SZ = std::max<size_t>(TEST_SIZE, 500'000);
+
+  // Train the model on keys in the lower half of the range, and keep it for
+  // keys that spread over the whole range
+  auto arr = uniform_distr<unsigned>(INPUT_SZ, 0, 1u << 30);
+  sorter.sort(arr.begin(), arr.end());
+  ASSERT_FALSE(sorter.drift().drifted);
+
+  for (int i = 0; i < 2; ++i) {
+    arr = uniform_distr<unsigned>(INPUT_SZ, 0, 1u << 31);
+    auto cksm = get_checksum(arr);
+    sorter.sort(arr.begin(), arr.end());
+    ASSERT_EQ(cksm, get_checksum(arr));
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+
+    // Test that the drift is reported every time, since the model is kept
+    ASSERT_TRUE(sorter.drift().drifted);
+    ASSERT_GT(sorter.drift().spill_rate, 0);
+  }
+}
@@ -0,0 +1,225 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../include/model_file.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+using learned_sort::cdf_model_type;
+
+extern size_t TEST_SIZE;
+
+// Returns the path of a temporary model file for the current test
+static string model_path() {
+  return testing::TempDir() + "/" +
+         testing::UnitTest::GetInstance()->current_test_info()->name() +
+         ".lsmodel";
+}
+
+// Tests that a flat array of n elements holds the same values as another one,
+// or that both arrays are absent
+template <class E>
+static void expect_same_array(const E *expected, const E *actual, long n) {
+  ASSERT_EQ(expected == nullptr, actual == nullptr);
+  if (expected == nullptr) return;
+  for (long i = 0; i < n; ++i) {
+    ASSERT_EQ(expected[i], actual[i]);
+  }
+}
+
+// Trains a model of each kind on the keys, saves it and maps it back, tests
+// that the mapped model has the parameters and the heavy keys of the trained
+// one, and sorts another batch of keys from the same distribution with it
+template <class T>
+void save_and_sort_next_batch(const vector<T> &keys,
+                              const vector<T> &next_batch) {
+  for (auto model_type :
+       {cdf_model_type::TWO_LAYER_RMI, cdf_model_type::THREE_LAYER_RMI,
+        cdf_model_type::PIECEWISE_LINEAR, cdf_model_type::RADIX_SPLINE}) {
+    typename learned_sort::TwoLayerRMI<T>::Params p;
+    p.model_type = model_type;
+    learned_sort::TwoLayerRMI<T> rmi(p);
+    ASSERT_TRUE(rmi.train(keys.begin(), keys.end()));
+    ASSERT_TRUE(learned_sort::save_model(rmi, model_path()));
+
+    learned_sort::MappedModel<T> mapped;
+    ASSERT_TRUE(mapped.open(model_path()));
+    learned_sort::internal::flat_model_storage storage;
+    const auto expected = learned_sort::internal::flatten_model(rmi, storage);
+    const auto &actual = mapped.model();
+    const long n = expected.num_leaf_models;
+    ASSERT_EQ(n, actual.num_leaf_models);
+    ASSERT_EQ(expected.routing, actual.routing);
+    ASSERT_EQ(expected.root_slope, actual.root_slope);
+    ASSERT_EQ(expected.root_intercept, actual.root_intercept);
+    ASSERT_EQ(expected.root_base_hi, actual.root_base_hi);
+    ASSERT_EQ(expected.root_base_lo, actual.root_base_lo);
+    expect_same_array(expected.slopes, actual.slopes, n);
+    expect_same_array(expected.intercepts, actual.intercepts, n);
+    expect_same_array(expected.base_hi, actual.base_hi, n);
+    expect_same_array(expected.base_lo, actual.base_lo, n);
+    ASSERT_EQ(expected.num_mid_models, actual.num_mid_models);
+    expect_same_array(expected.mid_slopes, actual.mid_slopes,
+                      expected.num_mid_models);
+    expect_same_array(expected.mid_intercepts, actual.mid_intercepts,
+                      expected.num_mid_models);
+    expect_same_array(expected.leaf_starts, actual.leaf_starts, n);
+    ASSERT_EQ(expected.num_radix_buckets, actual.num_radix_buckets);
+    expect_same_array(expected.radix_table, actual.radix_table,
+                      expected.num_radix_buckets + 1);
+    ASSERT_EQ(rmi.enable_dups_detection, mapped.enable_dups_detection());
+    ASSERT_EQ(model_type, mapped.params().model_type);
+
+    learned_sort::internal::heavy_keys<T> expected_heavy, actual_heavy;
+    learned_sort::internal::find_heavy_keys(rmi.training_sample, expected,
+                                            1000, expected_heavy);
+    mapped.find_heavy_keys(1000, actual_heavy);
+    ASSERT_EQ(expected_heavy.keys, actual_heavy.keys);
+    ASSERT_EQ(expected_heavy.first, actual_heavy.first);
+
+    auto arr = next_batch;
+    auto cksm = get_checksum(arr);
+    learned_sort::sort(arr.begin(), arr.end(), mapped);
+    ASSERT_EQ(cksm, get_checksum(arr));
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  }
+  std::remove(model_path().c_str());
+}
+
+TEST(MODEL_FILE_TEST, NormalDouble) {
+  save_and_sort_next_batch(normal_distr<double>(TEST_SIZE),
+                           normal_distr<double>(TEST_SIZE));
+}
+
+TEST(MODEL_FILE_TEST, HeavyKeysUnsigned) {
+  // Half of the keys are copies of a few heavy keys, whose runs in the sample
+  // are saved along with the model
+  std::mt19937_64 gen(42);
+  vector<unsigned> keys(TEST_SIZE), next_batch(TEST_SIZE);
+  for (auto *arr : {&keys, &next_batch}) {
+    for (auto &key : *arr) {
+      key = gen() % 2 ? gen() : (gen() % 16) << 28;
+    }
+  }
+  save_and_sort_next_batch(keys, next_batch);
+}
+
+TEST(MODEL_FILE_TEST, OffsetsUnsignedLong) {
+  std::mt19937_64 gen(42);
+  vector<unsigned long> keys(TEST_SIZE), next_batch(TEST_SIZE);
+  for (auto *arr : {&keys, &next_batch}) {
+    for (auto &key : *arr) {
+      key = gen() >> (gen() % 40);
+    }
+  }
+  save_and_sort_next_batch(keys, next_batch);
+}
+
+TEST(MODEL_FILE_TEST, OtherDistribution) {
+  // Sorting keys from another distribution is slower, but still correct
+  auto keys = normal_distr<double>(TEST_SIZE);
+  learned_sort::TwoLayerRMI<double>::Params p;
+  learned_sort::TwoLayerRMI<double> rmi(p);
+  ASSERT_TRUE(rmi.train(keys.begin(), keys.end()));
+  ASSERT_TRUE(learned_sort::save_model(rmi, model_path()));
+
+  learned_sort::MappedModel<double> mapped;
+  ASSERT_TRUE(mapped.open(model_path()));
+  auto arr = lognormal_distr<double>(TEST_SIZE);
+  auto cksm = get_checksum(arr);
+  learned_sort::sort(arr.begin(), arr.end(), mapped);
+  ASSERT_EQ(cksm, get_checksum(arr));
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  std::remove(model_path().c_str());
+}
+
+TEST(MODEL_FILE_TEST, RejectsInvalidFiles) {
+  // An untrained model is not saved
+  learned_sort::TwoLayerRMI<double>::Params p;
+  learned_sort::TwoLayerRMI<double> untrained(p);
+  ASSERT_FALSE(learned_sort::save_model(untrained, model_path()));
+
+  // A missing file is not mapped
+  learned_sort::MappedModel<double> mapped;
+  ASSERT_FALSE(mapped.open(model_path()));
+  ASSERT_FALSE(mapped.is_open());
+
+  // A model of other keys is not mapped
+  auto keys = normal_distr<double>(TEST_SIZE);
+  learned_sort::TwoLayerRMI<double> rmi(p);
+  ASSERT_TRUE(rmi.train(keys.begin(), keys.end()));
+  ASSERT_TRUE(learned_sort::save_model(rmi, model_path()));
+  learned_sort::MappedModel<long> other_keys;
+  ASSERT_FALSE(other_keys.open(model_path()));
+  ASSERT_TRUE(mapped.open(model_path()));
+
+  // A file with invalid hyperparameters is not mapped
+  FILE *file = std::fopen(model_path().c_str(), "r+b");
+  ASSERT_NE(nullptr, file);
+  learned_sort::internal::model_file_header header;
+  ASSERT_EQ(1u, std::fread(&header, sizeof(header), 1, file));
+  const long batch_sz_offset =
+      header.params_offset +
+      offsetof(learned_sort::TwoLayerRMI<double>::Params, batch_sz);
+  const long invalid_batch_sz = 0;
+  std::fseek(file, batch_sz_offset, SEEK_SET);
+  ASSERT_EQ(1u, std::fwrite(&invalid_batch_sz, sizeof(long), 1, file));
+  std::fflush(file);
+  learned_sort::MappedModel<double> invalid_params;
+  ASSERT_FALSE(invalid_params.open(model_path()));
+  std::fseek(file, batch_sz_offset, SEEK_SET);
+  ASSERT_EQ(1u, std::fwrite(&rmi.hp.batch_sz, sizeof(long), 1, file));
+  std::fflush(file);
+  learned_sort::MappedModel<double> restored;
+  ASSERT_TRUE(restored.open(model_path()));
+
+  // A truncated file is not mapped
+  std::fseek(file, 0, SEEK_END);
+  ASSERT_EQ(0, ftruncate(fileno(file), std::ftell(file) - 8));
+  std::fclose(file);
+  learned_sort::MappedModel<double> truncated;
+  ASSERT_FALSE(truncated.open(model_path()));
+
+  // A radix spline whose radix table points past its leaf models is not mapped
+  p.model_type = cdf_model_type::RADIX_SPLINE;
+  learned_sort::TwoLayerRMI<double> spline(p);
+  ASSERT_TRUE(spline.train(keys.begin(), keys.end()));
+  ASSERT_TRUE(learned_sort::save_model(spline, model_path()));
+  ASSERT_TRUE(mapped.open(model_path()));
+  file = std::fopen(model_path().c_str(), "r+b");
+  ASSERT_NE(nullptr, file);
+  ASSERT_EQ(1u, std::fread(&header, sizeof(header), 1, file));
+  ASSERT_GT(header.num_radix_buckets, 0);
+  const vector<long> invalid_radix_table(header.num_radix_buckets + 1,
+                                         1L << 40);
+  std::fseek(file, header.radix_table_offset, SEEK_SET);
+  ASSERT_EQ(invalid_radix_table.size(),
+            std::fwrite(invalid_radix_table.data(), sizeof(long),
+                        invalid_radix_table.size(), file));
+  std::fclose(file);
+  learned_sort::MappedModel<double> invalid_radix;
+  ASSERT_FALSE(invalid_radix.open(model_path()));
+  std::remove(model_path().c_str());
+}
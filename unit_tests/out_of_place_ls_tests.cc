@@ -0,0 +1,168 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+TEST(OUT_OF_PLACE_LEARNED_SORT_TEST, NormalDouble) {
+  // Generate random input
+  auto arr = normal_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.out_of_place = true;
+  learned_sort::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(OUT_OF_PLACE_LEARNED_SORT_TEST, UniformLong) {
+  // Generate random input
+  auto arr = uniform_distr<long>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<long>::Params p;
+  p.out_of_place = true;
+  learned_sort::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(OUT_OF_PLACE_LEARNED_SORT_TEST, LognormalDouble) {
+  // Generate random input
+  auto arr = lognormal_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.out_of_place = true;
+  learned_sort::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(OUT_OF_PLACE_LEARNED_SORT_TEST, ZipfUnsigned) {
+  // Generate random input
+  auto arr = zipf_distr<unsigned>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<unsigned>::Params p;
+  p.out_of_place = true;
+  learned_sort::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(OUT_OF_PLACE_LEARNED_SORT_TEST, TwoDupsDouble) {
+  // Generate random input
+  auto arr = two_dups_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.out_of_place = true;
+  learned_sort::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(OUT_OF_PLACE_LEARNED_SORT_TEST, MixGaussNoOverallocation) {
+  // Generate random input
+  auto arr = mix_of_gauss_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.out_of_place = true;
+  p.overallocation = 1;
+  learned_sort::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(OUT_OF_PLACE_LEARNED_SORT_TEST, RepeatedWithSorter) {
+  learned_sort::LearnedSorter<double>::Params p;
+  p.out_of_place = true;
+  learned_sort::LearnedSorter<double> sorter(p);
+
+  // Sort inputs of different sizes with the same buckets and spill area
+  vector<vector<double>> inputs = {normal_distr<double>(TEST_SIZE),
+                                   exponential_distr<double>(TEST_SIZE / 3),
+                                   normal_distr<double>(TEST_SIZE * 2)};
+
+  for (auto &arr : inputs) {
+    // Calculate the checksum
+    auto cksm = get_checksum(arr);
+
+    // Sort
+    sorter.sort(arr.begin(), arr.end());
+
+    // Test that the checksum is the same
+    ASSERT_EQ(cksm, get_checksum(arr));
+
+    // Test that it is sorted
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  }
+}
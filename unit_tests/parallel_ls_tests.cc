@@ -0,0 +1,276 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+// Use a fixed number of threads, regardless of the hardware
+static constexpr long NUM_THREADS = 4;
+
+TEST(PARALLEL_LEARNED_SORT_TEST, NormalDouble) {
+  // Generate random input
+  auto arr = normal_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, NormalUnsigned) {
+  // Generate random input
+  auto arr = normal_distr<unsigned>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<unsigned>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, UniformLong) {
+  // Generate random input
+  auto arr = uniform_distr<long>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<long>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, LognormalDouble) {
+  // Generate random input
+  auto arr = lognormal_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, MixGaussDouble) {
+  // Generate random input
+  auto arr = mix_of_gauss_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, RootDupsUnsigned) {
+  // Generate random input
+  auto arr = root_dups_distr<unsigned>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<unsigned>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, TwoDupsDouble) {
+  // Generate random input
+  auto arr = two_dups_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, IdenticalLong) {
+  // Generate random input
+  auto arr = identical_distr<long>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<long>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, ZipfUnsigned) {
+  // Generate random input
+  auto arr = zipf_distr<unsigned>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<unsigned>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, ExponentialDouble) {
+  // Generate random input
+  auto arr = exponential_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, EmptyInput) {
+  // Sort an empty input with explicit hyperparameters
+  vector<double> arr;
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = NUM_THREADS;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+  ASSERT_TRUE(arr.empty());
+
+  // Sort an empty input by a key-extraction functor
+  learned_sort::parallel::sort(
+      arr.begin(), arr.end(), [](double key) { return key; }, p);
+  ASSERT_TRUE(arr.empty());
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, ParallelSortOfSample) {
+  for (size_t size : {15ul, 1000ul, TEST_SIZE}) {
+    // Generate random input with many duplicates
+    auto arr = root_dups_distr<long>(size);
+    auto expected = arr;
+    std::sort(expected.begin(), expected.end());
+
+    // Sort
+    learned_sort::utils::parallel_sort(arr, NUM_THREADS);
+
+    // Test that it is sorted and that no key was lost
+    ASSERT_EQ(expected, arr);
+  }
+}
+
+TEST(PARALLEL_LEARNED_SORT_TEST, ParallelTrainingMatchesSerial) {
+  // Generate random input
+  auto arr = lognormal_distr<double>(TEST_SIZE);
+
+  // Train with one thread and with several threads, on a large sample
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.sampling_rate = .5;
+  learned_sort::TwoLayerRMI<double> serial_rmi(p), parallel_rmi(p);
+  ASSERT_TRUE(serial_rmi.train(arr.begin(), arr.end()));
+  ASSERT_TRUE(parallel_rmi.train(arr.begin(), arr.end(),
+                                 learned_sort::utils::identity_key(),
+                                 NUM_THREADS));
+
+  // Test that both trainings produced the same model
+  ASSERT_EQ(serial_rmi.training_sample, parallel_rmi.training_sample);
+  ASSERT_EQ(serial_rmi.enable_dups_detection,
+            parallel_rmi.enable_dups_detection);
+  ASSERT_EQ(serial_rmi.root_model.slope, parallel_rmi.root_model.slope);
+  for (size_t i = 0; i < serial_rmi.leaf_models.size(); ++i) {
+    ASSERT_EQ(serial_rmi.leaf_models[i].slope,
+              parallel_rmi.leaf_models[i].slope);
+    ASSERT_EQ(serial_rmi.leaf_models[i].intercept,
+              parallel_rmi.leaf_models[i].intercept);
+  }
+}
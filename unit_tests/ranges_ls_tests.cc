@@ -0,0 +1,221 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+TEST(RANGES_LEARNED_SORT_TEST, AscendingNormalDouble) {
+  // Generate random input
+  auto arr = normal_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  auto last = learned_sort::ranges::sort(arr);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the end of the range was returned
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  ASSERT_EQ(last, arr.end());
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, DescendingLognormalDouble) {
+  // Generate random input
+  auto arr = lognormal_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::ranges::sort(arr, std::ranges::greater());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end(), std::greater<double>()));
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, DescendingSignedLong) {
+  // Generate random input with both negative and positive keys
+  auto keys = normal_distr<double>(TEST_SIZE);
+  vector<long> arr(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    arr[i] = keys[i] * 1e6 - 5e8;
+  }
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::ranges::sort(arr, std::greater<>());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end(), std::greater<long>()));
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, DescendingTwoDupsUnsigned) {
+  // Generate random input
+  auto arr = two_dups_distr<unsigned>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::ranges::sort(arr, std::ranges::greater());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end(), std::greater<unsigned>()));
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, DescendingSortedInput) {
+  // Generate an input that is sorted in ascending order
+  auto arr = sorted_uniform_distr<double>(TEST_SIZE);
+
+  // Sort
+  learned_sort::ranges::sort(arr, std::ranges::greater());
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end(), std::greater<double>()));
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, SpanOverRawBuffer) {
+  // Copy random input into a raw buffer
+  auto keys = exponential_distr<double>(TEST_SIZE);
+  double *buf = new double[keys.size()];
+  std::copy(keys.begin(), keys.end(), buf);
+
+  // Sort
+  std::span<double> arr(buf, keys.size());
+  learned_sort::ranges::sort(arr);
+
+  // Test that it is sorted and that it has the original keys
+  std::sort(keys.begin(), keys.end());
+  ASSERT_TRUE(std::equal(keys.begin(), keys.end(), buf));
+
+  delete[] buf;
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, StdArray) {
+  // Copy random input into an array
+  auto keys = mix_of_gauss_distr<float>(10'000);
+  auto *arr = new array<float, 10'000>;
+  std::copy(keys.begin(), keys.end(), arr->begin());
+
+  // Sort
+  learned_sort::ranges::sort(*arr);
+
+  // Test that it is sorted and that it has the original keys
+  std::sort(keys.begin(), keys.end());
+  ASSERT_TRUE(std::equal(keys.begin(), keys.end(), arr->begin()));
+
+  delete arr;
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, ProjectionToDataMember) {
+  // Generate random input
+  auto arr = make_records<16>(zipf_distr<double>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::ranges::sort(arr, {}, &record<double, 16>::key);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(std::ranges::is_sorted(arr, {}, &record<double, 16>::key));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, DescendingProjection) {
+  // Generate random input
+  auto arr = make_records<32>(uniform_distr<long>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::ranges::sort(arr, std::ranges::greater(),
+                             [](const auto &r) { return r.key; });
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(std::ranges::is_sorted(arr, std::ranges::greater(),
+                                     &record<long, 32>::key));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, ParallelDescendingNormalDouble) {
+  // Generate random input
+  auto arr = normal_distr<double>(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = 4;
+  learned_sort::parallel::ranges::sort(arr, std::ranges::greater(),
+                                       std::identity(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end(), std::greater<double>()));
+}
+
+TEST(RANGES_LEARNED_SORT_TEST, TrainOnPointers) {
+  // Generate random input
+  auto arr = uniform_distr<double>(TEST_SIZE);
+
+  // Train the model on a raw buffer
+  learned_sort::TwoLayerRMI<double>::Params p;
+  learned_sort::TwoLayerRMI<double> rmi(p);
+  ASSERT_TRUE(rmi.train(arr.data(), arr.data() + arr.size()));
+
+  // Sort with the trained model
+  learned_sort::sort(arr.data(), arr.data() + arr.size(), rmi);
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
@@ -0,0 +1,197 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+// Returns the key of a record
+struct key_of_record {
+  template <class R>
+  auto operator()(const R &r) const {
+    return r.key;
+  }
+};
+
+// Whether the records are sorted by their keys
+template <class R>
+bool is_sorted_by_key(const vector<R> &records) {
+  return std::is_sorted(
+      records.begin(), records.end(),
+      [](const R &a, const R &b) { return a.key < b.key; });
+}
+
+TEST(RECORDS_LEARNED_SORT_TEST, NormalDouble16) {
+  // Generate random input
+  auto arr = make_records<16>(normal_distr<double>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end(), key_of_record());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(is_sorted_by_key(arr));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RECORDS_LEARNED_SORT_TEST, LognormalDouble32) {
+  // Generate random input
+  auto arr = make_records<32>(lognormal_distr<double>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end(), key_of_record());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(is_sorted_by_key(arr));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RECORDS_LEARNED_SORT_TEST, UniformUnsignedLong32) {
+  // Generate random input
+  auto arr = make_records<32>(uniform_distr<unsigned long>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end(), key_of_record());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(is_sorted_by_key(arr));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RECORDS_LEARNED_SORT_TEST, TwoDupsFloat16) {
+  // Generate random input
+  auto arr = make_records<16>(two_dups_distr<float>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end(), key_of_record());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(is_sorted_by_key(arr));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RECORDS_LEARNED_SORT_TEST, ReverseSortedLong16) {
+  // Generate random input
+  auto arr = make_records<16>(reverse_sorted_uniform_distr<long>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end(), key_of_record());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(is_sorted_by_key(arr));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RECORDS_LEARNED_SORT_TEST, OutOfPlaceZipfDouble32) {
+  // Generate random input
+  auto arr = make_records<32>(zipf_distr<double>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.out_of_place = true;
+  learned_sort::sort(arr.begin(), arr.end(), key_of_record(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(is_sorted_by_key(arr));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RECORDS_LEARNED_SORT_TEST, ParallelMixGaussDouble16) {
+  // Generate random input
+  auto arr = make_records<16>(mix_of_gauss_distr<double>(TEST_SIZE));
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.num_threads = 4;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), key_of_record(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted and that the payloads moved with their keys
+  ASSERT_TRUE(is_sorted_by_key(arr));
+  ASSERT_TRUE(payloads_match_keys(arr));
+}
+
+TEST(RECORDS_LEARNED_SORT_TEST, KeyOfLambda) {
+  // Generate random input, where each key is paired with its original index
+  auto keys = exponential_distr<double>(TEST_SIZE);
+  vector<pair<double, long>> arr(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    arr[i] = {keys[i], i};
+  }
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end(),
+                     [](const pair<double, long> &p) { return p.first; });
+
+  // Test that it is sorted and that every record was moved as a whole
+  ASSERT_TRUE(std::is_sorted(
+      arr.begin(), arr.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; }));
+  vector<char> seen(keys.size(), 0);
+  for (const auto &p : arr) {
+    ASSERT_EQ(keys[p.second], p.first);
+    seen[p.second] = 1;
+  }
+  ASSERT_EQ(std::count(seen.begin(), seen.end(), 1), (long)keys.size());
+}
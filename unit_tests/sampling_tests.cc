@@ -0,0 +1,126 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+TEST(SAMPLING_TEST, BlockSampleTakesOneRunPerStretch) {
+  // Use the positions of the keys as their values, so that the sorted sample
+  // holds the positions of the sampled keys
+  const long INPUT_SZ = 1'000'003;
+  vector<long> arr(INPUT_SZ);
+  std::iota(arr.begin(), arr.end(), 0);
+
+  for (long block_sz : {1L, 8L, 64L}) {
+    learned_sort::TwoLayerRMI<long>::Params p;
+    p.sampling_block_sz = block_sz;
+    learned_sort::TwoLayerRMI<long> rmi(p);
+    ASSERT_TRUE(rmi.train(arr.begin(), arr.end()));
+
+    // Test that the sample takes a run of contiguous keys from each stretch of
+    // the input, and that the last stretch holds the remaining keys
+    const long offset = INPUT_SZ / (p.sampling_rate * INPUT_SZ);
+    const long stretch_sz = block_sz * offset;
+    const long num_stretches = (INPUT_SZ + stretch_sz - 1) / stretch_sz;
+    const auto &sample = rmi.training_sample;
+    long i = 0;
+    for (long stretch_idx = 0; stretch_idx < num_stretches; ++stretch_idx) {
+      const long stretch_start = stretch_idx * stretch_sz;
+      const long stretch_end = std::min(INPUT_SZ, stretch_start + stretch_sz);
+      const long run_sz = std::min(block_sz, stretch_end - stretch_start);
+      ASSERT_LE(stretch_start, sample[i]);
+      ASSERT_LE(sample[i] + run_sz, stretch_end);
+      for (long k = 1; k < run_sz; ++k) {
+        ASSERT_EQ(sample[i] + k, sample[i + k]);
+      }
+      i += run_sz;
+    }
+    ASSERT_EQ(i, (long)sample.size());
+  }
+}
+
+TEST(SAMPLING_TEST, PeriodicInputDoesNotAlias) {
+  // Generate keys whose period divides the stride of the sample
+  const long INPUT_SZ = 1'000'000;
+  vector<unsigned> arr(INPUT_SZ);
+  for (long i = 0; i < INPUT_SZ; ++i) {
+    arr[i] = i % 4000;
+  }
+
+  // Test that a sample at a fixed stride only sees a few unique keys
+  learned_sort::TwoLayerRMI<unsigned>::Params p;
+  p.sampling_block_sz = 1;
+  learned_sort::TwoLayerRMI<unsigned> stride_rmi(p);
+  ASSERT_FALSE(stride_rmi.train(arr.begin(), arr.end()));
+
+  // Test that the runs at pseudo-random positions see enough unique keys to
+  // train the model, which then sorts the input
+  p.sampling_block_sz = 8;
+  learned_sort::TwoLayerRMI<unsigned> block_rmi(p);
+  ASSERT_TRUE(block_rmi.train(arr.begin(), arr.end()));
+
+  auto cksm = get_checksum(arr);
+  learned_sort::sort(arr.begin(), arr.end(), p);
+  ASSERT_EQ(cksm, get_checksum(arr));
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(SAMPLING_TEST, ProgressiveSamplingStopsEarlyOnSmoothInput) {
+  // Generate uniformly distributed keys, which a small sample models well
+  std::mt19937_64 gen(42);
+  std::uniform_real_distribution<double> distr(0, 1);
+  vector<double> arr(TEST_SIZE);
+  for (auto &key : arr) {
+    key = distr(gen);
+  }
+
+  learned_sort::TwoLayerRMI<double>::Params p;
+  p.progressive_sampling = true;
+  p.max_sampling_rate = 1;
+  learned_sort::TwoLayerRMI<double> rmi(p);
+  ASSERT_TRUE(rmi.train(arr.begin(), arr.end()));
+
+  // Test that the sampling stopped well before the maximum sample size
+  ASSERT_LT(rmi.training_sample.size(), arr.size() / 4);
+  ASSERT_TRUE(std::is_sorted(rmi.training_sample.begin(),
+                             rmi.training_sample.end()));
+}
+
+TEST(SAMPLING_TEST, ProgressiveSamplingSorts) {
+  for (auto arr : {mix_of_gauss_distr<double>(TEST_SIZE),
+                   lognormal_distr<double>(TEST_SIZE),
+                   root_dups_distr<double>(TEST_SIZE)}) {
+    auto cksm = get_checksum(arr);
+
+    learned_sort::TwoLayerRMI<double>::Params p;
+    p.progressive_sampling = true;
+    learned_sort::sort(arr.begin(), arr.end(), p);
+
+    ASSERT_EQ(cksm, get_checksum(arr));
+    ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  }
+}
@@ -0,0 +1,135 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+// Returns the number of buckets in a histogram of bucket sizes
+static long num_buckets(const long *hist) {
+  return std::accumulate(
+      hist, hist + learned_sort::sort_stats::NUM_HISTOGRAM_BINS, 0L);
+}
+
+TEST(SORT_STATS_TEST, HistogramBins) {
+  typedef learned_sort::sort_stats stats;
+  ASSERT_EQ(0, stats::histogram_bin(0));
+  ASSERT_EQ(1, stats::histogram_bin(1));
+  ASSERT_EQ(2, stats::histogram_bin(2));
+  ASSERT_EQ(2, stats::histogram_bin(3));
+  ASSERT_EQ(11, stats::histogram_bin(1024));
+  ASSERT_EQ(stats::NUM_HISTOGRAM_BINS - 1, stats::histogram_bin(1L << 62));
+}
+
+TEST(SORT_STATS_TEST, PhasesOfASort) {
+  // The inputs must be large enough to be sorted with a model
+  auto arr = normal_distr<double>(std::max<size_t>(TEST_SIZE, 500'000));
+  auto cksm = get_checksum(arr);
+
+  learned_sort::sort_stats stats;
+  {
+    learned_sort::collect_stats collect(stats);
+    learned_sort::sort(arr.begin(), arr.end());
+  }
+  ASSERT_EQ(cksm, get_checksum(arr));
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+  ASSERT_GT(stats.total_ms, 0);
+
+  // Test that the phases do not overlap
+  double phases_ms = 0;
+  for (int phase = 0; phase < learned_sort::sort_stats::NUM_PHASES; ++phase) {
+    phases_ms += stats.phase_ms[phase];
+  }
+  ASSERT_LE(phases_ms, stats.total_ms);
+
+  if constexpr (learned_sort::sort_stats::ENABLED) {
+    // Test that every phase of the sort is timed, and that every bucket is
+    // counted in the histograms
+    for (auto phase : {learned_sort::sort_phase::SAMPLING,
+                       learned_sort::sort_phase::TRAINING,
+                       learned_sort::sort_phase::PRIMARY_PARTITION,
+                       learned_sort::sort_phase::DEFRAGMENTATION,
+                       learned_sort::sort_phase::SECONDARY_PARTITION,
+                       learned_sort::sort_phase::COUNTING_SORT,
+                       learned_sort::sort_phase::TOUCH_UP}) {
+      ASSERT_GT(stats.phase_ms[static_cast<int>(phase)], 0);
+    }
+    ASSERT_GT(num_buckets(stats.primary_bucket_hist), 0);
+    ASSERT_GT(num_buckets(stats.secondary_bucket_hist),
+              num_buckets(stats.primary_bucket_hist));
+    ASSERT_GT(stats.fragments_swapped, 0);
+    ASSERT_GT(stats.touch_up_moves, 0);
+  } else {
+    // Test that nothing but the total time is collected
+    ASSERT_EQ(0, phases_ms);
+    ASSERT_EQ(0, num_buckets(stats.primary_bucket_hist));
+    ASSERT_EQ(0, stats.touch_up_moves);
+  }
+
+  // Test that the statistics print
+  ostringstream os;
+  stats.print(os);
+  ASSERT_NE(string::npos, os.str().find("touch_up_ms"));
+}
+
+TEST(SORT_STATS_TEST, HomogeneousBucketsSkipped) {
+  // Repeat every key 64 times, which fills whole secondary buckets with equal
+  // keys without making any of them heavy. The input size is fixed so that the
+  // sample has enough duplicates to enable their detection.
+  vector<unsigned> arr(1'000'000);
+  for (size_t i = 0; i < arr.size(); ++i) {
+    arr[i] = i / 64;
+  }
+  std::shuffle(arr.begin(), arr.end(), std::mt19937(42));
+
+  learned_sort::sort_stats stats;
+  {
+    learned_sort::collect_stats collect(stats);
+    learned_sort::sort(arr.begin(), arr.end());
+  }
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+
+  if constexpr (learned_sort::sort_stats::ENABLED) {
+    ASSERT_GT(stats.homogeneous_buckets_skipped, 0);
+  } else {
+    ASSERT_EQ(0, stats.homogeneous_buckets_skipped);
+  }
+}
+
+TEST(SORT_STATS_TEST, OnlyCollectedInScope) {
+  auto arr = normal_distr<double>(std::max<size_t>(TEST_SIZE, 500'000));
+  learned_sort::sort_stats stats;
+  {
+    learned_sort::collect_stats collect(stats);
+  }
+
+  // Test that a sort outside of the scope leaves the statistics alone
+  learned_sort::sort(arr.begin(), arr.end());
+  ASSERT_EQ(0, stats.phase_ms[static_cast<int>(
+                   learned_sort::sort_phase::TRAINING)]);
+  ASSERT_EQ(0, num_buckets(stats.secondary_bucket_hist));
+}
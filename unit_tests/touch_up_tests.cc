@@ -0,0 +1,120 @@
+/**
+ * @author Ani Kristo (anikristo@gmail.com)
+ *
+ * @copyright Copyright (c) 2021 Ani Kristo (anikristo@gmail.com)
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "../include/learned_sort.h"
+#include "../src/utils.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+
+extern size_t TEST_SIZE;
+
+// Generates keys in a thousand narrow clusters that are spread over the whole
+// range of unsigned long, where the model cannot tell the keys of a cluster
+// apart
+vector<unsigned long> clustered_keys(size_t size) {
+  std::mt19937_64 gen(42);
+  std::normal_distribution<double> distr(0, 1);
+  vector<unsigned long> centers(1000);
+  for (auto &center : centers) {
+    center = gen();
+  }
+
+  vector<unsigned long> arr(size);
+  for (auto &key : arr) {
+    key = centers[gen() % centers.size()] + (long)(distr(gen) * 1e8);
+  }
+  return arr;
+}
+
+TEST(TOUCH_UP_TEST, BoundedInsertionSortWithinBudget) {
+  // Generate sorted keys and displace some of them by a few positions
+  auto arr = sorted_uniform_distr<double>(10'000);
+  for (size_t i = 0; i + 8 < arr.size(); i += 100) {
+    std::swap(arr[i], arr[i + 8]);
+  }
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  ASSERT_TRUE(learned_sort::utils::bounded_insertion_sort(
+      arr.begin(), arr.end(), 16, arr.size()));
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(TOUCH_UP_TEST, BoundedInsertionSortOverBudget) {
+  for (long max_displacement : {100, 100'000}) {
+    // Generate keys in descending order
+    auto arr = reverse_sorted_uniform_distr<double>(10'000);
+
+    // Calculate the checksum
+    auto cksm = get_checksum(arr);
+
+    // Try to sort with too small a budget of displacement or moves
+    ASSERT_FALSE(learned_sort::utils::bounded_insertion_sort(
+        arr.begin(), arr.end(), max_displacement, 10 * arr.size()));
+
+    // Test that the keys were not lost
+    ASSERT_EQ(cksm, get_checksum(arr));
+  }
+}
+
+TEST(TOUCH_UP_TEST, ClusteredUnsignedLong) {
+  // Generate random input
+  auto arr = clustered_keys(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::sort(arr.begin(), arr.end());
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}
+
+TEST(TOUCH_UP_TEST, ParallelClusteredUnsignedLong) {
+  // Generate random input
+  auto arr = clustered_keys(TEST_SIZE);
+
+  // Calculate the checksum
+  auto cksm = get_checksum(arr);
+
+  // Sort
+  learned_sort::TwoLayerRMI<unsigned long>::Params p;
+  p.num_threads = 4;
+  learned_sort::parallel::sort(arr.begin(), arr.end(), p);
+
+  // Test that the checksum is the same
+  ASSERT_EQ(cksm, get_checksum(arr));
+
+  // Test that it is sorted
+  ASSERT_TRUE(std::is_sorted(arr.begin(), arr.end()));
+}